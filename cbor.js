@@ -0,0 +1,104 @@
+// Minimal CBOR (RFC 8949) decoder for the documents parse.cpp writes with
+// --format cbor: integers, floats, text/byte strings, arrays, maps and
+// true/false/null. Definite lengths only (that is all json.hpp emits).
+function decodeCbor(buffer) {
+    const bytes = new Uint8Array(buffer);
+    const view = new DataView(bytes.buffer, bytes.byteOffset, bytes.byteLength);
+    const utf8 = new TextDecoder();
+    let offset = 0;
+
+    function readLength(info) {
+        if (info < 24) return info;
+        let value;
+        switch (info) {
+            case 24: value = view.getUint8(offset); offset += 1; return value;
+            case 25: value = view.getUint16(offset); offset += 2; return value;
+            case 26: value = view.getUint32(offset); offset += 4; return value;
+            case 27: value = Number(view.getBigUint64(offset)); offset += 8; return value;
+        }
+        throw new Error('Unsupported CBOR length at byte ' + offset);
+    }
+
+    // Node labels and keys repeat heavily, so short strings are looked up in
+    // a cache keyed by a hash of their bytes; a hit is verified byte by byte,
+    // which is cheaper than building the string again.
+    const cache = new Map();
+
+    function readText(length) {
+        const start = offset;
+        const end = offset + length;
+        offset = end;
+        if (length > 48) return utf8.decode(bytes.subarray(start, end));
+        let hash = length;
+        for (let i = start; i < end; i++) hash = (Math.imul(hash, 31) + bytes[i]) | 0;
+        const cached = cache.get(hash);
+        if (cached !== undefined && cached.length === length) {
+            let same = true;
+            for (let i = 0; i < length; i++) {
+                if (cached.charCodeAt(i) !== bytes[start + i]) { same = false; break; }
+            }
+            if (same) return cached;
+        }
+        const text = utf8.decode(bytes.subarray(start, end));
+        cache.set(hash, text);
+        return text;
+    }
+
+    function readHalf() {
+        const half = view.getUint16(offset);
+        offset += 2;
+        const exponent = (half >> 10) & 0x1f;
+        const mantissa = half & 0x3ff;
+        const sign = half & 0x8000 ? -1 : 1;
+        if (exponent === 0) return sign * mantissa * 2 ** -24;
+        if (exponent === 31) return mantissa ? NaN : sign * Infinity;
+        return sign * (1024 + mantissa) * 2 ** (exponent - 25);
+    }
+
+    function readItem() {
+        const initial = bytes[offset++];
+        const major = initial >> 5;
+        const info = initial & 0x1f;
+        switch (major) {
+            case 0: return readLength(info);
+            case 1: return -1 - readLength(info);
+            case 2: {
+                const length = readLength(info);
+                const value = bytes.slice(offset, offset + length);
+                offset += length;
+                return value;
+            }
+            case 3: return readText(readLength(info));
+            case 4: {
+                const length = readLength(info);
+                const array = new Array(length);
+                for (let i = 0; i < length; i++) array[i] = readItem();
+                return array;
+            }
+            case 5: {
+                const length = readLength(info);
+                const object = {};
+                for (let i = 0; i < length; i++) {
+                    const key = readItem();
+                    object[key] = readItem();
+                }
+                return object;
+            }
+            case 7: {
+                let value;
+                switch (info) {
+                    case 20: return false;
+                    case 21: return true;
+                    case 22: return null;
+                    case 23: return undefined;
+                    case 25: return readHalf();
+                    case 26: value = view.getFloat32(offset); offset += 4; return value;
+                    case 27: value = view.getFloat64(offset); offset += 8; return value;
+                }
+            }
+        }
+        throw new Error('Unsupported CBOR item 0x' + initial.toString(16) + ' at byte ' + (offset - 1));
+    }
+
+    return readItem();
+}
@@ -6,809 +6,5722 @@
 #include<bits/stdc++.h>
 #include <stdexcept>
 #include <unordered_map>
+#include <coroutine>
 #include "json.hpp"
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#endif
+#endif
+
 using json = nlohmann::json;
 using namespace std;
 
-struct Token
+// --- Cancellation ---
+// A CancelToken is shared between the thread doing a run and whoever may
+// abandon it (the daemon, when a client sends "cancel"). The run polls it at
+// cheap intervals and unwinds with Cancelled once it has fired.
+
+struct Cancelled : runtime_error
 {
-    string type;
-    string value;
+    Cancelled() : runtime_error("Cancelled") {}
 };
 
-// Tokenize the code .... 
-// This function breaks a C++-like code string into tokens 
-// (like keywords, identifiers, numbers, etc.) using regular expressions. 
-// This is part of the lexical analysis phase of a compiler.
+class CancelToken
+{
+    atomic<bool> fired{false};
 
-// Loop over each character in the input string code:
-// Skip whitespace.
+public:
+    void cancel() { fired.store(true, memory_order_relaxed); }
+    bool cancelled() const { return fired.load(memory_order_relaxed); }
+    void check() const
+    {
+        if (cancelled())
+            throw Cancelled();
+    }
+};
+
+// Polls token every 1024th call; step is any counter the caller advances.
+inline void pollCancel(const CancelToken *token, size_t step)
+{
+    if (token && (step & 1023) == 0)
+        token->check();
+}
 
-// Try each regex pattern in order to match a token from the current position.
-// If a regex matches from the current character (it), it's a valid token.
+// --- Resource Limits ---
+// Caps on what one run may consume, so a pathological input fails with a
+// clear LimitExceeded error instead of exhausting memory or stack for
+// everyone sharing the process. Each cap is checked while the work grows:
+// tokens in tokenize(), nodes and nesting in Parser, trace events in
+// simulateProgram() and call depth in simulateExecution(). 0 disables a cap.
+// syntaxErrors is the exception: past it the parser stops early and keeps
+// the tree and errors it has rather than failing the run.
 
-// If nothing matches, throw an error (Unrecognized token).
+struct LimitExceeded : runtime_error
+{
+    using runtime_error::runtime_error;
+};
 
-// Return the full list of tokens.
+struct Limits
+{
+    size_t inputBytes = 64 << 20;    // source text per file / request
+    size_t tokens = 8'000'000;
+    size_t nodes = 8'000'000;
+    size_t depth = 1000;             // statement / expression nesting, and simulated call depth
+    size_t exprDepth = 10'000;       // operators folded into one left-nested Expr chain
+    size_t traceEvents = 1'000'000;
+    size_t outputBytes = 256 << 20;  // one encoded --pipe document / daemon response
+    size_t queue = 64;               // daemon: requests waiting before new ones are shed
+    size_t syntaxErrors = 100;       // diagnostics collected before the parser stops
+};
 
-vector<Token> tokenize(const string &code)
+[[noreturn]] void limitExceeded(const char *what, size_t limit)
 {
-    vector<Token> tokens;
-    vector<regex> token_patterns = {
-        regex("#[a-zA-Z_]+[^\n]*"), // Preprocessor directive
-        regex("\\bint\\b"),
-        regex("\\bvoid\\b"),
-        regex("\\bfloat\\b"),
-        regex("\\breturn\\b"),
-        regex("\\bif\\b"),
-        regex("\\belse\\b"),
-        regex("\\bwhile\\b"),
-        regex("\\bcout\\b"),
-        regex("\\bcin\\b"),
-        regex("\"[^\"]*\""), // string literal
-        regex("<<|>>"),
-        regex("==|!=|<=|>=|<|>"),
-        regex("[a-zA-Z_][a-zA-Z0-9_]*"),
-        regex("[0-9]+"),
-        regex("[(){};,=+*/-<>%.]")};
-
-    string::const_iterator it = code.begin();
-    while (it != code.end())
-    {
-        if (isspace(*it))
-        {
-            ++it;
-            continue;
+    throw LimitExceeded(string(what) + " (limit " + to_string(limit) + ")");
+}
+
+// Kept tiny so the checks inline into hot loops; the throw stays out of line.
+inline void checkLimit(size_t value, size_t limit, const char *what)
+{
+    if (limit && value > limit)
+        limitExceeded(what, limit);
+}
+
+// --- String Interning ---
+// Every distinct identifier / literal text is stored once per session and
+// referred to by a 32-bit id. Tokens, nodes, the symbol table, the simulator
+// and the trace all carry ids; text is only materialized when writing output.
+
+using Symbol = uint32_t;
+
+// Spellings interned first in every session, so their ids are fixed.
+// Keywords come first: a token is a keyword iff its id <= SymCin.
+enum PresetSymbol : Symbol
+{
+    SymInt,
+    SymVoid,
+    SymFloat,
+    SymString,
+    SymReturn,
+    SymIf,
+    SymElse,
+    SymWhile,
+    SymCout,
+    SymCin,
+    SymGlobal,
+    SymMain,
+    SymUsing,
+    SymNamespace,
+    SymEmptyString, // the literal "", a string variable's initial value
+    PresetSymbolCount
+};
+
+constexpr string_view presetSymbolText[PresetSymbolCount] = {
+    "int", "void", "float", "string", "return", "if", "else", "while", "cout", "cin",
+    "global", "main", "using", "namespace", "\"\""};
+
+class Interner
+{
+    unordered_map<string_view, Symbol> ids;
+    deque<string> texts; // deque never moves its elements, so the views in ids stay valid
+
+public:
+    Interner()
+    {
+        for (string_view text : presetSymbolText)
+            intern(text);
+    }
+
+    Symbol intern(string_view text)
+    {
+        auto it = ids.find(text);
+        if (it != ids.end())
+            return it->second;
+        Symbol id = static_cast<Symbol>(texts.size());
+        texts.emplace_back(text);
+        ids.emplace(texts.back(), id);
+        return id;
+    }
+
+    const string &text(Symbol id) const { return texts[id]; }
+    size_t size() const { return texts.size(); }
+};
+
+// --- Keywords ---
+// What it does:
+// Recognizes keywords with a perfect hash built at compile time from their
+// spellings in presetSymbolText, the only list of them: a multiplier is
+// searched for that sends the (length, first byte, last byte) key of every
+// keyword to its own slot of a 32-entry table. Looking an identifier up is
+// one multiply, one table load and one short compare, with no interning.
+
+constexpr Symbol NotKeyword = PresetSymbolCount;
+constexpr size_t keywordSlots = 32;
+
+constexpr uint32_t keywordSlot(string_view text, uint32_t seed)
+{
+    uint32_t key = static_cast<uint32_t>(text.size()) << 16 |
+                   static_cast<uint32_t>(static_cast<unsigned char>(text.front())) << 8 |
+                   static_cast<unsigned char>(text.back());
+    return (key * seed) >> 27; // top 5 bits: 0..31
+}
+
+struct KeywordTable
+{
+    uint32_t seed = 0;
+    size_t maxLength = 0;
+    array<uint8_t, keywordSlots> slots{}; // keyword symbol + 1; 0 = empty
+};
+
+constexpr KeywordTable buildKeywordTable()
+{
+    for (uint32_t seed = 1; seed < (1u << 20); seed += 2)
+    {
+        KeywordTable table;
+        table.seed = seed;
+        bool perfect = true;
+        for (Symbol keyword = 0; keyword <= SymCin && perfect; ++keyword)
+        {
+            uint8_t &slot = table.slots[keywordSlot(presetSymbolText[keyword], seed)];
+            perfect = slot == 0;
+            slot = static_cast<uint8_t>(keyword + 1);
+            table.maxLength = max(table.maxLength, presetSymbolText[keyword].size());
         }
-        bool matched = false;
-        for (const auto &pat : token_patterns)
-        {
-            smatch match;
-            if (regex_search(it, code.cend(), match, pat, regex_constants::match_continuous))
-            {
-                string val = match.str();
-                string type;
-                if (val == "int" || val == "void" || val == "float" || val == "return" || val == "if" || val == "else" || val == "while" || val == "cout" || val == "cin" || val == "string")
-                    type = "keyword";
-                else if (regex_match(val, regex("#[a-zA-Z_]+[^\n]*")))
-                    type = "preprocessor";
-                else if (regex_match(val, regex("\"[^\"]*\"")))
-                    type = "string";
-                else if (regex_match(val, regex("[0-9]+")))
-                    type = "number";
-                else if (regex_match(val, regex("[(){};,=+*/-<>%]")) ||
-                         val == "==" || val == "!=" || val == "<=" || val == ">=" || val == "<" || val == ">" ||
-                         val == "<<" || val == ">>")
-                    type = "symbol";
-                else
-                    type = "identifier";
-                tokens.push_back({type, val});
-                it += val.length();
-                matched = true;
-                break;
-            }
+        if (perfect)
+            return table;
+    }
+    return {};
+}
+
+constexpr KeywordTable keywordTable = buildKeywordTable();
+static_assert(keywordTable.seed != 0, "no perfect hash found for the keywords");
+
+// The keyword's symbol (<= SymCin), or NotKeyword.
+constexpr Symbol keywordSymbol(string_view text)
+{
+    if (text.empty() || text.size() > keywordTable.maxLength)
+        return NotKeyword;
+    Symbol keyword = keywordTable.slots[keywordSlot(text, keywordTable.seed)];
+    return keyword != 0 && presetSymbolText[keyword - 1] == text ? keyword - 1 : NotKeyword;
+}
+
+// int, void, float and string: the keywords that start a declaration.
+constexpr bool isTypeKeyword(Symbol keyword) { return keyword <= SymString; }
+
+static_assert(keywordSymbol("while") == SymWhile && keywordSymbol("cin") == SymCin &&
+              keywordSymbol("whilst") == NotKeyword && keywordSymbol("main") == NotKeyword);
+
+// Token kinds
+// Every symbol the lexer recognizes gets its own kind so the parser can look
+// operators up in a table instead of comparing strings.
+enum class TokenKind : uint8_t
+{
+    Preprocessor,
+    Keyword,
+    Identifier,
+    Number,
+    String,
+    LParen,
+    RParen,
+    LBrace,
+    RBrace,
+    Semicolon,
+    Comma,
+    Dot,
+    Assign,
+    Plus,
+    Minus,
+    Star,
+    Slash,
+    Percent,
+    Equal,
+    NotEqual,
+    Less,
+    Greater,
+    LessEqual,
+    GreaterEqual,
+    ShiftLeft,
+    ShiftRight,
+    OtherSymbol,
+    Count
+};
+
+// Fixed spelling of each symbol kind (empty for kinds whose text is interned).
+const char *const tokenSpelling[static_cast<size_t>(TokenKind::Count)] = {
+    "", "", "", "", "",
+    "(", ")", "{", "}", ";", ",", ".", "=",
+    "+", "-", "*", "/", "%",
+    "==", "!=", "<", ">", "<=", ">=", "<<", ">>",
+    "?"};
+
+// A token is its kind plus, for keywords, identifiers and literals, the
+// interned id of its text, and the byte range it was scanned from.
+struct Token
+{
+    TokenKind kind;
+    Symbol sym;
+    uint32_t offset = 0;
+    uint32_t length = 0;
+};
+
+// A scanned token before interning: its kind and its text in the source.
+struct Lexeme
+{
+    TokenKind kind;
+    string_view text;
+};
+
+string tokenText(const Token &token, const Interner &strings)
+{
+    if (token.kind <= TokenKind::String)
+        return strings.text(token.sym);
+    return tokenSpelling[static_cast<size_t>(token.kind)];
+}
+
+// Map a symbol lexeme to its kind (switch on length + first byte).
+TokenKind symbolKind(string_view val)
+{
+    if (val.size() == 2)
+    {
+        switch (val[0])
+        {
+        case '=': return TokenKind::Equal;
+        case '!': return TokenKind::NotEqual;
+        case '<': return val[1] == '<' ? TokenKind::ShiftLeft : TokenKind::LessEqual;
+        case '>': return val[1] == '>' ? TokenKind::ShiftRight : TokenKind::GreaterEqual;
         }
-        if (!matched)
-            throw runtime_error("Unrecognized token: " + string(it, it + 1));
+        return TokenKind::OtherSymbol;
     }
-    return tokens;
+    switch (val[0])
+    {
+    case '(': return TokenKind::LParen;
+    case ')': return TokenKind::RParen;
+    case '{': return TokenKind::LBrace;
+    case '}': return TokenKind::RBrace;
+    case ';': return TokenKind::Semicolon;
+    case ',': return TokenKind::Comma;
+    case '.': return TokenKind::Dot;
+    case '=': return TokenKind::Assign;
+    case '+': return TokenKind::Plus;
+    case '-': return TokenKind::Minus;
+    case '*': return TokenKind::Star;
+    case '/': return TokenKind::Slash;
+    case '%': return TokenKind::Percent;
+    case '<': return TokenKind::Less;
+    case '>': return TokenKind::Greater;
+    }
+    return TokenKind::OtherSymbol;
 }
 
+// --- Character Classes ---
+// What it does:
+// The lexer's inner loops: find the end of a whitespace run, an identifier
+// or a digit run, or the next occurrence of one byte (a closing quote, the
+// end of a preprocessor line or comment). Each comes in a scalar version and in SSE2 /
+// AVX2 versions that classify 16 / 32 bytes per step with byte compares and
+// a movemask, finishing the last partial block with the scalar loop. The
+// widest set the CPU supports is picked once at startup; --simd overrides
+// it (e.g. to compare them).
 
-// This is a recursive-descent parser that:
-// Parses a C++-like source code from a list of tokens
-// Builds a tree structure (Node) for each part (functions, statements, etc.)
-// Builds a symbol table for variables/functions with scope
-// Generates an AST (Abstract Syntax Tree) rooted at "Program"
+inline bool isSpaceChar(unsigned char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+inline bool isDigitChar(unsigned char c) { return c >= '0' && c <= '9'; }
+inline bool isWordStart(unsigned char c) { return c == '_' || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z'); }
+inline bool isWordChar(unsigned char c) { return isWordStart(c) || isDigitChar(c); }
 
+struct CharKernels
+{
+    const char *name;
+    const char *(*skipSpace)(const char *it, const char *end);
+    const char *(*skipWord)(const char *it, const char *end); // [A-Za-z0-9_]
+    const char *(*skipDigits)(const char *it, const char *end);
+    const char *(*find)(const char *it, const char *end, char byte); // end if absent
+};
 
+template <bool (*Match)(unsigned char)>
+const char *skipScalar(const char *it, const char *end)
+{
+    while (it < end && Match(static_cast<unsigned char>(*it)))
+        ++it;
+    return it;
+}
 
-// Tree Node
-struct Node
+const char *findScalar(const char *it, const char *end, char byte)
 {
-    string label;
-    vector<Node> children;
+    while (it < end && *it != byte)
+        ++it;
+    return it;
+}
+
+const CharKernels scalarKernels = {
+    "scalar", skipScalar<isSpaceChar>, skipScalar<isWordChar>, skipScalar<isDigitChar>, findScalar};
+
+#if defined(__GNUC__) && defined(__x86_64__)
+// Each class matches bytes with signed compares; bytes >= 0x80 are negative
+// and never match.
+
+struct SpaceClass
+{
+    static constexpr auto scalar = isSpaceChar;
+    static __m128i sse2(__m128i v)
+    {
+        __m128i control = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('\t' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('\r' + 1)));
+        return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), control);
+    }
+    __attribute__((target("avx2"))) static __m256i avx2(__m256i v)
+    {
+        __m256i control = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('\t' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), v));
+        return _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), control);
+    }
 };
 
-vector<Node> allFunctions; // For trace generation
-vector<json> trace;        // The execution trace
+struct DigitClass
+{
+    static constexpr auto scalar = isDigitChar;
+    static __m128i sse2(__m128i v)
+    {
+        return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+    }
+    __attribute__((target("avx2"))) static __m256i avx2(__m256i v)
+    {
+        return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+    }
+};
 
-// Symbol Table Entry
-struct SymbolEntry
+// Letters are matched case-insensitively by setting bit 5 first.
+struct WordClass
 {
-    string name;
-    string type;
-    string scope;
-    int value;
-    bool hasValue;
+    static constexpr auto scalar = isWordChar;
+    static __m128i sse2(__m128i v)
+    {
+        __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+        return _mm_or_si128(_mm_or_si128(letter, DigitClass::sse2(v)), _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+    }
+    __attribute__((target("avx2"))) static __m256i avx2(__m256i v)
+    {
+        __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        __m256i letter = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+        return _mm256_or_si256(_mm256_or_si256(letter, DigitClass::avx2(v)), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+    }
 };
 
-vector<SymbolEntry> symbolTable;
+// Most runs are a few bytes long: settle those one byte at a time before
+// paying for a block load.
+template <typename Class>
+const char *skipPrefix(const char *it, const char *end)
+{
+    for (const char *prefix = it + min<ptrdiff_t>(8, end - it); it < prefix; ++it)
+        if (!Class::scalar(static_cast<unsigned char>(*it)))
+            return it;
+    return nullptr;
+}
 
-// Add this line before the Parser class definition:
-int evalExpr(const Node &expr, std::unordered_map<std::string, int> &vars);
+template <typename Class>
+const char *skipSse2(const char *it, const char *end)
+{
+    if (const char *found = skipPrefix<Class>(it, end))
+        return found;
+    it += min<ptrdiff_t>(8, end - it);
+    for (; end - it >= 16; it += 16)
+    {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(it));
+        unsigned miss = ~static_cast<unsigned>(_mm_movemask_epi8(Class::sse2(block))) & 0xFFFF;
+        if (miss)
+            return it + __builtin_ctz(miss);
+    }
+    return skipScalar<Class::scalar>(it, end);
+}
 
-class Parser
+template <typename Class>
+__attribute__((target("avx2"))) const char *skipAvx2(const char *it, const char *end)
 {
-    vector<Token> tokens;
-    size_t pos = 0;
-    string currentScope = "global";
+    if (const char *found = skipPrefix<Class>(it, end))
+        return found;
+    it += min<ptrdiff_t>(8, end - it);
+    for (; end - it >= 32; it += 32)
+    {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(it));
+        unsigned miss = ~static_cast<unsigned>(_mm256_movemask_epi8(Class::avx2(block)));
+        if (miss)
+            return it + __builtin_ctz(miss);
+    }
+    return skipSse2<Class>(it, end);
+}
 
-    // ✅ Token peek()
-    // Purpose: Look at the current token without moving forward in the token stream.
-    // Returns: The token at tokens[pos].
-    // Throws: Error if we’ve reached the end of tokens.
-    // Use case: Just checking what's next, without consuming it.
+const char *findSse2(const char *it, const char *end, char byte)
+{
+    __m128i needle = _mm_set1_epi8(byte);
+    for (; end - it >= 16; it += 16)
+    {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(it));
+        unsigned hit = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle)));
+        if (hit)
+            return it + __builtin_ctz(hit);
+    }
+    return findScalar(it, end, byte);
+}
 
-    Token peek()
+__attribute__((target("avx2"))) const char *findAvx2(const char *it, const char *end, char byte)
+{
+    __m256i needle = _mm256_set1_epi8(byte);
+    for (; end - it >= 32; it += 32)
     {
-        if (pos < tokens.size())
-            return tokens[pos];
-        throw runtime_error("Unexpected end of input");
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(it));
+        unsigned hit = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle)));
+        if (hit)
+            return it + __builtin_ctz(hit);
     }
+    return findSse2(it, end, byte);
+}
 
-    // ✅ Token advance()
-    // Purpose: Return the current token and then move to the next one.
-    // Returns: The token at tokens[pos], then increments pos.
-    // Throws: Error if there are no more tokens.
-    // Use case: When you are ready to consume a token.
+const CharKernels sse2Kernels = {
+    "sse2", skipSse2<SpaceClass>, skipSse2<WordClass>, skipSse2<DigitClass>, findSse2};
+const CharKernels avx2Kernels = {
+    "avx2", skipAvx2<SpaceClass>, skipAvx2<WordClass>, skipAvx2<DigitClass>, findAvx2};
+#endif
 
+// The kernels for `name` ("scalar", "sse2", "avx2"; "" = the best this CPU
+// has), or nullptr if this build or CPU lacks them.
+const CharKernels *findCharKernels(string_view name)
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+    bool avx2 = __builtin_cpu_supports("avx2");
+    if (name.empty())
+        return avx2 ? &avx2Kernels : &sse2Kernels;
+    if (name == "sse2")
+        return &sse2Kernels;
+    if (name == "avx2")
+        return avx2 ? &avx2Kernels : nullptr;
+#else
+    if (name.empty())
+        return &scalarKernels;
+#endif
+    return name == "scalar" ? &scalarKernels : nullptr;
+}
 
-    Token advance()
+const CharKernels *charKernels = findCharKernels("");
+
+// --- Source Spans ---
+// What it does:
+// Tokens and nodes remember where they came from as a byte offset and
+// length into the source (8 bytes per node; tokens carry the same pair,
+// filled in by the lexer for free). Line and column are not tracked
+// while lexing: LineIndex finds the line starts with the newline kernel the
+// first time a position is asked for, then answers each one with a binary
+// search.
+
+struct Span
+{
+    uint32_t offset = 0;
+    uint32_t length = 0;
+};
+
+inline Span tokenSpan(const Token &token) { return {token.offset, token.length}; }
+
+// A lexer or parser error at a place in the source.
+struct SyntaxError : runtime_error
+{
+    Span span;
+    SyntaxError(const string &message, Span span) : runtime_error(message), span(span) {}
+};
+
+class LineIndex
+{
+    string_view text;
+    mutable once_flag built;
+    mutable vector<uint32_t> lineStarts;
+
+public:
+    explicit LineIndex(string_view text) : text(text) {}
+
+    // 1-based line and column (in bytes) of a byte offset.
+    pair<uint32_t, uint32_t> locate(uint32_t offset) const
     {
-        if (pos < tokens.size())
-            return tokens[pos++];
-        throw runtime_error("Unexpected end of input");
+        call_once(built, [this]
+                  {
+                      const char *end = text.data() + text.size();
+                      lineStarts.push_back(0);
+                      for (const char *it = text.data(); (it = charKernels->find(it, end, '\n')) < end; ++it)
+                          lineStarts.push_back(static_cast<uint32_t>(it + 1 - text.data())); });
+        size_t line = static_cast<size_t>(upper_bound(lineStarts.begin(), lineStarts.end(), offset) - lineStarts.begin());
+        return {static_cast<uint32_t>(line), offset - lineStarts[line - 1] + 1};
     }
 
-    ✅ bool match(const string &val)
-    // Purpose: Check if the current token's value matches val.
-    // If matched:
-    // Moves forward (++pos)
-    // Returns true
-    // Else: Returns false
-    // Use case: For checking specific symbols like "(", ";", etc.
+    // " at line L, column C", for error messages.
+    string describe(uint32_t offset) const
+    {
+        auto [line, column] = locate(offset);
+        return " at line " + to_string(line) + ", column " + to_string(column);
+    }
+};
+
+// Tokenize the code ....
+// This function breaks a C++-like code string into tokens
+// (like keywords, identifiers, numbers, etc.).
+// This is part of the lexical analysis phase of a compiler.
+
+// Loop over each character in the input string code:
+// Skip whitespace and comments (// to the end of the line, /* to */).
+
+// The first byte decides what the token can be; the matching kernel from
+// charKernels finds where it ends (identifier, number, string literal,
+// preprocessor line), and operators are one or two bytes. Comments are
+// skipped with the same kernels: find() jumps to the newline ending a //
+// comment, or from '*' to '*' until one is followed by '/'.
+
+// If nothing matches, throw an error (Unrecognized token).
 
+// scanTokens() does the matching and hands each lexeme to emit(kind, text);
+// identifier-like lexemes come out as Identifier (makeToken tells keywords
+// apart once they are interned). The code is lexed in place (it can point
+// straight into a mapped file).
+
+// tokenize() interns identifier-like and literal lexemes into `strings`,
+// once, and returns the full list of tokens.
+
+// Scanning starts at code[from]; only tokens that start before code[stopAt]
+// are scanned (one may run past it). Returns where scanning stopped. Errors
+// are SyntaxErrors with offsets into code.
+
+// The end of the block comment that opens at `open` (its "/*").
+inline const char *skipBlockComment(const CharKernels &kernels, const char *open, string_view code)
+{
+    const char *end = code.data() + code.size();
+    for (const char *it = kernels.find(open + 2, end, '*'); it < end; it = kernels.find(it + 1, end, '*'))
+        if (it + 1 < end && it[1] == '/')
+            return it + 2;
+    throw SyntaxError("Unterminated comment", {static_cast<uint32_t>(open - code.data()), 2});
+}
 
-    bool match(const string &val)
+// Skips whitespace and comments up to the next token, or to stop; a comment
+// that starts before stop is skipped whole, even if it runs past stop.
+inline const char *skipBlank(const CharKernels &kernels, const char *it, const char *stop, string_view code)
+{
+    const char *end = code.data() + code.size();
+    while (it < stop && (it = kernels.skipSpace(it, stop)) < stop && *it == '/' && it + 1 < end)
     {
-        if (pos < tokens.size() && tokens[pos].value == val)
-        {
-            ++pos;
-            return true;
-        }
-        return false;
+        if (it[1] == '/')
+            it = kernels.find(it + 2, end, '\n');
+        else if (it[1] == '*')
+            it = skipBlockComment(kernels, it, code);
+        else
+            break;
     }
-    bool matchType(const string &type)
+    return it;
+}
+
+template <typename Emit>
+const char *scanTokens(string_view code, Emit &&emit, size_t from = 0, size_t stopAt = string_view::npos)
+{
+    const CharKernels &kernels = *charKernels;
+    const char *it = code.data() + from;
+    const char *end = code.data() + code.size();
+    const char *stop = code.data() + min(stopAt, code.size());
+    auto error = [&](const string &message)
+    { return SyntaxError(message, {static_cast<uint32_t>(it - code.data()), 1}); };
+    while ((it = skipBlank(kernels, it, stop, code)) < stop)
     {
-        if (pos < tokens.size() && tokens[pos].type == type)
+        const char *start = it;
+        unsigned char c = static_cast<unsigned char>(*it);
+        char next = it + 1 < end ? it[1] : '\0';
+        TokenKind kind = TokenKind::OtherSymbol;
+        if (c == '#' && isWordStart(static_cast<unsigned char>(next)))
         {
-            ++pos;
-            return true;
+            // Preprocessor directive: the rest of the line, up to a comment
+            kind = TokenKind::Preprocessor;
+            const char *newline = kernels.find(it + 1, end, '\n');
+            for (it = kernels.find(it + 1, newline, '/'); it + 1 < newline && it[1] != '/' && it[1] != '*';)
+                it = kernels.find(it + 1, newline, '/');
+            if (it + 1 >= newline)
+                it = newline;
+            else
+                while (isSpaceChar(static_cast<unsigned char>(it[-1])))
+                    --it;
         }
-        return false;
+        else if (isWordStart(c))
+        {
+            kind = TokenKind::Identifier;
+            it = kernels.skipWord(it + 1, end);
+        }
+        else if (isDigitChar(c))
+        {
+            // Digits, then a fraction (.5) and an exponent (e-3) if digits follow
+            kind = TokenKind::Number;
+            it = kernels.skipDigits(it + 1, end);
+            if (it + 1 < end && *it == '.' && isDigitChar(static_cast<unsigned char>(it[1])))
+                it = kernels.skipDigits(it + 2, end);
+            if (it + 1 < end && (*it == 'e' || *it == 'E'))
+            {
+                const char *digits = it + 1 + (it[1] == '+' || it[1] == '-');
+                if (digits < end && isDigitChar(static_cast<unsigned char>(*digits)))
+                    it = kernels.skipDigits(digits + 1, end);
+            }
+        }
+        else if (c == '"')
+        {
+            const char *close = kernels.find(it + 1, end, '"');
+            if (close == end)
+                throw error("Unrecognized token: \"");
+            kind = TokenKind::String;
+            it = close + 1;
+        }
+        else
+        {
+            size_t length = 0;
+            switch (c)
+            {
+            case '<':
+            case '>':
+                length = next == c || next == '=' ? 2 : 1; // << >> <= >= < >
+                break;
+            case '=':
+                length = next == '=' ? 2 : 1;
+                break;
+            case '!':
+                length = next == '=' ? 2 : 0;
+                break;
+            case '(': case ')': case '{': case '}': case ';': case ',':
+            case '+': case '-': case '*': case '/': case '%': case '.':
+                length = 1;
+                break;
+            }
+            if (length == 0)
+            {
+                // A lone byte of a multi-byte character (or a control
+                // byte) is named by value rather than copied into the
+                // message as half a character.
+                if (isprint(c))
+                    throw error("Unrecognized token: " + string(1, static_cast<char>(c)));
+                char byte[16];
+                snprintf(byte, sizeof(byte), "byte 0x%02X", c);
+                throw error(string("Unrecognized token: ") + byte);
+            }
+            it += length;
+            kind = symbolKind(string_view(start, length));
+        }
+        emit(kind, string_view(start, static_cast<size_t>(it - start)));
     }
+    return it;
+}
+
+// Turns a lexeme of code into a Token, interning its text when it has one
+// (keywords have fixed symbols and skip the interner).
+inline Token makeToken(TokenKind kind, string_view text, string_view code, Interner &strings)
+{
+    auto offset = static_cast<uint32_t>(text.data() - code.data());
+    auto length = static_cast<uint32_t>(text.size());
+    if (kind > TokenKind::String)
+        return {kind, 0, offset, length};
+    if (kind == TokenKind::Identifier)
+        if (Symbol keyword = keywordSymbol(text); keyword != NotKeyword)
+            return {TokenKind::Keyword, keyword, offset, length};
+    return {kind, strings.intern(text), offset, length};
+}
+
+vector<Token> tokenize(string_view code, Interner &strings, const CancelToken *cancel = nullptr, size_t maxTokens = 0)
+{
+    vector<Token> tokens;
+    auto emit = [&](TokenKind kind, string_view text)
+    {
+        tokens.push_back(makeToken(kind, text, code, strings));
+        pollCancel(cancel, tokens.size());
+        checkLimit(tokens.size(), maxTokens, "Too many tokens");
+    };
+    scanTokens(code, emit);
+    return tokens;
+}
+
+// --- Token Sources ---
+// The parser reads tokens through has(pos, ahead) / at(index), where pos is
+// its position: tokens before pos are never looked at again.
+
+// A fully lexed token vector.
+class TokenArray
+{
+    const vector<Token> &tokens;
 
 public:
-    Parser(const vector<Token> &tokens) : tokens(tokens) {}
+    explicit TokenArray(const vector<Token> &tokens) : tokens(tokens) {}
+    bool has(size_t pos, size_t ahead = 0) const { return pos + ahead < tokens.size(); }
+    const Token &at(size_t index) const { return tokens[index]; }
+};
 
+// What it does:
+// Overlaps lexing with parsing. A lexer thread scans the source and pushes
+// lexemes into a fixed ring that the parser drains, so peak token memory is
+// the ring rather than the whole file. The ring is a lock-free single-
+// producer / single-consumer queue: the lexer only advances `head`, the
+// parser only advances `tail` (to its position), and either side waits
+// (spinning, then yielding) only while the ring is full or empty. Lexemes
+// are interned on the parser's side as they enter its lookahead window, so
+// the Interner is still only touched by one thread. A lexer error surfaces
+// when the parser reaches it; a parser error stops the lexer.
 
-    // What it does:
-    // Creates a root node called "Program".
-    // Handles preprocessor lines (e.g., #include <iostream>) and adds them as "Include: ...".
-    // Skips using namespace std; and adds it as "Using: namespace std".
-    // Parses all functions one by one using parseFunction() and adds them to the program's children.
-    // Returns the complete syntax tree for the program.
+class TokenPipe
+{
+    struct Abandoned
+    {
+    };
 
-    Node parse()
+    vector<Lexeme> ring;
+    vector<Token> window; // parser side: the ring's lexemes, interned
+    size_t mask;
+    string_view code;
+    Interner &strings;
+    alignas(64) atomic<size_t> head{0}; // lexemes pushed
+    alignas(64) atomic<size_t> tail{0}; // lexemes the parser is done with
+    atomic<bool> finished{false};       // the lexer stopped; error says why if it failed
+    atomic<bool> abandoned{false};      // the parser stopped; the lexer should too
+    exception_ptr error;
+    size_t available = 0; // parser side: head as last seen
+    size_t released = 0;  // parser side: tail as last stored
+    size_t interned = 0;  // parser side: lexemes copied into window
+    bool failed = false;  // parser side: has() rethrew the lexer's error
+    thread lexer;
+
+    template <typename Blocked>
+    static void waitWhile(Blocked blocked)
     {
-        Node root = {"Program"};
-        // Handle preprocessor directives at the top
-        while (pos < tokens.size() && tokens[pos].type == "preprocessor")
+        for (int spins = 0; blocked(); ++spins)
+            if (spins >= 64)
+                this_thread::yield();
+    }
+
+    void produce(const CancelToken *cancel, size_t maxTokens)
+    {
+        size_t count = 0;
+        size_t limit = ring.size(); // push no further than tail + ring size
+        auto emit = [&](TokenKind kind, string_view text)
+        {
+            if (count == limit)
+            {
+                waitWhile([&]
+                          {
+                              limit = tail.load(memory_order_acquire) + ring.size();
+                              return count == limit && !abandoned.load(memory_order_relaxed); });
+                if (count == limit)
+                    throw Abandoned();
+            }
+            ring[count & mask] = {kind, text};
+            if ((++count & 15) == 0 || count == limit)
+                head.store(count, memory_order_release);
+            pollCancel(cancel, count);
+            checkLimit(count, maxTokens, "Too many tokens");
+        };
+        try
         {
-            root.children.push_back({"Include: " + tokens[pos].value});
-            ++pos;
+            scanTokens(code, emit);
         }
-        // Skip 'using namespace std ;'
-        while (pos + 2 < tokens.size() &&
-               tokens[pos].value == "using" &&
-               tokens[pos + 1].value == "namespace" &&
-               tokens[pos + 2].type == "identifier")
+        catch (...)
+        {
+            error = current_exception();
+        }
+        head.store(count, memory_order_release);
+        finished.store(true, memory_order_release);
+    }
+
+public:
+    // capacity is rounded up to a power of two of at least 64 tokens.
+    TokenPipe(string_view code, Interner &strings, size_t capacity, const CancelToken *cancel = nullptr, size_t maxTokens = 0)
+        : ring(bit_ceil(max<size_t>(capacity, 64))), window(ring.size()), mask(ring.size() - 1), code(code), strings(strings)
+    {
+        lexer = thread([=, this]
+                       { produce(cancel, maxTokens); });
+    }
+
+    ~TokenPipe()
+    {
+        abandoned.store(true, memory_order_relaxed);
+        lexer.join();
+    }
+
+    TokenPipe(const TokenPipe &) = delete;
+    TokenPipe &operator=(const TokenPipe &) = delete;
+
+    // Waits until token pos + ahead is lexed (ahead < ring size); false at
+    // the end of the input. Rethrows the lexer's error once it is reached.
+    bool has(size_t pos, size_t ahead = 0)
+    {
+        // Slots are handed back a quarter of the ring at a time.
+        if (pos - released >= ring.size() / 4)
+            tail.store(released = pos, memory_order_release);
+        size_t need = pos + ahead + 1;
+        if (need <= interned)
+            return true;
+        if (need > available)
+        {
+            waitWhile([&]
+                      {
+                          available = head.load(memory_order_acquire);
+                          return available < need && !finished.load(memory_order_acquire); });
+            available = head.load(memory_order_acquire);
+            if (available < need)
+            {
+                if (error)
+                {
+                    failed = true;
+                    rethrow_exception(error);
+                }
+                return false;
+            }
+        }
+        for (; interned < available; ++interned)
+        {
+            const Lexeme &lexeme = ring[interned & mask];
+            window[interned & mask] = makeToken(lexeme.kind, lexeme.text, code, strings);
+        }
+        return true;
+    }
+
+    const Token &at(size_t index) const { return window[index & mask]; }
+
+    // Tokens lexed so far (all of them once the parser reached the end).
+    size_t count() const { return head.load(memory_order_acquire); }
+
+    // True once the parser has reached a lexer error (rather than stopping
+    // on one of its own).
+    bool lexerFailed() const { return failed; }
+};
+
+// --- Parallel Lexing ---
+// What it does:
+// Splits a large input into one chunk per thread, each starting right
+// after a newline, and scans the chunks concurrently. The only lexer state
+// that crosses a newline is a string literal or block comment spanning it
+// (a "#..." line and a // comment end at their newline), so each chunk is
+// scanned speculatively as if it began outside both. A sequential fix-up pass then checks every chunk
+// against where the scan before it really stopped: if the chunk has a
+// token boundary there, the lexemes before it are dropped; if not (it
+// started inside a string or comment, or a token ran past its start), it is
+// scanned again from that point. The lexemes are then interned in order, which
+// also concatenates them, so the result is exactly what tokenize() gives.
+
+const size_t minLexChunk = 256 << 10;
+
+struct LexChunk
+{
+    const char *begin;
+    const char *end;          // the next chunk's begin
+    vector<Lexeme> lexemes;   // tokens starting in [begin, stop)
+    const char *stop = nullptr; // where the scan ended; may be past end
+    exception_ptr error;      // the scan failed at stop
+};
+
+// Scans chunk's tokens from `from` on.
+void scanChunk(LexChunk &chunk, string_view code, const char *from, const CancelToken *cancel, size_t maxTokens)
+{
+    chunk.lexemes.clear();
+    chunk.error = nullptr;
+    auto emit = [&](TokenKind kind, string_view text)
+    {
+        chunk.lexemes.push_back({kind, text});
+        pollCancel(cancel, chunk.lexemes.size());
+        checkLimit(chunk.lexemes.size(), maxTokens, "Too many tokens");
+    };
+    try
+    {
+        chunk.stop = scanTokens(code, emit, static_cast<size_t>(from - code.data()), static_cast<size_t>(chunk.end - code.data()));
+    }
+    catch (...)
+    {
+        chunk.error = current_exception();
+        const char *last = chunk.lexemes.empty() ? from : chunk.lexemes.back().text.data() + chunk.lexemes.back().text.size();
+        chunk.stop = charKernels->skipSpace(last, code.data() + code.size());
+    }
+}
+
+// Whether the speculative scan of chunk passed through `resume` between
+// tokens; if so, drops the lexemes before it.
+bool resyncChunk(LexChunk &chunk, const char *resume, string_view code)
+{
+    auto first = lower_bound(chunk.lexemes.begin(), chunk.lexemes.end(), resume, [](const Lexeme &lexeme, const char *at)
+                             { return lexeme.text.data() < at; });
+    const char *next = first == chunk.lexemes.end() ? chunk.stop : first->text.data();
+    if (first != chunk.lexemes.begin() && prev(first)->text.data() + prev(first)->text.size() > resume)
+        return false; // resume is inside a token
+    if (resume > next || skipBlank(*charKernels, resume, next, code) != next)
+        return false;
+    chunk.lexemes.erase(chunk.lexemes.begin(), first);
+    return true;
+}
+
+vector<Token> tokenizeParallel(string_view code, Interner &strings, size_t threads, const CancelToken *cancel = nullptr, size_t maxTokens = 0)
+{
+    size_t count = min(threads, code.size() / minLexChunk);
+    if (count < 2)
+        return tokenize(code, strings, cancel, maxTokens);
+
+    const char *codeEnd = code.data() + code.size();
+    vector<LexChunk> chunks;
+    const char *begin = code.data();
+    for (size_t i = 1; i <= count && begin < codeEnd; ++i)
+    {
+        const char *end = codeEnd;
+        if (i < count)
+        {
+            const char *cut = code.data() + code.size() * i / count;
+            const char *newline = cut > begin ? static_cast<const char *>(memchr(cut, '\n', static_cast<size_t>(codeEnd - cut))) : nullptr;
+            if (!newline)
+                continue; // no line break left: this chunk takes the next one's text
+            end = newline + 1;
+        }
+        chunks.push_back({begin, end});
+        begin = end;
+    }
+
+    vector<thread> workers;
+    for (size_t i = 1; i < chunks.size(); ++i)
+        workers.emplace_back([&, i]
+                             { scanChunk(chunks[i], code, chunks[i].begin, cancel, maxTokens); });
+    scanChunk(chunks[0], code, chunks[0].begin, cancel, maxTokens);
+    for (auto &worker : workers)
+        worker.join();
+
+    // Fix-up, in order: each chunk continues where the previous scan stopped.
+    const char *resume = chunks[0].begin;
+    size_t total = 0;
+    for (auto &chunk : chunks)
+    {
+        if (resume >= chunk.end)
+        {
+            chunk.lexemes.clear(); // a token from an earlier chunk covers this one
+            continue;
+        }
+        if (!resyncChunk(chunk, resume, code))
+            scanChunk(chunk, code, resume, cancel, maxTokens);
+        if (chunk.error)
+            rethrow_exception(chunk.error);
+        resume = chunk.stop;
+        total += chunk.lexemes.size();
+    }
+    checkLimit(total, maxTokens, "Too many tokens");
+
+    vector<Token> tokens;
+    tokens.reserve(total);
+    for (const auto &chunk : chunks)
+        for (const Lexeme &lexeme : chunk.lexemes)
+        {
+            tokens.push_back(makeToken(lexeme.kind, lexeme.text, code, strings));
+            pollCancel(cancel, tokens.size());
+        }
+    return tokens;
+}
+
+
+// This is a recursive-descent parser that:
+// Parses a C++-like source code from a list of tokens
+// Builds a tree structure (Node) for each part (functions, statements, etc.)
+// Builds a symbol table for variables/functions with scope
+// Generates an AST (Abstract Syntax Tree) rooted at "Program"
+
+
+
+// Tree Node
+// The label shown in the visualizer ("Var: n", "int n", "Op: +", ...) is
+// built from kind + ids by nodeLabel() only when the tree is written out.
+enum class NodeKind : uint8_t
+{
+    Program,
+    File,         // sym = path (multi-file input only)
+    Include,      // sym = directive text
+    Using,        // sym = namespace
+    Function,
+    ReturnType,   // type = return type
+    FunctionName, // sym = function name
+    Parameters,
+    Param,        // type + sym
+    Body,
+    VarDecl,
+    Declarator,   // type + sym
+    Return,
+    If,
+    While,
+    Cout,
+    Cin,
+    Block,
+    Var,          // sym = variable name
+    Assignment,
+    FunctionCall,
+    Callee,       // sym = function name
+    Arguments,
+    Expr,
+    Value,        // sym = lexeme, token = Number / Identifier / String
+    Op            // token = operator kind
+};
+
+struct Node
+{
+    NodeKind kind;
+    TokenKind token = TokenKind::OtherSymbol;
+    Symbol sym = 0;
+    Symbol type = 0;
+    Span span; // the source it was parsed from (in its own file)
+    vector<Node> children;
+};
+
+string nodeLabel(const Node &node, const Interner &strings)
+{
+    switch (node.kind)
+    {
+    case NodeKind::Program: return "Program";
+    case NodeKind::File: return "File: " + strings.text(node.sym);
+    case NodeKind::Include: return "Include: " + strings.text(node.sym);
+    case NodeKind::Using: return "Using: namespace " + strings.text(node.sym);
+    case NodeKind::Function: return "Function";
+    case NodeKind::ReturnType: return "ReturnType: " + strings.text(node.type);
+    case NodeKind::FunctionName: return "FunctionName: " + strings.text(node.sym);
+    case NodeKind::Parameters: return "Parameters";
+    case NodeKind::Param:
+    case NodeKind::Declarator: return strings.text(node.type) + " " + strings.text(node.sym);
+    case NodeKind::Body: return "Body";
+    case NodeKind::VarDecl: return "VarDecl";
+    case NodeKind::Return: return "Return";
+    case NodeKind::If: return "If";
+    case NodeKind::While: return "While";
+    case NodeKind::Cout: return "Cout";
+    case NodeKind::Cin: return "Cin";
+    case NodeKind::Block: return "Block";
+    case NodeKind::Var: return "Var: " + strings.text(node.sym);
+    case NodeKind::Assignment: return "Assignment";
+    case NodeKind::FunctionCall: return "FunctionCall";
+    case NodeKind::Callee: return "Callee: " + strings.text(node.sym);
+    case NodeKind::Arguments: return "Arguments";
+    case NodeKind::Expr: return "Expr";
+    case NodeKind::Value: return "Value: " + strings.text(node.sym);
+    case NodeKind::Op: return string("Op: ") + tokenSpelling[static_cast<size_t>(node.token)];
+    }
+    return "";
+}
+
+// --- Runtime Values ---
+// What an expression evaluates to, in the simulator and in the symbol table:
+// an int, a double or a string, tagged. An Int is a C++ int: every result
+// that makes one wraps to 32 bits, so overflow mid-expression matches the
+// compiled program. A string is the interned text of its
+// literal, quotes included, so a Value stays 16 bytes, copies are plain
+// stores and equal strings have equal ids. None is "no value": an unknown
+// variable, or an operation its operand types do not support.
+
+struct Value
+{
+    enum class Kind : uint8_t
+    {
+        None,
+        Int,
+        Float,
+        String
+    };
+
+    Kind kind = Kind::None;
+    union
+    {
+        int32_t integer = 0;
+        double real;
+        Symbol text;
+    };
+
+    static Value ofInt(int64_t value)
+    {
+        Value v;
+        v.kind = Kind::Int;
+        v.integer = static_cast<int32_t>(value); // modulo 2^32
+        return v;
+    }
+    static Value ofFloat(double value)
+    {
+        Value v;
+        v.kind = Kind::Float;
+        v.real = value;
+        return v;
+    }
+    static Value ofString(Symbol text)
+    {
+        Value v;
+        v.kind = Kind::String;
+        v.text = text;
+        return v;
+    }
+
+    bool has() const { return kind != Kind::None; }
+    bool isNumber() const { return kind == Kind::Int || kind == Kind::Float; }
+    double number() const { return kind == Kind::Int ? static_cast<double>(integer) : real; }
+
+    // As a condition: a nonzero number or any string.
+    bool truthy() const
+    {
+        switch (kind)
+        {
+        case Kind::Int: return integer != 0;
+        case Kind::Float: return real != 0;
+        case Kind::String: return true;
+        case Kind::None: break;
+        }
+        return false;
+    }
+};
+
+static_assert(sizeof(Value) == 16 && is_trivially_copyable_v<Value>, "Value is copied around the evaluator by value");
+
+using Variables = unordered_map<Symbol, Value>;
+
+// Symbol Table Entry
+struct SymbolEntry
+{
+    Symbol name;
+    Symbol type;
+    bool isFunction;
+    Symbol scope;
+    Value value; // None unless known when parsed
+};
+
+// Execution trace event; sym is the function or variable involved.
+enum class TraceAction : uint8_t
+{
+    Call,
+    Return,
+    VarDecl,
+    Assign,
+    ReturnStmt,
+    IfEnter,
+    IfTaken,
+    WhileEnter,
+    Cout,
+    Cin
+};
+
+struct TraceEvent
+{
+    TraceAction action;
+    bool thenBranch = false; // IfTaken only
+    Symbol sym = 0;
+};
+
+// Session
+// Everything one parse/simulation run owns: the interned strings, the
+// functions found by the parser, the execution trace and the symbol table.
+struct Session
+{
+    Interner strings;
+    vector<SyntaxError> syntaxErrors;  // the parser recovered from these, in source order
+    vector<const Node *> allFunctions; // For trace generation (points into the parsed tree)
+    vector<TraceEvent> trace;          // The execution trace
+    vector<SymbolEntry> symbolTable;
+    Limits limits;
+    const CancelToken *cancel = nullptr; // set when the run may be abandoned
+    size_t pipeline = 0;                 // token ring size for pipelined lexing (0 = lex first)
+    size_t lexThreads = 1;               // threads a large input is lexed with
+    size_t callDepth = 0;                // simulated calls in progress
+    mutable size_t steps = 0;            // work counter for pollCancel
+
+    void poll() const { pollCancel(cancel, ++steps); }
+};
+
+// Binary operator table, indexed by TokenKind.
+// precedence 0 means "not a binary operator" and stops expression parsing.
+// << and >> are left out on purpose: they separate cout/cin operands.
+struct OperatorInfo
+{
+    int precedence;
+    bool rightAssoc;
+};
+
+const array<OperatorInfo, static_cast<size_t>(TokenKind::Count)> binaryOperators = []
+{
+    array<OperatorInfo, static_cast<size_t>(TokenKind::Count)> table{};
+    auto set = [&](TokenKind kind, int precedence, bool rightAssoc = false)
+    { table[static_cast<size_t>(kind)] = {precedence, rightAssoc}; };
+    set(TokenKind::Star, 5);
+    set(TokenKind::Slash, 5);
+    set(TokenKind::Percent, 5);
+    set(TokenKind::Plus, 4);
+    set(TokenKind::Minus, 4);
+    set(TokenKind::Less, 3);
+    set(TokenKind::Greater, 3);
+    set(TokenKind::LessEqual, 3);
+    set(TokenKind::GreaterEqual, 3);
+    set(TokenKind::Equal, 2);
+    set(TokenKind::NotEqual, 2);
+    return table;
+}();
+
+// Thrown by Parser. Unlike a lexer error, the parser can recover from it:
+// the statement or function it occurred in is skipped (see Parser::recover).
+struct ParseError : SyntaxError
+{
+    using SyntaxError::SyntaxError;
+};
+
+// Add this line before the Parser class definition:
+Value evalExpr(const Node &expr, const Variables &vars, const Interner &strings);
+Value convertValue(Value value, Symbol type);
+
+template <typename Tokens>
+class Parser
+{
+    Tokens &tokens;
+    size_t pos = 0;
+    Session &session;
+    Symbol currentScope = SymGlobal;
+    size_t nodeCount = 0;
+    size_t depth = 0;
+    size_t folds = 0; // operators folded into the Expr chains being built
+    Token last{}; // the last token consumed (an empty one at the start)
+    unordered_map<uint64_t, size_t> symbolRows; // scope << 32 | name -> its latest symbolTable row
+
+    // Adds a row to the symbol table; assignments find it by scope and name
+    // without scanning the table.
+    void declare(const SymbolEntry &entry)
+    {
+        symbolRows[uint64_t(entry.scope) << 32 | entry.name] = session.symbolTable.size();
+        session.symbolTable.push_back(entry);
+    }
+
+    // Every node the parser builds comes from here, so the node cap holds
+    // while the tree grows.
+    Node makeNode(NodeKind kind, TokenKind token = TokenKind::OtherSymbol, Symbol sym = 0, Symbol type = 0, Span span = {})
+    {
+        checkLimit(++nodeCount, session.limits.nodes, "Too many syntax tree nodes");
+        return {kind, token, sym, type, span};
+    }
+
+    // Spans: a node starts at the token current when it was begun (here())
+    // and ends with the last token consumed when it is closed.
+    uint32_t lastEnd() const { return last.offset + last.length; }
+    uint32_t here() { return has() ? at().offset : lastEnd(); }
+    Span spanFrom(uint32_t begin) const { return {begin, lastEnd() - begin}; }
+    void close(Node &node, uint32_t begin) const { node.span = spanFrom(begin); }
+
+    // An error at the current token (or the end of the input), or at token.
+    ParseError syntaxError(const string &message) { return {message, has() ? tokenSpan(at()) : Span{lastEnd(), 0}}; }
+    ParseError syntaxError(const string &message, const Token &token) const { return {message, tokenSpan(token)}; }
+
+    // Thrown once limits.syntaxErrors diagnostics are collected; parse()
+    // returns the functions completed so far.
+    struct GiveUp
+    {
+    };
+
+    // Adds error to session.syntaxErrors, one per offset so an early end of
+    // input is not reported again by every block it cuts short.
+    void record(const ParseError &error)
+    {
+        auto &errors = session.syntaxErrors;
+        if (errors.empty() || errors.back().span.offset != error.span.offset)
+            errors.push_back(error);
+        if (session.limits.syntaxErrors && errors.size() >= session.limits.syntaxErrors)
+            throw GiveUp();
+    }
+
+    // What it does:
+    // Panic-mode recovery. Records error and skips ahead from the token at
+    // `start`, where the failed statement or function began: up to and
+    // including its ;, or a { ... } group as a whole. A statement stops
+    // before the } of its enclosing block, which the caller then consumes;
+    // at the top level a stray } is skipped too.
+
+    void recover(const ParseError &error, size_t start, bool topLevel)
+    {
+        record(error);
+        if (pos > start && last.kind == TokenKind::Semicolon)
+            return; // the statement ended where it failed
+        size_t braces = 0;
+        while (has())
+        {
+            session.poll();
+            TokenKind kind = at().kind;
+            if (kind == TokenKind::RBrace && braces == 0 && !topLevel)
+                return;
+            take();
+            if (kind == TokenKind::LBrace)
+                ++braces;
+            else if (kind == TokenKind::RBrace && (braces == 0 || --braces == 0))
+                return;
+            else if (kind == TokenKind::Semicolon && braces == 0)
+                return;
+        }
+    }
+
+    // Parses statements into parent up to and including the } that closes
+    // a body or block. A statement that fails is recorded and skipped, so
+    // one mistake does not hide the ones after it; a missing } is recorded
+    // and the statements so far are kept.
+    void parseStatements(Node &parent)
+    {
+        while (!match(TokenKind::RBrace))
+        {
+            if (!has())
+                return record(syntaxError("Expected }"));
+            size_t start = pos;
+            try
+            {
+                parent.children.push_back(parseStatement());
+            }
+            catch (const ParseError &error)
+            {
+                recover(error, start, false);
+            }
+        }
+    }
+
+    // Holds `depth` one level deeper while alive, for real recursion: a
+    // nested statement or block, or an operand parsed by a nested
+    // parseExpression. Folding an operator into a left-nested Expr chain is
+    // a loop, so a flat `1 + 1 + ... + 1` is not nesting; fold() counts it
+    // against the larger exprDepth instead, which still bounds the tree
+    // walkers (evalExpr, serializers) that recurse down the chain.
+    class Nesting
+    {
+        Parser &parser;
+        size_t folds = 0;
+
+    public:
+        explicit Nesting(Parser &parser) : parser(parser)
+        {
+            checkLimit(++parser.depth, parser.session.limits.depth, "Nesting too deep");
+        }
+        ~Nesting()
+        {
+            --parser.depth;
+            parser.folds -= folds;
+        }
+        void fold()
+        {
+            ++folds;
+            checkLimit(++parser.folds, parser.session.limits.exprDepth, "Expression too long");
+        }
+    };
+
+    // ✅ Token peek()
+    // Purpose: Look at the current token without moving forward in the token stream.
+    // Returns: The token at tokens[pos].
+    // Throws: Error if we’ve reached the end of tokens.
+    // Use case: Just checking what's next, without consuming it.
+
+    // True if the token `ahead` places past the current one exists.
+    bool has(size_t ahead = 0) { return tokens.has(pos, ahead); }
+
+    // That token; only valid once has(ahead) returned true.
+    const Token &at(size_t ahead = 0) const { return tokens.at(pos + ahead); }
+
+    Token peek()
+    {
+        if (has())
+            return at();
+        throw syntaxError("Unexpected end of input");
+    }
+
+    // Consumes the current token (has() must be true).
+    Token take()
+    {
+        last = at();
+        ++pos;
+        return last;
+    }
+
+    // ✅ Token advance()
+    // Purpose: Return the current token and then move to the next one.
+    // Returns: The token at tokens[pos], then increments pos.
+    // Throws: Error if there are no more tokens.
+    // Use case: When you are ready to consume a token.
+
+
+    Token advance()
+    {
+        if (has())
+            return take();
+        throw syntaxError("Unexpected end of input");
+    }
+
+    // ✅ bool match(TokenKind kind)
+    // Purpose: Check if the current token is a symbol of the given kind.
+    // If matched:
+    // Moves forward (++pos)
+    // Returns true
+    // Else: Returns false
+    // Use case: For checking specific symbols like "(", ";", etc.
+
+
+    bool match(TokenKind kind)
+    {
+        if (has() && at().kind == kind)
+        {
+            take();
+            return true;
+        }
+        return false;
+    }
+
+    // Same as match(), for keywords ("int", "return", ...).
+    bool matchKeyword(Symbol keyword)
+    {
+        if (has() && at().kind == TokenKind::Keyword && at().sym == keyword)
+        {
+            take();
+            return true;
+        }
+        return false;
+    }
+
+    // The current token's keyword symbol, or NotKeyword.
+    Symbol keyword() { return has() && at().kind == TokenKind::Keyword ? at().sym : NotKeyword; }
+
+    // Accepts one of the supported type keywords and stores it in type.
+    // Returns false if the current token is not a type.
+    bool matchTypeKeyword(Symbol &type)
+    {
+        Symbol current = keyword();
+        if (!isTypeKeyword(current))
+            return false;
+        type = current;
+        take();
+        return true;
+    }
+
+public:
+    Parser(Tokens &tokens, Session &session) : tokens(tokens), session(session) {}
+
+
+    // What it does:
+    // Creates a root node called "Program".
+    // Handles preprocessor lines (e.g., #include <iostream>) and adds them as "Include: ...".
+    // Skips using namespace std; and adds it as "Using: namespace std".
+    // Parses all functions one by one using parseFunction() and adds them to the program's children.
+    // A function that fails to parse is left out and parsing resumes after it (see recover()).
+    // Returns the syntax tree for the program; session.syntaxErrors lists what was left out.
+
+    Node parse()
+    {
+        uint32_t begin = here();
+        Node root = makeNode(NodeKind::Program);
+        // Handle preprocessor directives at the top
+        while (has() && at().kind == TokenKind::Preprocessor)
+        {
+            Token directive = take();
+            root.children.push_back(makeNode(NodeKind::Include, TokenKind::Preprocessor, directive.sym, 0, tokenSpan(directive)));
+        }
+        // Skip 'using namespace std ;'
+        while (has(2) &&
+               at().sym == SymUsing && at().kind == TokenKind::Identifier &&
+               at(1).sym == SymNamespace && at(1).kind == TokenKind::Identifier &&
+               at(2).kind == TokenKind::Identifier)
+        {
+            uint32_t usingBegin = here();
+            Node usingNode = makeNode(NodeKind::Using, TokenKind::Identifier, at(2).sym);
+            take();
+            take();
+            take();
+            if (has() && at().kind == TokenKind::Semicolon)
+                take();
+            close(usingNode, usingBegin);
+            root.children.push_back(std::move(usingNode));
+        }
+        try
+        {
+            while (has())
+            {
+                size_t start = pos;
+                try
+                {
+                    root.children.push_back(parseFunction());
+                }
+                catch (const ParseError &error)
+                {
+                    currentScope = SymGlobal;
+                    recover(error, start, true);
+                }
+            }
+        }
+        catch (const GiveUp &)
+        {
+        }
+        close(root, begin);
+        // Index the functions once the children vector stops growing; moving
+        // root out keeps the same buffer, so the pointers stay valid.
+        for (const auto &child : root.children)
+            if (child.kind == NodeKind::Function)
+                session.allFunctions.push_back(&child);
+        return root;
+    }
+
+    Node parseFunction()
+    {
+        uint32_t begin = here();
+        Node funcNode = makeNode(NodeKind::Function);
+
+        // Accept multiple return types
+        Symbol returnType;
+        if (!matchTypeKeyword(returnType))
+            throw syntaxError("Expected return type");
+        Span returnTypeSpan = tokenSpan(last);
+
+        Token name = advance();
+        if (name.kind != TokenKind::Identifier)
+            throw syntaxError("Expected function name", name);
+
+        funcNode.children.push_back(makeNode(NodeKind::ReturnType, TokenKind::Keyword, 0, returnType, returnTypeSpan));
+        funcNode.children.push_back(makeNode(NodeKind::FunctionName, TokenKind::Identifier, name.sym, 0, tokenSpan(name)));
+
+        uint32_t paramsBegin = here();
+        if (!match(TokenKind::LParen))
+            throw syntaxError("Expected (");
+
+        // Add function to symbol table
+        declare({name.sym, returnType, true, SymGlobal});
+
+        Symbol prevScope = currentScope;
+        currentScope = name.sym;
+        Node paramList = makeNode(NodeKind::Parameters);
+        if (!match(TokenKind::RParen))
+        {
+            do
+            {
+                // Accept multiple parameter types
+                uint32_t paramBegin = here();
+                Symbol paramType;
+                if (!matchTypeKeyword(paramType))
+                    throw syntaxError("Expected parameter type");
+                Token paramName = advance();
+                if (paramName.kind != TokenKind::Identifier)
+                    throw syntaxError("Expected parameter name", paramName);
+                paramList.children.push_back(makeNode(NodeKind::Param, TokenKind::Identifier, paramName.sym, paramType, spanFrom(paramBegin)));
+                // Add parameter to symbol table
+                declare({paramName.sym, paramType, false, currentScope});
+            } while (match(TokenKind::Comma));
+            if (!match(TokenKind::RParen))
+                throw syntaxError("Expected )");
+        }
+        close(paramList, paramsBegin);
+        funcNode.children.push_back(std::move(paramList));
+
+        uint32_t bodyBegin = here();
+        if (!match(TokenKind::LBrace))
+            throw syntaxError("Expected {");
+
+        Node body = makeNode(NodeKind::Body);
+        parseStatements(body);
+        close(body, bodyBegin);
+        funcNode.children.push_back(std::move(body));
+
+        currentScope = prevScope;
+        close(funcNode, begin);
+        return funcNode;
+    }
+
+
+// ---------------------------------------------------------------------------
+
+    // What it does:
+    // Parses a single statement (like variable declaration, return, if, while, etc.).
+    // Returns the syntax tree for the statement.
+
+    Node parseStatement()
+    {
+        session.poll();
+        Nesting level(*this);
+        uint32_t begin = here();
+        // Statements that start with a keyword: one switch on its symbol
+        switch (keyword())
+        {
+        // Variable declaration for supported types
+        case SymInt:
+        case SymVoid:
+        case SymFloat:
+        case SymString:
+        {
+            Symbol varType = advance().sym;
+            Token varName = advance();
+            if (varName.kind != TokenKind::Identifier)
+                throw syntaxError("Expected variable name", varName);
+            Node decl = makeNode(NodeKind::VarDecl);
+            decl.children.push_back(makeNode(NodeKind::Declarator, TokenKind::Identifier, varName.sym, varType, spanFrom(begin)));
+            Value val;
+            if (match(TokenKind::Assign))
+            {
+                decl.children.push_back(parseExpression());
+                // Try to evaluate if possible (variables are not known yet)
+                val = convertValue(evalExpr(decl.children.back(), {}, session.strings), varType);
+            }
+            if (!match(TokenKind::Semicolon))
+                throw syntaxError("Expected ; after variable declaration");
+            // Add variable to symbol table
+            declare({varName.sym, varType, false, currentScope, val});
+            close(decl, begin);
+            return decl;
+        }
+        case SymReturn:
+        {
+            take();
+            Node retNode = makeNode(NodeKind::Return);
+            retNode.children.push_back(parseExpression());
+            if (!match(TokenKind::Semicolon))
+                throw syntaxError("Expected ; after return");
+            close(retNode, begin);
+            return retNode;
+        }
+        case SymIf:
+        {
+            take();
+            Node ifNode = makeNode(NodeKind::If);
+            if (!match(TokenKind::LParen))
+                throw syntaxError("Expected ( after if");
+            ifNode.children.push_back(parseExpression());
+            if (!match(TokenKind::RParen))
+                throw syntaxError("Expected ) after if condition");
+            ifNode.children.push_back(parseStatement());
+            if (matchKeyword(SymElse))
+                ifNode.children.push_back(parseStatement());
+            close(ifNode, begin);
+            return ifNode;
+        }
+        case SymWhile:
+        {
+            take();
+            Node whileNode = makeNode(NodeKind::While);
+            if (!match(TokenKind::LParen))
+                throw syntaxError("Expected ( after while");
+            whileNode.children.push_back(parseExpression());
+            if (!match(TokenKind::RParen))
+                throw syntaxError("Expected ) after while condition");
+            whileNode.children.push_back(parseStatement());
+            close(whileNode, begin);
+            return whileNode;
+        }
+        case SymCout:
+        {
+            take();
+            Node coutNode = makeNode(NodeKind::Cout);
+            // Require at least one << and expression
+            if (!match(TokenKind::ShiftLeft))
+                throw syntaxError("Expected << after cout");
+            coutNode.children.push_back(parseExpression());
+            // Handle additional << expressions
+            while (match(TokenKind::ShiftLeft))
+            {
+                coutNode.children.push_back(parseExpression());
+            }
+            if (!match(TokenKind::Semicolon))
+                throw syntaxError("Expected ; after cout");
+            close(coutNode, begin);
+            return coutNode;
+        }
+        case SymCin:
+        {
+            take();
+            Node cinNode = makeNode(NodeKind::Cin);
+            if (!match(TokenKind::ShiftRight))
+                throw syntaxError("Expected >> after cin");
+            do
+            {
+                Token var = advance();
+                if (var.kind != TokenKind::Identifier)
+                    throw syntaxError("Expected variable after >>", var);
+                cinNode.children.push_back(makeNode(NodeKind::Var, TokenKind::Identifier, var.sym, 0, tokenSpan(var)));
+            } while (match(TokenKind::ShiftRight));
+            if (!match(TokenKind::Semicolon))
+                throw syntaxError("Expected ; after cin");
+            close(cinNode, begin);
+            return cinNode;
+        }
+        default:
+            break;
+        }
+        if (match(TokenKind::LBrace))
+        {
+            Node block = makeNode(NodeKind::Block);
+            parseStatements(block);
+            close(block, begin);
+            return block;
+        }
+        // Function call or assignment
+        Token first = advance();
+        if (first.kind == TokenKind::Identifier)
+        {
+            if (match(TokenKind::Assign))
+            {
+                // Assignment
+                Node assign = makeNode(NodeKind::Assignment);
+                assign.children.push_back(makeNode(NodeKind::Var, TokenKind::Identifier, first.sym, 0, tokenSpan(first)));
+                assign.children.push_back(parseExpression());
+                const Node &expr = assign.children.back();
+                // Try to update value in symbol table if possible
+                auto row = symbolRows.find(uint64_t(currentScope) << 32 | first.sym);
+                if (row != symbolRows.end())
+                {
+                    SymbolEntry &entry = session.symbolTable[row->second];
+                    entry.value = convertValue(evalExpr(expr, {}, session.strings), entry.type);
+                }
+                if (!match(TokenKind::Semicolon))
+                    throw syntaxError("Expected ; after assignment");
+                close(assign, begin);
+                return assign;
+            }
+            else if (match(TokenKind::LParen))
+            {
+                // Function call
+                Node call = makeNode(NodeKind::FunctionCall);
+                call.children.push_back(makeNode(NodeKind::Callee, TokenKind::Identifier, first.sym, 0, tokenSpan(first)));
+                uint32_t argsBegin = last.offset; // the (
+                Node args = makeNode(NodeKind::Arguments);
+                if (!match(TokenKind::RParen))
+                {
+                    do
+                    {
+                        args.children.push_back(parseExpression());
+                    } while (match(TokenKind::Comma));
+                    if (!match(TokenKind::RParen))
+                        throw syntaxError("Expected ) after function call arguments");
+                }
+                close(args, argsBegin);
+                call.children.push_back(std::move(args));
+                if (!match(TokenKind::Semicolon))
+                    throw syntaxError("Expected ; after function call");
+                close(call, begin);
+                return call;
+            }
+        }
+        throw syntaxError("Unknown statement starting with: " + tokenText(first, session.strings), first);
+    }
+
+    // What it does:
+    // Parses an expression (like 1 + 2, a, a + b * c, etc.) by precedence climbing.
+    // Each loop iteration does one table lookup on the operator's kind; operators
+    // that bind tighter than minPrec are folded into the right operand first.
+    // Returns the syntax tree for the expression.
+
+    Node parseExpression(int minPrec = 1)
+    {
+        Nesting level(*this);
+        Node left = parseSimpleExpression();
+        uint32_t begin = left.span.offset;
+        while (has())
+        {
+            const OperatorInfo &info = binaryOperators[static_cast<size_t>(at().kind)];
+            if (info.precedence < minPrec)
+                break;
+            Token op = advance();
+            level.fold();
+            Node exprNode = makeNode(NodeKind::Expr);
+            exprNode.children.reserve(3);
+            exprNode.children.push_back(std::move(left));
+            exprNode.children.push_back(makeNode(NodeKind::Op, op.kind, 0, 0, tokenSpan(op)));
+            exprNode.children.push_back(parseExpression(info.rightAssoc ? info.precedence : info.precedence + 1));
+            close(exprNode, begin);
+            left = std::move(exprNode);
+        }
+        return left;
+    }
+
+    // What it does:
+    // Parses a simple expression (like 1, a, a(), etc.).
+    // Punctuation that ends a statement or list is not a value; stopping
+    // there lets recover() resynchronize on it.
+    // Returns the syntax tree for the simple expression.
+
+    Node parseSimpleExpression()
+    {
+        session.poll();
+        switch (peek().kind)
+        {
+        case TokenKind::Semicolon:
+        case TokenKind::Comma:
+        case TokenKind::RParen:
+        case TokenKind::LBrace:
+        case TokenKind::RBrace:
+            throw syntaxError("Expected expression");
+        default:
+            break;
+        }
+        Token left = take();
+        if (left.kind == TokenKind::Identifier && has() && at().kind == TokenKind::LParen)
+        {
+            // Function call as expression
+            uint32_t argsBegin = advance().offset; // consume '('
+            Node call = makeNode(NodeKind::FunctionCall);
+            call.children.push_back(makeNode(NodeKind::Callee, TokenKind::Identifier, left.sym, 0, tokenSpan(left)));
+            Node args = makeNode(NodeKind::Arguments);
+            if (has() && at().kind != TokenKind::RParen)
+            {
+                do
+                {
+                    args.children.push_back(parseExpression());
+                } while (match(TokenKind::Comma));
+            }
+            if (!match(TokenKind::RParen))
+                throw syntaxError("Expected ) after function call arguments");
+            close(args, argsBegin);
+            call.children.push_back(std::move(args));
+            close(call, left.offset);
+            return call;
+        }
+        Node exprNode = makeNode(NodeKind::Expr, TokenKind::OtherSymbol, 0, 0, tokenSpan(left));
+        exprNode.children.push_back(makeNode(NodeKind::Value, left.kind, left.sym, 0, tokenSpan(left)));
+        return exprNode;
+    }
+};
+
+// --- Expression Evaluation ---
+
+// The value of a literal: an int, a double if it has a fraction or
+// exponent, or a string. A whole number past int range (a long in C++;
+// there are no long variables here) is a double too, so it keeps its
+// magnitude in arithmetic instead of wrapping.
+Value literalValue(const Node &value, const Interner &strings)
+{
+    if (value.token == TokenKind::String)
+        return Value::ofString(value.sym);
+    const string &text = strings.text(value.sym);
+    const char *end = text.data() + text.size();
+    if (text.find_first_of(".eE") == string::npos)
+    {
+        int32_t integer = 0;
+        if (from_chars(text.data(), end, integer).ec == errc())
+            return Value::ofInt(integer);
+    }
+    double real = 0;
+    from_chars(text.data(), end, real);
+    return Value::ofFloat(real);
+}
+
+// value as a variable of the given type keyword holds it: floats truncate
+// toward zero (None outside int range), and a mismatch (or void) is None.
+Value convertValue(Value value, Symbol type)
+{
+    switch (type)
+    {
+    case SymInt:
+        if (value.kind == Value::Kind::Int)
+            return value;
+        if (value.kind == Value::Kind::Float && value.real > INT32_MIN - 1.0 && value.real < INT32_MAX + 1.0)
+            return Value::ofInt(static_cast<int32_t>(value.real));
+        return {};
+    case SymFloat:
+        return value.isNumber() ? Value::ofFloat(value.number()) : Value{};
+    case SymString:
+        return value.kind == Value::Kind::String ? value : Value{};
+    default:
+        return {};
+    }
+}
+
+// A declared variable before its first assignment: zero, or "".
+Value initialValue(Symbol type)
+{
+    return type == SymString ? Value::ofString(SymEmptyString) : convertValue(Value::ofInt(0), type);
+}
+
+// An assignment keeps the variable's type: value is converted to the kind
+// it holds already, if any.
+Value assignValue(const Value &current, Value value)
+{
+    switch (current.kind)
+    {
+    case Value::Kind::Int: return convertValue(value, SymInt);
+    case Value::Kind::Float: return convertValue(value, SymFloat);
+    case Value::Kind::String: return convertValue(value, SymString);
+    case Value::Kind::None: break;
+    }
+    return value;
+}
+
+// left op right. Two ints stay ints, wrapped to 32 bits (INT_MIN / -1 is
+// INT_MIN, and x / 0 == x % 0 == 0 as before); an int and a double give a
+// double; strings only compare.
+// Comparisons give the int 0 or 1.
+Value applyOperator(TokenKind op, Value left, Value right, const Interner &strings)
+{
+    if (left.kind == Value::Kind::String && right.kind == Value::Kind::String)
+    {
+        int order = left.text == right.text ? 0 : strings.text(left.text).compare(strings.text(right.text));
+        switch (op)
+        {
+        case TokenKind::Equal: return Value::ofInt(order == 0);
+        case TokenKind::NotEqual: return Value::ofInt(order != 0);
+        case TokenKind::Less: return Value::ofInt(order < 0);
+        case TokenKind::Greater: return Value::ofInt(order > 0);
+        case TokenKind::LessEqual: return Value::ofInt(order <= 0);
+        case TokenKind::GreaterEqual: return Value::ofInt(order >= 0);
+        default: return {};
+        }
+    }
+    if (!left.isNumber() || !right.isNumber())
+        return {};
+    if (left.kind == Value::Kind::Int && right.kind == Value::Kind::Int)
+    {
+        // 32-bit operands cannot overflow 64 bits; ofInt wraps the result
+        int64_t a = left.integer, b = right.integer;
+        switch (op)
+        {
+        case TokenKind::Plus: return Value::ofInt(a + b);
+        case TokenKind::Minus: return Value::ofInt(a - b);
+        case TokenKind::Star: return Value::ofInt(a * b);
+        case TokenKind::Slash: return Value::ofInt(b == 0 ? 0 : a / b);
+        case TokenKind::Percent: return Value::ofInt(b == 0 ? 0 : a % b);
+        case TokenKind::Equal: return Value::ofInt(a == b);
+        case TokenKind::NotEqual: return Value::ofInt(a != b);
+        case TokenKind::Less: return Value::ofInt(a < b);
+        case TokenKind::Greater: return Value::ofInt(a > b);
+        case TokenKind::LessEqual: return Value::ofInt(a <= b);
+        case TokenKind::GreaterEqual: return Value::ofInt(a >= b);
+        default: return {};
+        }
+    }
+    double a = left.number(), b = right.number();
+    switch (op)
+    {
+    case TokenKind::Plus: return Value::ofFloat(a + b);
+    case TokenKind::Minus: return Value::ofFloat(a - b);
+    case TokenKind::Star: return Value::ofFloat(a * b);
+    case TokenKind::Slash: return b != 0 ? Value::ofFloat(a / b) : Value{};
+    case TokenKind::Equal: return Value::ofInt(a == b);
+    case TokenKind::NotEqual: return Value::ofInt(a != b);
+    case TokenKind::Less: return Value::ofInt(a < b);
+    case TokenKind::Greater: return Value::ofInt(a > b);
+    case TokenKind::LessEqual: return Value::ofInt(a <= b);
+    case TokenKind::GreaterEqual: return Value::ofInt(a >= b);
+    default: return {};
+    }
+}
+
+Value evalExpr(const Node &expr, const Variables &vars, const Interner &strings)
+{
+    if (expr.kind == NodeKind::Expr)
+    {
+        if (expr.children.size() == 1)
+        {
+            const Node &value = expr.children[0];
+            if (value.token == TokenKind::Number || value.token == TokenKind::String)
+                return literalValue(value, strings);
+            auto it = vars.find(value.sym);
+            if (value.token == TokenKind::Identifier && it != vars.end())
+                return it->second;
+            return {};
+        }
+        else if (expr.children.size() == 3)
+        {
+            Value left = evalExpr(expr.children[0], vars, strings);
+            Value right = evalExpr(expr.children[2], vars, strings);
+            return applyOperator(expr.children[1].token, left, right, strings);
+        }
+    }
+    return {};
+}
+
+// A value as symbol_table.json shows it; strings without their quotes.
+json valueToJson(const Value &value, const Interner &strings)
+{
+    switch (value.kind)
+    {
+    case Value::Kind::Int: return value.integer;
+    case Value::Kind::Float: return value.real;
+    case Value::Kind::String:
+    {
+        const string &text = strings.text(value.text);
+        return text.substr(1, text.size() - 2);
+    }
+    case Value::Kind::None: break;
+    }
+    return nullptr;
+}
+
+// --- Tree Layout ---
+// Tidy tree layout computed on the server, so the browser only draws.
+// This is Walker's algorithm with Buchheim, Jünger & Leipert's linear-time
+// fixes (the one d3.tree() runs), done over flat arrays indexed by preorder
+// id instead of recursion: a node's descendants always have larger ids, so
+// walking ids downwards visits every subtree before its root.
+
+// Same spacing as the d3.tree().separation() call in script.js.
+const double siblingSeparation = 2.5;
+const double cousinSeparation = 2.0;
+
+struct TreeLayout
+{
+    vector<double> x; // breadth position by preorder id, leftmost node at 0
+    vector<int> depth;
+};
+
+TreeLayout layoutTree(const Node &root)
+{
+    // Flatten the tree in preorder.
+    vector<int> parent, childCount, lastChild, prevSibling, number, depth;
+    {
+        vector<pair<const Node *, int>> stack = {{&root, -1}};
+        while (!stack.empty())
+        {
+            auto [node, up] = stack.back();
+            stack.pop_back();
+            int id = static_cast<int>(parent.size());
+            parent.push_back(up);
+            childCount.push_back(0);
+            lastChild.push_back(-1);
+            depth.push_back(up < 0 ? 0 : depth[up] + 1);
+            prevSibling.push_back(up < 0 ? -1 : lastChild[up]);
+            number.push_back(up < 0 ? 0 : childCount[up]);
+            if (up >= 0)
+            {
+                lastChild[up] = id;
+                ++childCount[up];
+            }
+            for (auto it = node->children.rbegin(); it != node->children.rend(); ++it)
+                stack.push_back({&*it, id});
+        }
+    }
+    const int n = static_cast<int>(parent.size());
+    vector<int> subtreeSize(n, 1);
+    for (int v = n - 1; v > 0; --v)
+        subtreeSize[parent[v]] += subtreeSize[v];
+
+    vector<double> prelim(n, 0), mod(n, 0), change(n, 0), shift(n, 0);
+    vector<int> thread(n, -1), ancestor(n);
+    iota(ancestor.begin(), ancestor.end(), 0);
+
+    auto nextLeft = [&](int v)
+    { return childCount[v] ? v + 1 : thread[v]; };
+    auto nextRight = [&](int v)
+    { return childCount[v] ? lastChild[v] : thread[v]; };
+    auto separation = [&](int a, int b)
+    { return parent[a] == parent[b] ? siblingSeparation : cousinSeparation; };
+    auto moveSubtree = [&](int wm, int wp, double amount)
+    {
+        double subtrees = number[wp] - number[wm];
+        change[wp] -= amount / subtrees;
+        shift[wp] += amount;
+        change[wm] += amount / subtrees;
+        prelim[wp] += amount;
+        mod[wp] += amount;
+    };
+    // Pushes v's subtree right until its left contour clears the right
+    // contour of its left siblings, threading contours as it goes.
+    auto apportion = [&](int v, int defaultAncestor)
+    {
+        int w = prevSibling[v];
+        if (w < 0)
+            return defaultAncestor;
+        int vip = v, vop = v, vim = w, vom = parent[v] + 1;
+        double sip = mod[vip], sop = mod[vop], sim = mod[vim], som = mod[vom];
+        while (nextRight(vim) >= 0 && nextLeft(vip) >= 0)
+        {
+            vim = nextRight(vim);
+            vip = nextLeft(vip);
+            vom = nextLeft(vom);
+            vop = nextRight(vop);
+            ancestor[vop] = v;
+            double gap = (prelim[vim] + sim) - (prelim[vip] + sip) + separation(vim, vip);
+            if (gap > 0)
+            {
+                int a = parent[ancestor[vim]] == parent[v] ? ancestor[vim] : defaultAncestor;
+                moveSubtree(a, v, gap);
+                sip += gap;
+                sop += gap;
+            }
+            sim += mod[vim];
+            sip += mod[vip];
+            som += mod[vom];
+            sop += mod[vop];
+        }
+        if (nextRight(vim) >= 0 && nextRight(vop) < 0)
+        {
+            thread[vop] = nextRight(vim);
+            mod[vop] += sim - sop;
+        }
+        if (nextLeft(vip) >= 0 && nextLeft(vom) < 0)
+        {
+            thread[vom] = nextLeft(vip);
+            mod[vom] += sip - som;
+            defaultAncestor = v;
+        }
+        return defaultAncestor;
+    };
+
+    // First walk (post-order). When v is reached, prelim[c] of each internal
+    // child c holds the midpoint of c's children; here each child is placed
+    // next to its left sibling and apportioned, in left-to-right order.
+    for (int v = n - 1; v >= 0; --v)
+    {
+        if (childCount[v] == 0)
+            continue;
+        int defaultAncestor = v + 1;
+        for (int c = v + 1, k = 0; k < childCount[v]; c += subtreeSize[c], ++k)
+        {
+            int left = prevSibling[c];
+            if (childCount[c] == 0)
+                prelim[c] = left >= 0 ? prelim[left] + separation(left, c) : 0;
+            else if (left >= 0)
+            {
+                double midpoint = prelim[c];
+                prelim[c] = prelim[left] + separation(left, c);
+                mod[c] = prelim[c] - midpoint;
+            }
+            defaultAncestor = apportion(c, defaultAncestor);
+        }
+        // Execute the shifts recorded by moveSubtree, right to left.
+        double totalShift = 0, totalChange = 0;
+        for (int c = lastChild[v]; c >= 0; c = prevSibling[c])
+        {
+            prelim[c] += totalShift;
+            mod[c] += totalShift;
+            totalChange += change[c];
+            totalShift += shift[c] + totalChange;
+        }
+        prelim[v] = (prelim[v + 1] + prelim[lastChild[v]]) / 2;
+    }
+
+    // Second walk: absolute x is prelim plus the mods of all ancestors.
+    TreeLayout layout;
+    layout.x.resize(n);
+    vector<double> modSum(n, 0);
+    double minX = 0;
+    for (int v = 0; v < n; ++v)
+    {
+        if (v > 0)
+            modSum[v] = modSum[parent[v]] + mod[parent[v]];
+        layout.x[v] = prelim[v] + modSum[v];
+        minX = min(minX, layout.x[v]);
+    }
+    for (double &x : layout.x)
+        x -= minX;
+    layout.depth = std::move(depth);
+    return layout;
+}
+
+// Appends "x" (breadth, rounded to 1/100) and "y" (depth) when a layout is
+// given, and "span" ([byte offset, length] in the node's file) with spans.
+json nodeToJson(const Node &node, const Interner &strings, const TreeLayout *layout, bool spans, size_t &id)
+{
+    json j;
+    j["name"] = nodeLabel(node, strings);
+    if (spans)
+        j["span"] = {node.span.offset, node.span.length};
+    if (layout)
+    {
+        j["x"] = round(layout->x[id] * 100) / 100;
+        j["y"] = layout->depth[id];
+    }
+    ++id;
+    j["children"] = json::array();
+    for (const auto &child : node.children)
+    {
+        j["children"].push_back(nodeToJson(child, strings, layout, spans, id));
+    }
+    return j;
+}
+
+json nodeToJson(const Node &node, const Interner &strings, const TreeLayout *layout = nullptr, bool spans = false)
+{
+    size_t id = 0;
+    return nodeToJson(node, strings, layout, spans, id);
+}
+
+// --- Generators ---
+// What it does:
+// Generator<T> is a sequence computed lazily by a coroutine: each co_yield
+// hands one value to the consumer and suspends until the next one is asked
+// for, so the consumer can pause, resume or stop early (destroying the
+// generator discards the rest unevaluated). A coroutine may also co_yield
+// another Generator<T> to produce its values in place, like Python's
+// "yield from". The consumer always resumes the innermost running coroutine
+// directly, so a value costs the same however deep the nesting is, and the
+// nested frames live on the heap instead of the native stack.
+
+template <typename T>
+class Generator
+{
+public:
+    struct promise_type;
+    using Handle = coroutine_handle<promise_type>;
+
+    struct promise_type
+    {
+        const T *value = nullptr;        // root only: the value just yielded
+        promise_type *root = this;       // outermost generator, owned by the consumer
+        promise_type *leaf = this;       // root only: the coroutine to resume next
+        promise_type *parent = nullptr;  // the generator that yielded this one
+        exception_ptr error;
+
+        Generator get_return_object() { return Generator(Handle::from_promise(*this)); }
+        suspend_always initial_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() { error = current_exception(); }
+
+        suspend_always yield_value(const T &v) noexcept
+        {
+            root->value = &v;
+            return {};
+        }
+
+        // co_yield of a nested generator: runs it to completion, then resumes here.
+        auto yield_value(Generator &&nested) noexcept
+        {
+            struct Awaiter
+            {
+                Handle child;
+                bool await_ready() noexcept { return !child; }
+                coroutine_handle<> await_suspend(Handle self) noexcept
+                {
+                    promise_type &inner = child.promise();
+                    inner.root = self.promise().root;
+                    inner.parent = &self.promise();
+                    inner.root->leaf = &inner;
+                    return child;
+                }
+                void await_resume()
+                {
+                    if (child && child.promise().error)
+                        rethrow_exception(child.promise().error);
+                }
+            };
+            return Awaiter{nested.handle};
+        }
+
+        // A finished nested generator hands control straight back to its parent.
+        auto final_suspend() noexcept
+        {
+            struct Awaiter
+            {
+                bool await_ready() noexcept { return false; }
+                coroutine_handle<> await_suspend(Handle self) noexcept
+                {
+                    promise_type *parent = self.promise().parent;
+                    if (!parent)
+                        return noop_coroutine();
+                    self.promise().root->leaf = parent;
+                    return Handle::from_promise(*parent);
+                }
+                void await_resume() noexcept {}
+            };
+            return Awaiter{};
+        }
+    };
+
+    Generator(Generator &&other) noexcept : handle(exchange(other.handle, {})) {}
+    Generator &operator=(Generator &&other) noexcept
+    {
+        if (this != &other)
+        {
+            if (handle)
+                handle.destroy();
+            handle = exchange(other.handle, {});
+        }
+        return *this;
+    }
+    ~Generator()
+    {
+        if (handle)
+            handle.destroy();
+    }
+
+    // Runs until the next value; false once the coroutine has finished.
+    // Exceptions thrown inside the coroutine (or a nested one) surface here.
+    bool next()
+    {
+        if (!handle || handle.done())
+            return false;
+        promise_type &root = handle.promise();
+        Handle::from_promise(*root.leaf).resume();
+        if (!handle.done())
+            return true;
+        if (root.error)
+            rethrow_exception(exchange(root.error, nullptr));
+        return false;
+    }
+
+    // The current value; valid until the next call to next().
+    const T &value() const { return *handle.promise().value; }
+
+    struct Sentinel
+    {
+    };
+
+    class Iterator
+    {
+        Generator *generator;
+
+    public:
+        explicit Iterator(Generator *generator) : generator(generator) {}
+        const T &operator*() const { return generator->value(); }
+        Iterator &operator++()
+        {
+            if (!generator->next())
+                generator = nullptr;
+            return *this;
+        }
+        bool operator!=(Sentinel) const { return generator != nullptr; }
+    };
+
+    Iterator begin() { return Iterator(next() ? this : nullptr); }
+    Sentinel end() { return {}; }
+
+private:
+    Handle handle;
+
+    explicit Generator(Handle handle) : handle(handle) {}
+};
+
+// --- Trace Generation ---
+
+json traceEventToJson(const TraceEvent &event, const Interner &strings)
+{
+    switch (event.action)
+    {
+    case TraceAction::Call: return {{"action", "call"}, {"function", strings.text(event.sym)}};
+    case TraceAction::Return: return {{"action", "return"}, {"function", strings.text(event.sym)}};
+    case TraceAction::VarDecl: return {{"action", "vardecl"}, {"variable", strings.text(event.sym)}};
+    case TraceAction::Assign: return {{"action", "assign"}, {"variable", strings.text(event.sym)}};
+    case TraceAction::ReturnStmt: return {{"action", "return_stmt"}};
+    case TraceAction::IfEnter: return {{"action", "if_enter"}};
+    case TraceAction::IfTaken: return {{"action", "if_taken"}, {"branch", event.thenBranch ? "then" : "else"}};
+    case TraceAction::WhileEnter: return {{"action", "while_enter"}};
+    case TraceAction::Cout: return {{"action", "cout"}};
+    case TraceAction::Cin: return {{"action", "cin"}};
+    }
+    return json::object();
+}
+
+// Returns the FunctionName child of a Function node, or nullptr.
+const Node *functionName(const Node &func)
+{
+    for (const auto &child : func.children)
+        if (child.kind == NodeKind::FunctionName)
+            return &child;
+    return nullptr;
+}
+
+// Binds the arguments of a call to func's parameters, converted to their
+// types; a missing or unusable argument leaves the parameter at zero. All
+// arguments are evaluated before any is bound, since a run shares one set
+// of variables (f(b, a) must not see the new a).
+void bindParameters(const Node &func, const Node *arguments, Variables &vars, const Interner &strings)
+{
+    for (const auto &params : func.children)
+    {
+        if (params.kind != NodeKind::Parameters)
+            continue;
+        vector<Value> values;
+        for (size_t i = 0; i < params.children.size(); ++i)
+            values.push_back(arguments && i < arguments->children.size() ? evalExpr(arguments->children[i], vars, strings) : Value());
+        for (size_t i = 0; i < params.children.size(); ++i)
+        {
+            const Node &param = params.children[i];
+            Value value = convertValue(values[i], param.type);
+            vars[param.sym] = value.has() ? value : initialValue(param.type);
+        }
+    }
+}
+
+// What it does:
+// Walks the tree from `node` like an interpreter and yields one TraceEvent
+// per step as the consumer asks for it; nothing past the last requested
+// event is evaluated. Nested statements and calls are nested generators.
+
+Generator<TraceEvent> simulateExecution(const Node &node, Variables &vars, Session &session)
+{
+    session.poll();
+    const Interner &strings = session.strings;
+    if (node.kind == NodeKind::Function)
+    {
+        const Node *name = functionName(node);
+        if (name)
+        {
+            co_yield TraceEvent{TraceAction::Call, false, name->sym};
+            // Find body and simulate it
+            for (const auto &child : node.children)
+            {
+                if (child.kind == NodeKind::Body)
+                {
+                    for (const auto &stmt : child.children)
+                    {
+                        co_yield simulateExecution(stmt, vars, session);
+                    }
+                }
+            }
+            co_yield TraceEvent{TraceAction::Return, false, name->sym};
+        }
+    }
+    else if (node.kind == NodeKind::VarDecl)
+    {
+        Symbol var = 0;
+        Symbol type = 0;
+        if (!node.children.empty())
+        {
+            var = node.children[0].sym;
+            type = node.children[0].type;
+        }
+        Value val = initialValue(type);
+        if (node.children.size() > 1)
+            val = convertValue(evalExpr(node.children[1], vars, strings), type);
+        vars[var] = val;
+        co_yield TraceEvent{TraceAction::VarDecl, false, var};
+    }
+    else if (node.kind == NodeKind::Assignment)
+    {
+        Symbol var = 0;
+        if (!node.children.empty())
+            var = node.children[0].sym;
+        Value &slot = vars[var];
+        if (node.children.size() > 1)
+            slot = assignValue(slot, evalExpr(node.children[1], vars, strings));
+        co_yield TraceEvent{TraceAction::Assign, false, var};
+    }
+    else if (node.kind == NodeKind::Return)
+    {
+        co_yield TraceEvent{TraceAction::ReturnStmt};
+        if (!node.children.empty())
+            evalExpr(node.children[0], vars, strings);
+    }
+    else if (node.kind == NodeKind::If)
+    {
+        co_yield TraceEvent{TraceAction::IfEnter};
+        bool conditionTrue = false;
+        if (!node.children.empty())
+            conditionTrue = evalExpr(node.children[0], vars, strings).truthy();
+        if (conditionTrue)
+        {
+            co_yield TraceEvent{TraceAction::IfTaken, true};
+            if (node.children.size() > 1)
+                co_yield simulateExecution(node.children[1], vars, session);
+        }
+        else
+        {
+            co_yield TraceEvent{TraceAction::IfTaken, false};
+            if (node.children.size() > 2)
+                co_yield simulateExecution(node.children[2], vars, session);
+        }
+    }
+    else if (node.kind == NodeKind::While)
+    {
+        co_yield TraceEvent{TraceAction::WhileEnter};
+        int loopCount = 0;
+        while (evalExpr(node.children[0], vars, strings).truthy() && loopCount < 10) // prevent infinite loop
+        {
+            if (node.children.size() > 1)
+                co_yield simulateExecution(node.children[1], vars, session);
+            loopCount++;
+        }
+    }
+    else if (node.kind == NodeKind::Cout)
+    {
+        co_yield TraceEvent{TraceAction::Cout};
+        for (const auto &child : node.children)
+            evalExpr(child, vars, strings);
+    }
+    else if (node.kind == NodeKind::Cin)
+    {
+        co_yield TraceEvent{TraceAction::Cin};
+        // For demo, set input variable to 5 if not already set
+        for (const auto &child : node.children)
+        {
+            if (child.kind == NodeKind::Var)
+            {
+                if (vars.count(child.sym) == 0)
+                    vars[child.sym] = Value::ofInt(5);
+            }
+        }
+    }
+    else if (node.kind == NodeKind::FunctionCall)
+    {
+        const Node *callee = nullptr;
+        const Node *arguments = nullptr;
+        for (const auto &child : node.children)
+        {
+            if (child.kind == NodeKind::Callee)
+                callee = &child;
+            else if (child.kind == NodeKind::Arguments)
+                arguments = &child;
+        }
+        if (callee)
+        {
+            checkLimit(session.callDepth + 1, session.limits.depth, "Calls nested too deep");
+            // Scoped so a consumer that stops mid-call still unwinds the depth.
+            struct CallScope
+            {
+                size_t &depth;
+                explicit CallScope(size_t &depth) : depth(depth) { ++depth; }
+                ~CallScope() { --depth; }
+            } scope(session.callDepth);
+            co_yield TraceEvent{TraceAction::Call, false, callee->sym};
+            for (const Node *func : session.allFunctions)
+            {
+                const Node *fname = functionName(*func);
+                if (fname && fname->sym == callee->sym)
+                {
+                    bindParameters(*func, arguments, vars, strings);
+                    co_yield simulateExecution(*func, vars, session);
+                    break;
+                }
+            }
+            co_yield TraceEvent{TraceAction::Return, false, callee->sym};
+        }
+    }
+    else
+    {
+        for (const auto &child : node.children)
+        {
+            co_yield simulateExecution(child, vars, session);
+        }
+    }
+}
+
+// --- Input Loading ---
+
+// What it does:
+// Maps a source file read-only with mmap so the lexer can work on the
+// file's pages directly. If mapping is not possible (empty file, pipe,
+// Windows) the file is read once into a buffer sized from its length.
+// The path "-" means standard input.
+// Throws: Error if the file cannot be opened or read.
+
+class SourceFile
+{
+    const char *data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+    vector<char> buffer;
+
+public:
+    explicit SourceFile(const string &path)
+    {
+#ifndef _WIN32
+        bool isStdin = path == "-";
+        int fd = isStdin ? STDIN_FILENO : open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw runtime_error("Failed to open " + path);
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        {
+            size = static_cast<size_t>(st.st_size);
+            void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED)
+            {
+                madvise(addr, size, MADV_SEQUENTIAL);
+                data = static_cast<const char *>(addr);
+                mapped = true;
+                if (!isStdin)
+                    close(fd);
+                return;
+            }
+        }
+        // Fallback: one read() pass into a pre-sized buffer (one spare byte
+        // so a regular file hits EOF without growing it)
+        buffer.resize(size + 1);
+        size_t filled = 0;
+        while (true)
+        {
+            if (filled == buffer.size())
+                buffer.resize(max<size_t>(4096, buffer.size() * 2));
+            ssize_t n = read(fd, buffer.data() + filled, buffer.size() - filled);
+            if (n < 0)
+            {
+                if (!isStdin)
+                    close(fd);
+                throw runtime_error("Failed to read " + path);
+            }
+            if (n == 0)
+                break;
+            filled += static_cast<size_t>(n);
+        }
+        if (!isStdin)
+            close(fd);
+        size = filled;
+#else
+        if (path == "-")
+        {
+            buffer.assign(istreambuf_iterator<char>(cin), istreambuf_iterator<char>());
+            size = buffer.size();
+            data = buffer.data();
+            return;
+        }
+        ifstream file(path, ios::binary | ios::ate);
+        if (!file.is_open())
+            throw runtime_error("Failed to open " + path);
+        buffer.resize(static_cast<size_t>(file.tellg()));
+        file.seekg(0);
+        file.read(buffer.data(), static_cast<streamsize>(buffer.size()));
+        size = buffer.size();
+#endif
+        data = buffer.data();
+    }
+
+    ~SourceFile()
+    {
+#ifndef _WIN32
+        if (mapped)
+            munmap(const_cast<char *>(data), size);
+#endif
+    }
+
+    SourceFile(const SourceFile &) = delete;
+    SourceFile &operator=(const SourceFile &) = delete;
+
+    string_view text() const { return string_view(data, size); }
+};
+
+// --- Running ---
+
+// Counters and timings for one run, reported in batch summaries.
+struct RunStats
+{
+    size_t tokens = 0;
+    size_t nodes = 0;
+    double lexMs = 0;
+    double parseMs = 0;
+    double simulateMs = 0;
+    double layoutMs = 0;
+};
+
+double elapsedMs(chrono::steady_clock::time_point since)
+{
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - since).count();
+}
+
+size_t countNodes(const Node &node)
+{
+    size_t count = 1;
+    for (const auto &child : node.children)
+        count += countNodes(child);
+    return count;
+}
+
+// Lexes and parses one source text into session and returns its Program node.
+// Syntax errors the parser recovered from are added to session.syntaxErrors
+// and the tree leaves out what they skipped; a lexer error is thrown. Either
+// way the message gets the line and column.
+Node parseSource(string_view code, Session &session, RunStats &stats)
+{
+    auto start = chrono::steady_clock::now();
+    checkLimit(code.size(), session.limits.inputBytes, "Input too large");
+    checkLimit(code.size(), UINT32_MAX, "Input too large"); // spans are 32-bit
+    LineIndex lines(code);
+    size_t firstError = session.syntaxErrors.size();
+    Node unit = {NodeKind::Program};
+    try
+    {
+        if (session.pipeline)
+        {
+            // Lexing overlaps parsing, so its time is part of parseMs.
+            TokenPipe tokens(code, session.strings, session.pipeline, session.cancel, session.limits.tokens);
+            size_t symbols = session.symbolTable.size(), functions = session.allFunctions.size();
+            try
+            {
+                Parser parser(tokens, session);
+                unit = parser.parse();
+            }
+            catch (const exception &)
+            {
+                // Lexing first would have failed before parsing anything:
+                // drop what the parser added up to the lexer's error.
+                if (tokens.lexerFailed())
+                {
+                    session.symbolTable.resize(symbols);
+                    session.allFunctions.resize(functions);
+                    session.syntaxErrors.erase(session.syntaxErrors.begin() + firstError, session.syntaxErrors.end());
+                }
+                throw;
+            }
+            stats.tokens += tokens.count();
+            stats.parseMs += elapsedMs(start);
+        }
+        else
+        {
+            auto lexed = tokenizeParallel(code, session.strings, session.lexThreads, session.cancel, session.limits.tokens);
+            stats.lexMs += elapsedMs(start);
+            stats.tokens += lexed.size();
+
+            start = chrono::steady_clock::now();
+            TokenArray tokens(lexed);
+            Parser parser(tokens, session);
+            unit = parser.parse();
+            stats.parseMs += elapsedMs(start);
+        }
+    }
+    catch (const SyntaxError &error)
+    {
+        throw SyntaxError(error.what() + lines.describe(error.span.offset), error.span);
+    }
+    for (size_t i = firstError; i < session.syntaxErrors.size(); ++i)
+    {
+        SyntaxError &error = session.syntaxErrors[i];
+        error = SyntaxError(error.what() + lines.describe(error.span.offset), error.span);
+    }
+    return unit;
+}
+
+// What it does:
+// Lexes and parses each file into the same session and returns the tree.
+// A single file yields its Program node directly; several files become
+// "File: <path>" subtrees of one Program so calls can cross files.
+
+Node parseFiles(const vector<string> &paths, Session &session, RunStats &stats)
+{
+    Node tree = {NodeKind::Program};
+    for (const auto &path : paths)
+    {
+        Node unit = {NodeKind::Program};
+        size_t firstError = session.syntaxErrors.size();
+        try
+        {
+            auto start = chrono::steady_clock::now();
+            SourceFile source(path);
+            stats.lexMs += elapsedMs(start);
+            unit = parseSource(source.text(), session, stats);
+        }
+        catch (const exception &e)
+        {
+            throw runtime_error(paths.size() > 1 ? path + ": " + e.what() : string(e.what()));
+        }
+        if (paths.size() > 1)
+            for (size_t i = firstError; i < session.syntaxErrors.size(); ++i)
+            {
+                SyntaxError &error = session.syntaxErrors[i];
+                error = SyntaxError(path + ": " + error.what(), error.span);
+            }
+        if (paths.size() == 1)
+            tree = std::move(unit);
+        else
+        {
+            unit.kind = NodeKind::File;
+            unit.sym = session.strings.intern(path);
+            tree.children.push_back(std::move(unit));
+        }
+    }
+    stats.nodes = countNodes(tree);
+    return tree;
+}
+
+// The trace of running the program from main, produced lazily.
+Generator<TraceEvent> programTrace(Session &session)
+{
+    for (const Node *func : session.allFunctions)
+    {
+        const Node *name = functionName(*func);
+        if (name && name->sym == SymMain)
+        {
+            Variables vars;
+            co_yield simulateExecution(*func, vars, session);
+        }
+    }
+}
+
+// Simulate execution starting from main, recording the whole trace
+void simulateProgram(Session &session, RunStats &stats)
+{
+    auto start = chrono::steady_clock::now();
+    for (const TraceEvent &event : programTrace(session))
+    {
+        checkLimit(session.trace.size() + 1, session.limits.traceEvents, "Trace too long");
+        session.trace.push_back(event);
+    }
+    stats.simulateMs += elapsedMs(start);
+}
+
+json traceToJson(const Session &session)
+{
+    json traceJson = json::array();
+    for (const auto &event : session.trace)
+    {
+        session.poll();
+        traceJson.push_back(traceEventToJson(event, session.strings));
+    }
+    return traceJson;
+}
+
+json symbolTableToJson(const Session &session)
+{
+    json symtab = json::array();
+    for (const auto &entry : session.symbolTable)
+    {
+        session.poll();
+        json row;
+        row["name"] = session.strings.text(entry.name);
+        row["type"] = session.strings.text(entry.type) + (entry.isFunction ? " (function)" : "");
+        row["scope"] = session.strings.text(entry.scope);
+        if (entry.value.has())
+            row["value"] = valueToJson(entry.value, session.strings);
+        symtab.push_back(row);
+    }
+    return symtab;
+}
+
+// Syntax errors the parser recovered from: [{"message", "span": [offset, length]}].
+json diagnosticsToJson(const Session &session)
+{
+    json diagnostics = json::array();
+    for (const auto &error : session.syntaxErrors)
+        diagnostics.push_back({{"message", error.what()}, {"span", {error.span.offset, error.span.length}}});
+    return diagnostics;
+}
+
+// For runs that only go on with a whole program (files on disk, --svg,
+// --batch): fails with every recovered syntax error, one per line.
+void requireValidSyntax(const Session &session)
+{
+    if (session.syntaxErrors.empty())
+        return;
+    string message;
+    for (const auto &error : session.syntaxErrors)
+        message += (message.empty() ? "" : "\n") + string(error.what());
+    throw runtime_error(message);
+}
+
+// --- Output Formats ---
+// JSON for people and the default frontend; CBOR / MessagePack (both built
+// into json.hpp) for smaller payloads that skip text parsing in the browser.
+
+enum class OutputFormat
+{
+    Json,
+    Cbor,
+    MsgPack
+};
+
+OutputFormat parseOutputFormat(const string &name)
+{
+    if (name == "json")
+        return OutputFormat::Json;
+    if (name == "cbor")
+        return OutputFormat::Cbor;
+    if (name == "msgpack")
+        return OutputFormat::MsgPack;
+    throw runtime_error("Unknown output format: " + name + " (expected json, cbor or msgpack)");
+}
+
+const char *formatExtension(OutputFormat format)
+{
+    switch (format)
+    {
+    case OutputFormat::Json: return "json";
+    case OutputFormat::Cbor: return "cbor";
+    case OutputFormat::MsgPack: return "msgpack";
+    }
+    return "json";
+}
+
+// JSON text of j. Source files need not be UTF-8, and their text reaches
+// labels, values and error messages, so invalid bytes are written as U+FFFD
+// instead of failing the whole document. Every JSON writer goes through
+// this or writeDocument.
+string jsonText(const json &j, int indent = -1)
+{
+    return j.dump(indent, ' ', false, json::error_handler_t::replace);
+}
+
+// Serializes j to out; indent only applies to JSON (-1 = compact). JSON is
+// streamed rather than dumped to a string first: indented, a deep tree (a
+// long operator chain) is far larger than the tree itself.
+void writeDocument(const json &j, ostream &out, OutputFormat format, int indent)
+{
+    switch (format)
+    {
+    case OutputFormat::Json:
+    {
+        nlohmann::detail::serializer<json> serializer(nlohmann::detail::output_adapter<char>(out), ' ', json::error_handler_t::replace);
+        serializer.dump(j, indent >= 0, false, static_cast<unsigned>(max(indent, 0)));
+        break;
+    }
+    case OutputFormat::Cbor:
+        json::to_cbor(j, out);
+        break;
+    case OutputFormat::MsgPack:
+        json::to_msgpack(j, out);
+        break;
+    }
+}
+
+// How results are written: the serialization format, and whether tree
+// nodes carry server-computed x/y coordinates (--layout) and their source
+// spans (--spans).
+struct OutputOptions
+{
+    OutputFormat format = OutputFormat::Json;
+    bool layout = false;
+    bool spans = false;
+};
+
+json treeToJson(const Node &tree, const Session &session, const OutputOptions &options, RunStats &stats)
+{
+    if (!options.layout)
+        return nodeToJson(tree, session.strings, nullptr, options.spans);
+    auto start = chrono::steady_clock::now();
+    TreeLayout layout = layoutTree(tree);
+    stats.layoutMs += elapsedMs(start);
+    return nodeToJson(tree, session.strings, &layout, options.spans);
+}
+
+// What it does:
+// Builds the single document --pipe writes to stdout: the tree, trace and
+// symbol table plus the errors and counters of the run. tree is null when
+// parsing failed, and partial when the parser recovered from syntax errors
+// (listed with their spans under "diagnostics").
+
+json runDocument(const Node *tree, const Session &session, RunStats &stats, const vector<string> &errors, const OutputOptions &options)
+{
+    json doc;
+    doc["tree"] = tree ? treeToJson(*tree, session, options, stats) : json(nullptr);
+    doc["trace"] = traceToJson(session);
+    doc["symbols"] = symbolTableToJson(session);
+    doc["errors"] = errors;
+    doc["diagnostics"] = diagnosticsToJson(session);
+    doc["stats"] = {
+        {"tokens", stats.tokens},
+        {"nodes", stats.nodes},
+        {"trace_events", session.trace.size()},
+        {"lex_ms", stats.lexMs},
+        {"parse_ms", stats.parseMs},
+        {"simulate_ms", stats.simulateMs},
+        {"layout_ms", stats.layoutMs}};
+    return doc;
+}
+
+// Writes <prefix>tree.<ext>, <prefix>trace.<ext> and <prefix>symbol_table.<ext>
+// (the trace is left out when it is streamed instead, see streamTrace).
+void writeOutputs(const Node &tree, const Session &session, RunStats &stats, const string &prefix, const OutputOptions &options, bool withTrace = true)
+{
+    string ext = formatExtension(options.format);
+    ofstream out(prefix + "tree." + ext, ios::binary);
+    writeDocument(treeToJson(tree, session, options, stats), out, options.format, 4);
+    if (withTrace)
+    {
+        ofstream traceOut(prefix + "trace." + ext, ios::binary);
+        writeDocument(traceToJson(session), traceOut, options.format, 4);
+        if (!traceOut)
+            throw runtime_error("Failed to write outputs to " + prefix + "trace." + ext);
+    }
+    ofstream symtabOut(prefix + "symbol_table." + ext, ios::binary);
+    writeDocument(symbolTableToJson(session), symtabOut, options.format, 4);
+    if (!out || !symtabOut)
+        throw runtime_error("Failed to write outputs to " + prefix + "*." + ext);
+}
+
+// --- Buffered Writer ---
+// Collects small writes in a fixed buffer and hands them to the FILE in
+// large blocks, so streaming output costs neither a syscall per item nor
+// a copy of the whole document in memory.
+
+class BufferedWriter
+{
+    FILE *out;
+    array<char, 1 << 16> buffer;
+    size_t used = 0;
+
+public:
+    explicit BufferedWriter(FILE *out) : out(out) {}
+    ~BufferedWriter() { flush(); }
+
+    void write(string_view text)
+    {
+        if (text.size() > buffer.size() - used)
+        {
+            flush();
+            if (text.size() > buffer.size())
+            {
+                fwrite(text.data(), 1, text.size(), out);
+                return;
+            }
+        }
+        memcpy(buffer.data() + used, text.data(), text.size());
+        used += text.size();
+    }
+
+    void number(double value)
+    {
+        char digits[32];
+        auto result = to_chars(digits, digits + sizeof(digits), round(value * 10) / 10);
+        write(string_view(digits, static_cast<size_t>(result.ptr - digits)));
+    }
+
+    void flush()
+    {
+        if (used > 0)
+            fwrite(buffer.data(), 1, used, out);
+        used = 0;
+        fflush(out);
+    }
+
+    bool failed() const { return ferror(out) != 0; }
+};
+
+// --- Streaming Trace ---
+// What it does:
+// Runs the simulation and writes each trace event as one NDJSON line as
+// soon as it is produced, instead of collecting session.trace and writing
+// one array at the end. Lines go through a BufferedWriter that is flushed
+// at most every 10 ms (and right after the first event), so a reader can
+// start animating at once without a syscall per event, and memory stays
+// flat however long the trace is. A run that fails ends the stream with
+// an {"error": ...} line; a reader that goes away stops the simulation.
+
+size_t streamTrace(Session &session, BufferedWriter &out, RunStats &stats)
+{
+    auto start = chrono::steady_clock::now();
+    auto lastFlush = start - chrono::hours(1);
+    size_t events = 0;
+    try
+    {
+        for (const TraceEvent &event : programTrace(session))
+        {
+            checkLimit(++events, session.limits.traceEvents, "Trace too long");
+            out.write(jsonText(traceEventToJson(event, session.strings)));
+            out.write("\n");
+            auto now = chrono::steady_clock::now();
+            if (now - lastFlush >= chrono::milliseconds(10))
+            {
+                out.flush();
+                lastFlush = now;
+                if (out.failed())
+                    throw runtime_error("Failed to write the trace stream");
+            }
+        }
+    }
+    catch (const exception &e)
+    {
+        out.write(jsonText({{"error", e.what()}}));
+        out.write("\n");
+        out.flush();
+        throw;
+    }
+    out.flush();
+    stats.simulateMs += elapsedMs(start);
+    return events;
+}
+
+// --- SVG Export ---
+
+// Node fill, matching getNodeColor() in script.js (which tests label prefixes,
+// so e.g. FunctionCall and ReturnType take the Function / Return colors).
+const char *nodeColor(NodeKind kind)
+{
+    switch (kind)
+    {
+    case NodeKind::Function:
+    case NodeKind::FunctionName:
+    case NodeKind::FunctionCall: return "url(#func-gradient)";
+    case NodeKind::If: return "#ff6f61";
+    case NodeKind::While: return "#6a4c93";
+    case NodeKind::Assignment: return "#43aa8b";
+    case NodeKind::Return:
+    case NodeKind::ReturnType: return "#f9c846";
+    case NodeKind::VarDecl: return "#577590";
+    case NodeKind::Parameters: return "#4d908e";
+    case NodeKind::Arguments: return "#90be6d";
+    case NodeKind::Expr: return "#277da1";
+    case NodeKind::Block:
+    case NodeKind::Body: return "#b5838d";
+    case NodeKind::Program: return "#f9844a";
+    default: return "#adb5bd";
+    }
+}
+
+void writeEscaped(BufferedWriter &out, string_view text)
+{
+    size_t start = 0;
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        const char *entity = nullptr;
+        switch (text[i])
+        {
+        case '&': entity = "&amp;"; break;
+        case '<': entity = "&lt;"; break;
+        case '>': entity = "&gt;"; break;
+        case '"': entity = "&quot;"; break;
+        }
+        if (entity)
+        {
+            out.write(text.substr(start, i - start));
+            out.write(entity);
+            start = i + 1;
+        }
+    }
+    out.write(text.substr(start));
+}
+
+// What it does:
+// Lays the tree out (layoutTree) and streams it as SVG: first every edge as
+// a horizontal cubic link (like d3.linkHorizontal), then every node as a
+// circle + label, styled like renderTree(). Nodes are visited with an
+// explicit preorder stack whose ids match the layout's, and text goes
+// through a BufferedWriter, so memory beyond the layout arrays stays
+// bounded and nothing deep recurses.
+
+void writeSvg(const Node &root, const Interner &strings, FILE *file)
+{
+    const double breadthStep = 16; // px per layout unit (siblings are 2.5 units apart)
+    const double depthStep = 220;  // px per level
+    const double margin = 120;
+
+    TreeLayout layout = layoutTree(root);
+    double maxX = 0;
+    int maxDepth = 0;
+    for (size_t v = 0; v < layout.x.size(); ++v)
+    {
+        maxX = max(maxX, layout.x[v]);
+        maxDepth = max(maxDepth, layout.depth[v]);
+    }
+    auto px = [&](uint32_t id)
+    { return margin + layout.depth[id] * depthStep; };
+    auto py = [&](uint32_t id)
+    { return margin + layout.x[id] * breadthStep; };
+
+    BufferedWriter out(file);
+    out.write("<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"");
+    out.number(2 * margin + maxDepth * depthStep + 400);
+    out.write("\" height=\"");
+    out.number(2 * margin + maxX * breadthStep);
+    out.write("\">\n<defs><linearGradient id=\"func-gradient\" x1=\"0%\" y1=\"0%\" x2=\"100%\" y2=\"100%\">"
+              "<stop offset=\"0%\" stop-color=\"#1971c2\"/><stop offset=\"100%\" stop-color=\"#4dabf7\"/>"
+              "</linearGradient></defs>\n"
+              "<style>text{font-size:13px;font-family:\"Segoe UI\",Roboto,sans-serif;fill:#343a40}</style>\n");
+
+    // Preorder walk yielding (node, id, parent id).
+    auto walk = [&](auto &&visit)
+    {
+        vector<pair<const Node *, uint32_t>> stack = {{&root, UINT32_MAX}};
+        uint32_t id = 0;
+        while (!stack.empty())
+        {
+            auto [node, parent] = stack.back();
+            stack.pop_back();
+            visit(*node, id, parent);
+            for (auto it = node->children.rbegin(); it != node->children.rend(); ++it)
+                stack.push_back({&*it, id});
+            ++id;
+        }
+    };
+
+    out.write("<g fill=\"none\" stroke=\"#adb5bd\" stroke-width=\"1.2\" stroke-opacity=\"0.8\">\n");
+    walk([&](const Node &, uint32_t id, uint32_t parent)
+         {
+        if (parent == UINT32_MAX)
+            return;
+        double sx = px(parent), sy = py(parent), tx = px(id), ty = py(id), mx = (sx + tx) / 2;
+        out.write("<path d=\"M");
+        out.number(sx); out.write(","); out.number(sy);
+        out.write("C"); out.number(mx); out.write(","); out.number(sy);
+        out.write(" "); out.number(mx); out.write(","); out.number(ty);
+        out.write(" "); out.number(tx); out.write(","); out.number(ty);
+        out.write("\"/>\n"); });
+    out.write("</g>\n<g stroke=\"#22223b\" stroke-width=\"2\">\n");
+    walk([&](const Node &node, uint32_t id, uint32_t)
+         {
+        bool leaf = node.children.empty();
+        out.write("<g transform=\"translate(");
+        out.number(px(id)); out.write(","); out.number(py(id));
+        out.write(")\"><circle r=\"12\" fill=\"");
+        out.write(nodeColor(node.kind));
+        out.write(leaf ? "\"/><text stroke=\"none\" dy=\"5\" x=\"20\">"
+                       : "\"/><text stroke=\"none\" dy=\"5\" x=\"-20\" text-anchor=\"end\">");
+        writeEscaped(out, nodeLabel(node, strings));
+        out.write("</text></g>\n"); });
+    out.write("</g>\n</svg>\n");
+    out.flush();
+    if (out.failed())
+        throw runtime_error("Failed to write SVG");
+}
+
+// --- Thread Pool ---
+
+// Fixed set of worker threads pulling tasks from one queue.
+// wait() blocks until every submitted task has finished.
+
+class ThreadPool
+{
+    vector<thread> workers;
+    deque<function<void()>> tasks;
+    mutex lock;
+    condition_variable ready;
+    condition_variable idle;
+    size_t running = 0;
+    bool stopping = false;
+
+    void work()
+    {
+        while (true)
+        {
+            function<void()> task;
+            {
+                unique_lock<mutex> guard(lock);
+                ready.wait(guard, [&]
+                           { return stopping || !tasks.empty(); });
+                if (tasks.empty())
+                    return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+                ++running;
+            }
+            task();
+            {
+                lock_guard<mutex> guard(lock);
+                --running;
+                if (tasks.empty() && running == 0)
+                    idle.notify_all();
+            }
+        }
+    }
+
+public:
+    explicit ThreadPool(size_t threads)
+    {
+        for (size_t i = 0; i < max<size_t>(1, threads); ++i)
+            workers.emplace_back([this]
+                                 { work(); });
+    }
+
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (auto &worker : workers)
+            worker.join();
+    }
+
+    void submit(function<void()> task)
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            tasks.push_back(std::move(task));
+        }
+        ready.notify_one();
+    }
+
+    void wait()
+    {
+        unique_lock<mutex> guard(lock);
+        idle.wait(guard, [&]
+                  { return tasks.empty() && running == 0; });
+    }
+
+    size_t size() const { return workers.size(); }
+};
+
+// --- Batch Mode ---
+
+// What it does:
+// Collects the sources for --batch: every .cpp/.cc/.cxx file under a
+// directory (recursively), or the paths listed one per line in a file.
+
+vector<filesystem::path> collectBatchFiles(const filesystem::path &source)
+{
+    vector<filesystem::path> files;
+    if (filesystem::is_directory(source))
+    {
+        for (const auto &entry : filesystem::recursive_directory_iterator(source))
+        {
+            string ext = entry.path().extension().string();
+            if (entry.is_regular_file() && (ext == ".cpp" || ext == ".cc" || ext == ".cxx"))
+                files.push_back(entry.path());
+        }
+        sort(files.begin(), files.end());
+    }
+    else
+    {
+        ifstream list(source);
+        if (!list.is_open())
+            throw runtime_error("Failed to open " + source.string());
+        string line;
+        while (getline(list, line))
+        {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            if (!line.empty())
+                files.emplace_back(line);
+        }
+    }
+    return files;
+}
+
+// Runs one batch file end to end and reports how it went.
+// Outputs mirror the file's path under outDir: <outDir>/<rel>.tree.<ext>, ...
+json processBatchFile(const filesystem::path &file, const filesystem::path &base, const filesystem::path &outDir, const OutputOptions &options, const Limits &limits)
+{
+    json result = {{"file", file.string()}};
+    RunStats stats;
+    auto start = chrono::steady_clock::now();
+    try
+    {
+        Session session;
+        session.limits = limits;
+        Node tree = parseFiles({file.string()}, session, stats);
+        requireValidSyntax(session);
+        simulateProgram(session, stats);
+
+        filesystem::path rel = file.lexically_relative(base);
+        if (rel.empty() || *rel.begin() == "..")
+            rel = file.filename();
+        filesystem::path out = outDir / rel;
+        filesystem::create_directories(out.parent_path());
+        writeOutputs(tree, session, stats, out.string() + ".", options);
+        result["ok"] = true;
+        result["trace_events"] = session.trace.size();
+        result["symbols"] = session.symbolTable.size();
+    }
+    catch (const exception &e)
+    {
+        result["ok"] = false;
+        result["error"] = e.what();
+    }
+    result["tokens"] = stats.tokens;
+    result["nodes"] = stats.nodes;
+    result["lex_ms"] = stats.lexMs;
+    result["parse_ms"] = stats.parseMs;
+    result["simulate_ms"] = stats.simulateMs;
+    result["layout_ms"] = stats.layoutMs;
+    result["total_ms"] = elapsedMs(start);
+    return result;
+}
+
+// What it does:
+// Processes every file of a batch on a thread pool (one task per file,
+// each with its own Session, so workers share nothing but the result
+// slots) and writes <outDir>/summary.json with per-file results, error
+// count, totals and wall time.
+
+int runBatch(const string &source, const string &outDir, size_t threads, const OutputOptions &options, const Limits &limits)
+{
+    auto start = chrono::steady_clock::now();
+    vector<filesystem::path> files = collectBatchFiles(source);
+    filesystem::path base = filesystem::is_directory(source) ? filesystem::path(source) : filesystem::current_path();
+    filesystem::create_directories(outDir);
+
+    vector<json> results(files.size());
+    {
+        ThreadPool pool(threads);
+        threads = pool.size();
+        for (size_t i = 0; i < files.size(); ++i)
+            pool.submit([&, i]
+                        { results[i] = processBatchFile(files[i], base, outDir, options, limits); });
+        pool.wait();
+    }
+
+    size_t failed = 0, tokens = 0, nodes = 0;
+    double cpuMs = 0;
+    for (const auto &result : results)
+    {
+        failed += result["ok"].get<bool>() ? 0 : 1;
+        tokens += result["tokens"].get<size_t>();
+        nodes += result["nodes"].get<size_t>();
+        cpuMs += result["total_ms"].get<double>();
+    }
+    double wallMs = elapsedMs(start);
+    json summary = {
+        {"files", files.size()},
+        {"failed", failed},
+        {"threads", threads},
+        {"wall_ms", wallMs},
+        {"cpu_ms", cpuMs},
+        {"tokens", tokens},
+        {"nodes", nodes},
+        {"results", results}};
+    ofstream summaryOut(filesystem::path(outDir) / "summary.json");
+    summaryOut << jsonText(summary, 4);
+
+    cout << "Processed " << files.size() << " files (" << failed << " failed) in "
+         << wallMs << " ms on " << threads << " threads\n";
+    cout << "Summary saved to " << (filesystem::path(outDir) / "summary.json").string() << "\n";
+    return failed == 0 ? 0 : 2;
+}
+
+// --- Daemon ---
+// Long-lived mode (--daemon) that keeps parsed trees in memory and serves
+// them a window at a time, so a huge program never has to be sent whole.
+//
+// Protocol (stdin/stdout):
+//   request:  one JSON object per line, {"id": <uint>, "op": ..., ...}
+//   response: "<id> <length>\n" followed by <length> bytes of payload,
+//             encoded as the request's "format" (json, cbor or msgpack).
+//
+// Ops:
+//   parse    {code, depth?, limit?, budget?, layout?, trace?} -> {doc, nodes, tree, trace, symbols, errors, diagnostics, stats, extent?}
+//   subtree  {doc, node, depth?, offset?, limit?, budget?} -> {doc, node, tree}
+//   step     {doc, count?, restart?} -> {doc, events, done}
+//   locate   {doc, offset, end?, limit?} -> {doc, node, path, nodes?, more?}
+//   close    {doc}
+//   cancel   {target} -> {cancelled: target, found}
+//   stats    {} -> {requests, runs, coalesced, cancelled, shed, documents}
+//
+// A parse with syntax errors still answers a document: its tree leaves out
+// the statements and functions the parser skipped to recover, "errors"
+// lists every error and "diagnostics" adds their spans. Such a program is
+// not run, so its trace is empty. Only a lexer error answers doc: null.
+//
+// "step" runs the document's program lazily and returns its next `count`
+// trace events, pausing there until the next step; nothing beyond them is
+// simulated. Parse with "trace": false to skip the eager trace and only step.
+//
+// Nodes are addressed by preorder id (root = 0). A window holds at most
+// `depth` levels below its root, `limit` children per node and `budget`
+// nodes in total, filled breadth-first. A node whose children were not all
+// sent carries "childCount" so the client can page them in with subtree
+// (offset = number of children it already has). Every node carries
+// "span": [byte offset, length] of its source in the parsed code.
+//
+// "locate" maps a byte offset of the code to the innermost node there
+// (the Program root between functions, null past the end), with "path":
+// the ids of its ancestors from the root, so a client can page its way
+// down to it. With "end" it also lists the ids of all nodes overlapping
+// [offset, end), at most `limit` of them ("more": true if there were
+// others). Both are binary searches over an
+// index built with the document (see Document::indexSpans).
+//
+// Requests run one at a time on a worker thread while the main thread keeps
+// reading, so "cancel" can stop a queued or running request; that request
+// then answers {"error": "Cancelled", "cancelled": true}.
+//
+// Identical parse requests (same code and window, any format) that arrive
+// while one is queued or running share that run: every waiter gets the same
+// payload and the same doc, which stays open until each of them closed it.
+//
+// Requests are bounded by Limits: runs stop with an error once they pass a
+// cap, a line longer than the input cap allows is skipped unread, and while
+// `queue` requests are waiting new ones are refused with "overloaded": true.
+
+// A parsed program retained by the daemon.
+struct Document
+{
+    static constexpr uint32_t NoNode = UINT32_MAX;
+
+    Session session;
+    Node tree = {NodeKind::Program};
+    vector<const Node *> nodes;   // preorder id -> node
+    vector<uint32_t> subtreeSize; // preorder id -> nodes in its subtree
+    vector<uint32_t> parent;      // preorder id -> parent id (NoNode for the root)
+    vector<pair<uint32_t, uint32_t>> innermost; // (offset, node innermost from there on), by offset
+    unique_ptr<TreeLayout> layout;
+    uint64_t lastUsed = 0;
+    size_t owners = 1; // clients that share it through a coalesced parse
+    mutex stepLock;
+    optional<Generator<TraceEvent>> stepper; // the paused "step" run (uses session)
+    size_t stepped = 0;                      // events it has produced
+
+    void index()
+    {
+        vector<pair<const Node *, uint32_t>> stack = {{&tree, NoNode}};
+        while (!stack.empty())
+        {
+            auto [node, up] = stack.back();
+            stack.pop_back();
+            nodes.push_back(node);
+            parent.push_back(up);
+            uint32_t id = static_cast<uint32_t>(nodes.size() - 1);
+            for (auto it = node->children.rbegin(); it != node->children.rend(); ++it)
+                stack.push_back({&*it, id});
+        }
+        subtreeSize.assign(nodes.size(), 1);
+        for (size_t v = nodes.size() - 1; v > 0; --v)
+            subtreeSize[parent[v]] += subtreeSize[v];
+        indexSpans();
+    }
+
+    // What it does:
+    // Builds `innermost`: the source offsets where the innermost node
+    // changes, each with the node from there to the next one. Spans nest
+    // like the tree (children inside their parent, siblings apart), so one
+    // preorder pass meets the boundaries in order: a node's start hands the
+    // offsets to it, its end hands them back to its parent. When several
+    // boundaries fall on one offset the last one (the deepest node) wins.
+    void indexSpans()
+    {
+        vector<uint32_t> open; // the nodes containing the current one, and it
+        auto mark = [&](uint32_t offset, uint32_t node)
+        {
+            if (!innermost.empty() && innermost.back().first >= offset)
+                innermost.back().second = node;
+            else
+                innermost.push_back({offset, node});
+        };
+        auto closeBefore = [&](size_t id)
+        {
+            while (!open.empty() && open.back() + subtreeSize[open.back()] <= id)
+            {
+                const Span &span = nodes[open.back()]->span;
+                open.pop_back();
+                mark(span.offset + span.length, open.empty() ? NoNode : open.back());
+            }
+        };
+        for (uint32_t id = 0; id < nodes.size(); ++id)
+        {
+            closeBefore(id);
+            mark(nodes[id]->span.offset, id);
+            open.push_back(id);
+        }
+        closeBefore(nodes.size());
+    }
+
+    // The innermost node whose span contains offset, or NoNode.
+    uint32_t nodeAt(uint32_t offset) const
+    {
+        auto after = upper_bound(innermost.begin(), innermost.end(), offset, [](uint32_t at, const pair<uint32_t, uint32_t> &boundary)
+                                 { return at < boundary.first; });
+        return after == innermost.begin() ? NoNode : prev(after)->second;
+    }
+
+    // The first node, in preorder, that starts after offset. Preorder lists
+    // spans by start, so the nodes starting in a range are a run of ids.
+    uint32_t firstStartingAfter(uint32_t offset) const
+    {
+        auto it = partition_point(nodes.begin(), nodes.end(), [&](const Node *node)
+                                  { return node->span.offset <= offset; });
+        return static_cast<uint32_t>(it - nodes.begin());
+    }
+};
+
+struct WindowLimits
+{
+    int depth = 3;
+    size_t limit = 100;
+    size_t budget = 1000;
+    size_t offset = 0; // first child of the window root to include
+};
+
+// What it does:
+// Picks the nodes of the window breadth-first (so upper levels win when the
+// budget runs out), then serializes them as a nested tree. Work and output
+// are bounded by the budget, not by the size of the program.
+
+json windowToJson(const Document &doc, uint32_t rootId, const WindowLimits &limits)
+{
+    unordered_map<uint32_t, vector<uint32_t>> shown; // node -> children sent
+    size_t budget = limits.budget > 0 ? limits.budget - 1 : 0;
+    deque<pair<uint32_t, int>> queue = {{rootId, 0}};
+    while (!queue.empty() && budget > 0)
+    {
+        auto [id, level] = queue.front();
+        queue.pop_front();
+        if (level >= limits.depth)
+            continue;
+        const Node *node = doc.nodes[id];
+        size_t skip = id == rootId ? limits.offset : 0;
+        uint32_t child = id + 1;
+        for (size_t i = 0; i < node->children.size() && budget > 0; ++i, child += doc.subtreeSize[child])
+        {
+            if (i < skip)
+                continue;
+            if (i >= skip + limits.limit)
+                break;
+            shown[id].push_back(child);
+            queue.push_back({child, level + 1});
+            --budget;
+        }
+    }
+
+    function<json(uint32_t)> emit = [&](uint32_t id)
+    {
+        const Node *node = doc.nodes[id];
+        json j;
+        j["id"] = id;
+        j["name"] = nodeLabel(*node, doc.session.strings);
+        j["span"] = {node->span.offset, node->span.length};
+        if (doc.layout)
+        {
+            j["x"] = round(doc.layout->x[id] * 100) / 100;
+            j["y"] = doc.layout->depth[id];
+        }
+        auto it = shown.find(id);
+        size_t sent = it == shown.end() ? 0 : it->second.size();
+        if (sent > 0)
+        {
+            j["children"] = json::array();
+            for (uint32_t child : it->second)
+                j["children"].push_back(emit(child));
+        }
+        if (sent < node->children.size())
+            j["childCount"] = node->children.size();
+        return j;
+    };
+    return emit(rootId);
+}
+
+// Counters reported by the "stats" op.
+struct DaemonMetrics
+{
+    atomic<uint64_t> requests{0};  // requests read
+    atomic<uint64_t> runs{0};      // requests actually executed
+    atomic<uint64_t> coalesced{0}; // parse requests answered by another run
+    atomic<uint64_t> cancelled{0};
+    atomic<uint64_t> shed{0};      // refused because the queue was full
+};
+
+// The document store and request handlers. Safe to call from several
+// threads (the HTTP server does): runs happen outside the lock, which only
+// guards the documents map and its counters.
+class Daemon
+{
+    const DaemonMetrics &metrics;
+    const Limits &limits;
+    mutex lock;
+    unordered_map<uint64_t, shared_ptr<Document>> documents;
+    uint64_t nextDocument;
+    uint64_t clock = 0;
+    size_t maxDocuments;
+
+    static WindowLimits windowLimits(const json &request)
+    {
+        WindowLimits limits;
+        limits.depth = request.value("depth", limits.depth);
+        limits.limit = request.value("limit", limits.limit);
+        limits.budget = request.value("budget", limits.budget);
+        limits.offset = request.value("offset", limits.offset);
+        return limits;
+    }
+
+    shared_ptr<Document> document(const json &request)
+    {
+        uint64_t id = request.at("doc").get<uint64_t>();
+        lock_guard<mutex> guard(lock);
+        auto it = documents.find(id);
+        if (it == documents.end())
+            throw runtime_error("Unknown document (closed or evicted)");
+        it->second->lastUsed = ++clock;
+        return it->second;
+    }
+
+    // Drops least recently used documents beyond maxDocuments (lock held).
+    void evict()
+    {
+        while (documents.size() > maxDocuments)
+        {
+            auto oldest = documents.begin();
+            for (auto it = documents.begin(); it != documents.end(); ++it)
+                if (it->second->lastUsed < oldest->second->lastUsed)
+                    oldest = it;
+            documents.erase(oldest);
+        }
+    }
+
+    json parse(const json &request, const CancelToken &cancel)
+    {
+        auto doc = make_shared<Document>();
+        doc->session.limits = limits;
+        doc->session.cancel = &cancel;
+        RunStats stats;
+        json response;
+        vector<string> errors;
+        bool parsed = false;
+        try
+        {
+            doc->tree = parseSource(request.at("code").get<string>(), doc->session, stats);
+            parsed = true;
+            for (const auto &error : doc->session.syntaxErrors)
+                errors.push_back(error.what());
+            if (errors.empty() && request.value("trace", true))
+                simulateProgram(doc->session, stats);
+        }
+        catch (const json::exception &)
+        {
+            throw;
+        }
+        catch (const Cancelled &)
+        {
+            throw;
+        }
+        catch (const exception &e)
+        {
+            errors.push_back(e.what());
+        }
+        response["trace"] = traceToJson(doc->session);
+        response["symbols"] = symbolTableToJson(doc->session);
+        response["errors"] = errors;
+        response["diagnostics"] = diagnosticsToJson(doc->session);
+        if (!parsed)
+        {
+            response["doc"] = nullptr;
+            response["tree"] = nullptr;
+            return response;
+        }
+
+        doc->index();
+        stats.nodes = doc->nodes.size();
+        if (request.value("layout", false))
+        {
+            auto start = chrono::steady_clock::now();
+            doc->layout = make_unique<TreeLayout>(layoutTree(doc->tree));
+            stats.layoutMs = elapsedMs(start);
+            cancel.check();
+            response["extent"] = {
+                {"x", *max_element(doc->layout->x.begin(), doc->layout->x.end())},
+                {"depth", *max_element(doc->layout->depth.begin(), doc->layout->depth.end())}};
+        }
+        response["tree"] = windowToJson(*doc, 0, windowLimits(request));
+        response["nodes"] = doc->nodes.size();
+        response["stats"] = {
+            {"tokens", stats.tokens},
+            {"nodes", stats.nodes},
+            {"trace_events", doc->session.trace.size()},
+            {"lex_ms", stats.lexMs},
+            {"parse_ms", stats.parseMs},
+            {"simulate_ms", stats.simulateMs},
+            {"layout_ms", stats.layoutMs}};
+
+        cancel.check();
+        doc->session.cancel = nullptr; // the token dies with the request
+        lock_guard<mutex> guard(lock);
+        uint64_t id = nextDocument++;
+        doc->lastUsed = ++clock;
+        documents[id] = std::move(doc);
+        response["doc"] = id;
+        evict();
+        return response;
+    }
+
+    json subtree(const json &request)
+    {
+        shared_ptr<Document> doc = document(request);
+        uint32_t node = request.at("node").get<uint32_t>();
+        if (node >= doc->nodes.size())
+            throw runtime_error("Unknown node id " + to_string(node));
+        return {{"doc", request.at("doc")}, {"node", node}, {"tree", windowToJson(*doc, node, windowLimits(request))}};
+    }
+
+    json locate(const json &request)
+    {
+        shared_ptr<Document> doc = document(request);
+        uint32_t offset = request.at("offset").get<uint32_t>();
+        uint32_t node = doc->nodeAt(offset);
+        json path = json::array();
+        for (uint32_t up = node == Document::NoNode ? node : doc->parent[node]; up != Document::NoNode; up = doc->parent[up])
+            path.push_back(up);
+        reverse(path.begin(), path.end());
+        json response = {{"doc", request.at("doc")}, {"node", node == Document::NoNode ? json(nullptr) : json(node)}, {"path", path}};
+        if (request.contains("end"))
+        {
+            // Overlapping [offset, end): the nodes containing offset, then
+            // those starting inside the range.
+            uint32_t end = request.at("end").get<uint32_t>();
+            size_t limit = request.value("limit", size_t(1000));
+            json overlapping = path;
+            if (node != Document::NoNode)
+                overlapping.push_back(node);
+            for (uint32_t id = doc->firstStartingAfter(offset);
+                 id < doc->nodes.size() && doc->nodes[id]->span.offset < end && overlapping.size() <= limit; ++id)
+                overlapping.push_back(id);
+            if (overlapping.size() > limit)
+            {
+                overlapping.erase(overlapping.begin() + static_cast<ptrdiff_t>(limit), overlapping.end());
+                response["more"] = true;
+            }
+            response["nodes"] = std::move(overlapping);
+        }
+        return response;
+    }
+
+    json step(const json &request)
+    {
+        shared_ptr<Document> doc = document(request);
+        if (!doc->session.syntaxErrors.empty())
+            throw runtime_error("The program has syntax errors");
+        size_t count = request.value("count", size_t(100));
+        lock_guard<mutex> guard(doc->stepLock);
+        if (!doc->stepper || request.value("restart", false))
+        {
+            doc->stepper.reset(); // unwinds the old run before a new one starts
+            doc->stepper.emplace(programTrace(doc->session));
+            doc->stepped = 0;
+        }
+        json events = json::array();
+        bool done = false;
+        while (events.size() < count)
+        {
+            if (!doc->stepper->next())
+            {
+                done = true;
+                break;
+            }
+            checkLimit(++doc->stepped, limits.traceEvents, "Trace too long");
+            events.push_back(traceEventToJson(doc->stepper->value(), doc->session.strings));
+        }
+        return {{"doc", request.at("doc")}, {"events", events}, {"done", done}};
+    }
+
+public:
+    Daemon(size_t maxDocuments, const DaemonMetrics &metrics, const Limits &limits, uint64_t firstDocument = 1)
+        : metrics(metrics), limits(limits), nextDocument(firstDocument), maxDocuments(max<size_t>(1, maxDocuments)) {}
+
+    // Registers extra clients of a document produced by a coalesced parse.
+    void share(uint64_t doc, size_t clients)
+    {
+        lock_guard<mutex> guard(lock);
+        auto it = documents.find(doc);
+        if (it != documents.end())
+            it->second->owners += clients;
+    }
+
+    json handle(const json &request, const CancelToken &cancel)
+    {
+        cancel.check();
+        string op = request.at("op").get<string>();
+        if (op == "parse")
+            return parse(request, cancel);
+        if (op == "subtree")
+            return subtree(request);
+        if (op == "step")
+            return step(request);
+        if (op == "locate")
+            return locate(request);
+        if (op == "close")
+        {
+            lock_guard<mutex> guard(lock);
+            auto it = documents.find(request.at("doc").get<uint64_t>());
+            if (it != documents.end() && --it->second->owners == 0)
+                documents.erase(it);
+            return {{"closed", request.at("doc")}};
+        }
+        if (op == "stats")
+        {
+            lock_guard<mutex> guard(lock);
+            return {
+                {"requests", metrics.requests.load()},
+                {"runs", metrics.runs.load()},
+                {"coalesced", metrics.coalesced.load()},
+                {"cancelled", metrics.cancelled.load()},
+                {"shed", metrics.shed.load()},
+                {"documents", documents.size()}};
+        }
+        throw runtime_error("Unknown op: " + op);
+    }
+};
+
+string encodePayload(const json &payload, OutputFormat format)
+{
+    ostringstream body;
+    writeDocument(payload, body, format, -1);
+    return body.str();
+}
+
+// Encodes payload, or a short error document if it is over maxBytes.
+string encodeLimited(const json &payload, OutputFormat format, size_t maxBytes)
+{
+    string bytes = encodePayload(payload, format);
+    if (maxBytes && bytes.size() > maxBytes)
+    {
+        string error = "Output too large (" + to_string(bytes.size()) + " bytes, limit " + to_string(maxBytes) + ")";
+        bytes = encodePayload({{"error", error}, {"errors", {error}}, {"tree", nullptr}}, format);
+    }
+    return bytes;
+}
+
+// Reads one line, like getline, keeping at most maxBytes of it (0 = all).
+// The rest of a longer line is read and dropped, and tooLong is set.
+bool readLine(istream &in, string &line, size_t maxBytes, bool &tooLong)
+{
+    line.clear();
+    tooLong = false;
+    char chunk[1 << 16];
+    while (true)
+    {
+        in.getline(chunk, sizeof(chunk));
+        size_t n = static_cast<size_t>(in.gcount());
+        bool full = in.fail() && !in.eof() && n == sizeof(chunk) - 1;
+        if (!in.fail() && !in.eof())
+            --n; // the newline
+        if (maxBytes && line.size() + n > maxBytes)
+            tooLong = true;
+        if (!tooLong)
+            line.append(chunk, n);
+        if (!full)
+            return !in.fail() || !line.empty() || tooLong;
+        in.clear();
+    }
+}
+
+// The id of a request whose line was too long to parse, if the line
+// starts with it (server.py sends "id" first for this reason).
+uint64_t leadingId(string_view line)
+{
+    static const regex idPrefix("^\\s*\\{\\s*\"id\"\\s*:\\s*([0-9]+)");
+    cmatch match;
+    if (regex_search(line.data(), line.data() + line.size(), match, idPrefix))
+        return stoull(match[1].str());
+    return 0;
+}
+
+// Longest request line accepted for an input cap: JSON escaping can make
+// each source byte up to 6 bytes long.
+size_t maxLineBytes(const Limits &limits)
+{
+    return limits.inputBytes ? limits.inputBytes * 6 + (64 << 10) : 0;
+}
+
+// Writes one response frame: "<id> <length>\n" + payload.
+void writeFrame(ostream &out, uint64_t id, const string &payload)
+{
+    out << id << ' ' << payload.size() << '\n';
+    out.write(payload.data(), static_cast<streamsize>(payload.size()));
+    out.flush();
+}
+
+// --- Single Flight ---
+// Identical parse requests (equal apart from "id" and "format") that arrive
+// while one is queued or running share that run: the first opens a flight,
+// the others join it as waiters, and every waiter gets the run's answer.
+// runDaemon runs a flight on its worker thread; the supervisor sends the
+// first waiter's request line to a worker process and copies the answer to
+// the rest. Not synchronized: runDaemon calls it under its own lock.
+
+using Waiter = pair<uint64_t, OutputFormat>; // request id, format of its answer
+
+// One execution of a request and everyone waiting for its answer.
+struct Flight
+{
+    json request;            // without "id" and "format"
+    optional<size_t> key;    // content hash, for parses only
+    vector<Waiter> waiters;
+    CancelToken cancel;      // daemon: fired when the last waiter cancels
+    Waiter leader{};         // supervisor: the id (and format) the worker answers under
+};
+
+class SingleFlight
+{
+    unordered_map<uint64_t, shared_ptr<Flight>> byRequest; // waiting id -> flight
+    unordered_map<size_t, shared_ptr<Flight>> byContent;   // parse hash -> open flight
+
+public:
+    // The key a request is coalesced under: parses only.
+    static optional<size_t> key(const json &request)
+    {
+        if (request.value("op", string()) != "parse")
+            return nullopt;
+        return hash<string>{}(request.dump());
+    }
+
+    // Adds id as a waiter of an open flight for the same request; false if
+    // there is none and the request needs a run of its own.
+    bool join(optional<size_t> key, const json &request, uint64_t id, OutputFormat format)
+    {
+        if (!key)
+            return false;
+        auto it = byContent.find(*key);
+        if (it == byContent.end() || it->second->waiters.empty() || it->second->request != request)
+            return false;
+        it->second->waiters.push_back({id, format});
+        byRequest[id] = it->second;
+        return true;
+    }
+
+    // Opens a flight for request with id as its first waiter.
+    shared_ptr<Flight> open(optional<size_t> key, json request, uint64_t id, OutputFormat format)
+    {
+        auto flight = make_shared<Flight>();
+        flight->request = std::move(request);
+        flight->key = key;
+        flight->leader = {id, format};
+        flight->waiters.push_back({id, format});
+        byRequest[id] = flight;
+        if (key)
+            byContent[*key] = flight;
+        return flight;
+    }
+
+    // Removes waiter id from its flight and returns the flight (null if id
+    // waits on none), with the format id wanted.
+    shared_ptr<Flight> leave(uint64_t id, OutputFormat &format)
+    {
+        auto it = byRequest.find(id);
+        if (it == byRequest.end())
+            return nullptr;
+        shared_ptr<Flight> flight = std::move(it->second);
+        byRequest.erase(it);
+        auto &waiters = flight->waiters;
+        for (auto w = waiters.begin(); w != waiters.end(); ++w)
+            if (w->first == id)
+            {
+                format = w->second;
+                waiters.erase(w);
+                break;
+            }
+        return flight;
+    }
+
+    // Closes flight to new waiters and returns the ones it has.
+    vector<Waiter> finish(const shared_ptr<Flight> &flight)
+    {
+        if (flight->key)
+        {
+            auto open = byContent.find(*flight->key);
+            if (open != byContent.end() && open->second == flight)
+                byContent.erase(open);
+        }
+        vector<Waiter> waiters = std::move(flight->waiters);
+        flight->waiters.clear();
+        for (const auto &waiter : waiters)
+            byRequest.erase(waiter.first);
+        return waiters;
+    }
+};
+
+// What it does:
+// Reads requests on the main thread and hands them, in order, to a single
+// worker that owns the Daemon. Parses are coalesced through SingleFlight.
+// "cancel" drops one waiter (answering it at once) and fires the flight's
+// token when nobody is left. When a run finishes, its payload is encoded
+// once per format and written to every waiter. Frames from both threads
+// are written under one lock.
+
+int runDaemon(size_t maxDocuments, const Limits &limits, uint64_t firstDocument = 1)
+{
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    DaemonMetrics metrics;
+    Daemon daemon(maxDocuments, metrics, limits, firstDocument);
+    mutex outputLock;
+    mutex flightLock;
+    SingleFlight flights;
+    size_t queued = 0; // flights not finished yet
+    auto reply = [&](uint64_t id, const json &response, OutputFormat format)
+    {
+        string payload = encodeLimited(response, format, limits.outputBytes);
+        lock_guard<mutex> guard(outputLock);
+        writeFrame(cout, id, payload);
+    };
+
+    ThreadPool worker(1);
+    string line;
+    bool tooLong = false;
+    while (readLine(cin, line, maxLineBytes(limits), tooLong))
+    {
+        if (line.empty() || line == "\r")
+            continue;
+        ++metrics.requests;
+        uint64_t id = 0;
+        OutputFormat format = OutputFormat::Json;
+        json request;
+        try
+        {
+            if (tooLong)
+            {
+                id = leadingId(line);
+                throw LimitExceeded("Request too large (limit " + to_string(maxLineBytes(limits)) + " bytes)");
+            }
+            request = json::parse(line);
+            id = request.value("id", uint64_t(0));
+            format = parseOutputFormat(request.value("format", string("json")));
+            request.erase("id");
+            request.erase("format");
+            if (request.value("op", string()) == "cancel")
+            {
+                uint64_t target = request.at("target").get<uint64_t>();
+                OutputFormat targetFormat = OutputFormat::Json;
+                bool found = false;
+                {
+                    lock_guard<mutex> guard(flightLock);
+                    if (auto flight = flights.leave(target, targetFormat))
+                    {
+                        if (flight->waiters.empty())
+                            flight->cancel.cancel();
+                        found = true;
+                    }
+                }
+                if (found)
+                {
+                    ++metrics.cancelled;
+                    reply(target, {{"error", "Cancelled"}, {"cancelled", true}}, targetFormat);
+                }
+                reply(id, {{"cancelled", target}, {"found", found}}, format);
+                continue;
+            }
+        }
+        catch (const exception &e)
+        {
+            reply(id, {{"error", e.what()}}, format);
+            continue;
+        }
+
+        optional<size_t> key = SingleFlight::key(request);
+        {
+            lock_guard<mutex> guard(flightLock);
+            if (flights.join(key, request, id, format))
+            {
+                ++metrics.coalesced;
+                continue;
+            }
+            if (limits.queue && queued >= limits.queue)
+            {
+                ++metrics.shed;
+                reply(id, {{"error", "Too many queued requests (limit " + to_string(limits.queue) + ")"}, {"overloaded", true}}, format);
+                continue;
+            }
+            ++queued;
+            auto flight = flights.open(key, std::move(request), id, format);
+
+            worker.submit([&, flight]
+                          {
+                json response;
+                try
+                {
+                    flight->cancel.check();
+                    ++metrics.runs;
+                    response = daemon.handle(flight->request, flight->cancel);
+                }
+                catch (const Cancelled &e)
+                {
+                    response = {{"error", e.what()}, {"cancelled", true}};
+                }
+                catch (const exception &e)
+                {
+                    response = {{"error", e.what()}};
+                }
+                vector<Waiter> waiters;
+                {
+                    lock_guard<mutex> guard(flightLock);
+                    waiters = flights.finish(flight);
+                    --queued;
+                }
+                if (waiters.empty())
+                    return;
+                if (waiters.size() > 1 && response.contains("doc") && response["doc"].is_number())
+                    daemon.share(response["doc"].get<uint64_t>(), waiters.size() - 1);
+                map<OutputFormat, string> payloads;
+                for (const auto &[waiterId, waiterFormat] : waiters)
+                {
+                    auto &payload = payloads[waiterFormat];
+                    if (payload.empty())
+                        payload = encodeLimited(response, waiterFormat, limits.outputBytes);
+                    lock_guard<mutex> guard(outputLock);
+                    writeFrame(cout, waiterId, payload);
+                } });
+        }
+    }
+    worker.wait();
+    return 0;
+}
+
+// --- Supervisor ---
+// --supervisor speaks the daemon protocol on stdin/stdout but runs every
+// request in a pre-forked worker process, so an input that crashes the
+// parser only takes down its worker. The supervisor warms the parser up
+// once (code paged in, allocators warm) and forks workers from that image;
+// a crashed worker costs a fork, not a new process launch.
+//
+// Each worker is an ordinary daemon (runDaemon) on a pair of pipes and gets
+// at most one request at a time (cancel is forwarded at any time). Document
+// ids carry the worker's generation in their upper 32 bits, so subtree and
+// close go to the worker holding the document; after a crash they get
+// "Unknown document". Requests of a crashed worker are answered with
+// {"error": ..., "crashed": true}.
+//
+// Identical parses are coalesced here, before they reach a worker, with the
+// same SingleFlight table as runDaemon: only the first request's line is
+// sent, and its answer is copied to every waiter under the waiter's id and
+// format. Its document then has one owner per waiter; the worker counts
+// one, and closes beyond that are answered here.
+
+#ifndef _WIN32
+
+// A request line waiting for a worker.
+struct QueuedRequest
+{
+    uint64_t id;
+    OutputFormat format;
+    string line;
+};
+
+struct Worker
+{
+    pid_t pid = -1;
+    int in = -1;  // requests to the worker
+    int out = -1; // frames from the worker
+    uint64_t generation = 0;
+    string frames;                                   // bytes read, not yet forwarded
+    unordered_map<uint64_t, OutputFormat> requests;  // sent, not yet answered
+    deque<QueuedRequest> queue;                      // requests for its documents
+};
+
+bool writeAll(int fd, string_view bytes)
+{
+    while (!bytes.empty())
+    {
+        ssize_t n = write(fd, bytes.data(), bytes.size());
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        bytes.remove_prefix(static_cast<size_t>(n));
+    }
+    return true;
+}
+
+void writeFrame(int fd, uint64_t id, const json &payload, OutputFormat format)
+{
+    string body = encodePayload(payload, format);
+    writeAll(fd, to_string(id) + ' ' + to_string(body.size()) + '\n');
+    writeAll(fd, body);
+}
+
+// Runs one small program through every stage so the workers forked later
+// start with touched code pages and warm allocators.
+void warmUp()
+{
+    Session session;
+    RunStats stats;
+    Node tree = parseSource("#include <iostream>\nint main() { int a = 1; while (a < 3) { a = a + 1; } cout << a; return 0; }",
+                            session, stats);
+    simulateProgram(session, stats);
+    encodePayload(runDocument(&tree, session, stats, {}, {OutputFormat::Cbor, true}), OutputFormat::Cbor);
+}
+
+// A frame payload read back, to re-encode it in another format.
+json decodePayload(string_view bytes, OutputFormat format)
+{
+    switch (format)
+    {
+    case OutputFormat::Cbor: return json::from_cbor(bytes.begin(), bytes.end());
+    case OutputFormat::MsgPack: return json::from_msgpack(bytes.begin(), bytes.end());
+    case OutputFormat::Json: break;
+    }
+    return json::parse(bytes);
+}
+
+class Supervisor
+{
+    vector<Worker> workers;
+    deque<QueuedRequest> shared; // parse requests, for any idle worker
+    SingleFlight flights;
+    unordered_map<uint64_t, shared_ptr<Flight>> parses; // leader id -> its flight, until answered
+    unordered_map<uint64_t, size_t> sharedDocs;         // doc -> owners beyond the one its worker counts
+    unordered_set<uint64_t> swallowed;                  // ids whose worker frames were answered here
+    size_t maxDocuments;
+    Limits limits;
+    uint64_t generations = 0;
+    uint64_t crashes = 0;
+    uint64_t requestCount = 0;
+    uint64_t runs = 0;
+    uint64_t coalesced = 0;
+    uint64_t shed = 0;
+    string input;          // the request line being read
+    bool skipping = false; // input is the head of a line over maxLineBytes
+
+    void spawn(Worker &worker)
+    {
+        int toWorker[2], fromWorker[2];
+        if (pipe(toWorker) != 0 || pipe(fromWorker) != 0)
+            throw runtime_error("pipe failed");
+        worker.generation = ++generations;
+        fflush(nullptr);
+        pid_t pid = fork();
+        if (pid < 0)
+            throw runtime_error("fork failed");
+        if (pid == 0)
+        {
+            dup2(toWorker[0], STDIN_FILENO);
+            dup2(fromWorker[1], STDOUT_FILENO);
+            close(toWorker[0]), close(toWorker[1]), close(fromWorker[0]), close(fromWorker[1]);
+            for (const auto &other : workers)
+                if (other.pid > 0)
+                    close(other.in), close(other.out);
+            signal(SIGPIPE, SIG_DFL);
+            int status = runDaemon(maxDocuments, limits, (worker.generation << 32) | 1);
+            cout.flush();
+            _exit(status);
+        }
+        close(toWorker[0]);
+        close(fromWorker[1]);
+        worker.pid = pid;
+        worker.in = toWorker[1];
+        worker.out = fromWorker[0];
+        worker.frames.clear();
+    }
+
+    // Answers everything the dead worker owed and forks a replacement.
+    void respawn(Worker &worker)
+    {
+        int status = 0;
+        waitpid(worker.pid, &status, 0);
+        close(worker.in);
+        close(worker.out);
+        worker.pid = -1;
+        ++crashes;
+        string reason = WIFSIGNALED(status) ? "Worker crashed (signal " + to_string(WTERMSIG(status)) + ")"
+                                            : "Worker exited (status " + to_string(WEXITSTATUS(status)) + ")";
+        for (const auto &[id, format] : worker.requests)
+        {
+            if (swallowed.erase(id))
+                continue;
+            auto parse = parses.find(id);
+            if (parse == parses.end())
+            {
+                writeFrame(STDOUT_FILENO, id, {{"error", reason}, {"crashed", true}}, format);
+                continue;
+            }
+            for (const auto &[waiter, waiterFormat] : flights.finish(parse->second))
+                writeFrame(STDOUT_FILENO, waiter, {{"error", reason}, {"crashed", true}}, waiterFormat);
+            parses.erase(parse);
+        }
+        worker.requests.clear();
+        for (auto it = sharedDocs.begin(); it != sharedDocs.end();)
+            it = it->first >> 32 == worker.generation ? sharedDocs.erase(it) : next(it);
+        for (const auto &request : worker.queue)
+            writeFrame(STDOUT_FILENO, request.id, {{"error", "Unknown document (worker restarted)"}}, request.format);
+        worker.queue.clear();
+        spawn(worker);
+    }
+
+    void send(Worker &worker, const QueuedRequest &request)
+    {
+        worker.requests[request.id] = request.format;
+        writeAll(worker.in, request.line + '\n'); // a dead worker shows up as EOF on its frames
+    }
+
+    // Gives each idle worker its next request: its own documents first.
+    void dispatch()
+    {
+        for (auto &worker : workers)
+        {
+            if (!worker.requests.empty())
+                continue;
+            deque<QueuedRequest> &from = worker.queue.empty() ? shared : worker.queue;
+            if (from.empty())
+                continue;
+            QueuedRequest request = std::move(from.front());
+            from.pop_front();
+            ++runs;
+            send(worker, request);
+        }
+    }
+
+    // Forwards complete frames; returns false once the worker is gone.
+    bool drain(Worker &worker)
+    {
+        char buffer[1 << 16];
+        ssize_t n = read(worker.out, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR)
+            return true;
+        if (n <= 0)
+            return false;
+        worker.frames.append(buffer, static_cast<size_t>(n));
+        size_t start = 0;
+        while (true)
+        {
+            size_t newline = worker.frames.find('\n', start);
+            if (newline == string::npos)
+                break;
+            uint64_t id = 0;
+            size_t length = 0;
+            if (sscanf(worker.frames.c_str() + start, "%" SCNu64 " %zu", &id, &length) != 2)
+                return false;
+            size_t end = newline + 1 + length;
+            if (end > worker.frames.size())
+                break;
+            worker.requests.erase(id);
+            auto parse = parses.find(id);
+            if (parse != parses.end())
+            {
+                answer(parse->second, string_view(worker.frames).substr(newline + 1, length));
+                parses.erase(parse);
+            }
+            else if (!swallowed.erase(id))
+                writeAll(STDOUT_FILENO, string_view(worker.frames).substr(start, end - start));
+            start = end;
+        }
+        worker.frames.erase(0, start);
+        return true;
+    }
+
+    // Writes the answer to a coalesced parse (payload, in the leader's
+    // format) to each of its waiters, re-encoded for those wanting another
+    // format, and counts the extra owners of the document it opened.
+    void answer(const shared_ptr<Flight> &flight, string_view payload)
+    {
+        vector<Waiter> waiters = flights.finish(flight);
+        auto [leader, leaderFormat] = flight->leader;
+        optional<json> decoded;
+        auto document = [&]() -> const json &
+        {
+            if (!decoded)
+                decoded = decodePayload(payload, leaderFormat);
+            return *decoded;
+        };
+        if (waiters.size() > 1)
+        {
+            const json &response = document();
+            if (response.contains("doc") && response["doc"].is_number())
+                sharedDocs[response["doc"].get<uint64_t>()] += waiters.size() - 1;
+        }
+        map<OutputFormat, string> payloads;
+        for (const auto &[id, format] : waiters)
+        {
+            if (format == leaderFormat)
+            {
+                writeAll(STDOUT_FILENO, to_string(id) + ' ' + to_string(payload.size()) + '\n');
+                writeAll(STDOUT_FILENO, payload);
+                continue;
+            }
+            string &body = payloads[format];
+            if (body.empty())
+                body = encodeLimited(document(), format, limits.outputBytes);
+            writeAll(STDOUT_FILENO, to_string(id) + ' ' + to_string(body.size()) + '\n');
+            writeAll(STDOUT_FILENO, body);
+        }
+    }
+
+    // Removes a request that has not reached a worker yet.
+    bool dequeue(uint64_t target, OutputFormat &format)
+    {
+        auto take = [&](deque<QueuedRequest> &queue)
+        {
+            for (auto it = queue.begin(); it != queue.end(); ++it)
+                if (it->id == target)
+                {
+                    format = it->format;
+                    queue.erase(it);
+                    return true;
+                }
+            return false;
+        };
+        if (take(shared))
+            return true;
+        for (auto &worker : workers)
+            if (take(worker.queue))
+                return true;
+        return false;
+    }
+
+    Worker *owner(uint64_t doc)
+    {
+        for (auto &worker : workers)
+            if (worker.generation == doc >> 32)
+                return &worker;
+        return nullptr;
+    }
+
+    // Routes one request line read from stdin.
+    void accept(string line)
+    {
+        ++requestCount;
+        uint64_t id = 0;
+        OutputFormat format = OutputFormat::Json;
+        try
+        {
+            // Parsed whole: a parse is coalesced by its code too. The worker
+            // still gets the original line.
+            json request = json::parse(line);
+            id = request.value("id", uint64_t(0));
+            format = parseOutputFormat(request.value("format", string("json")));
+            request.erase("id");
+            request.erase("format");
+            string op = request.value("op", string());
+            if (op == "cancel")
+            {
+                uint64_t target = request.at("target").get<uint64_t>();
+                OutputFormat targetFormat;
+                if (auto flight = flights.leave(target, targetFormat))
+                {
+                    // A waiter of a parse. The run goes on for the others;
+                    // without any it is dropped, or cancelled on its worker
+                    // (whose answers then go nowhere).
+                    if (flight->waiters.empty())
+                    {
+                        uint64_t leader = flight->leader.first;
+                        Worker *running = nullptr;
+                        for (auto &worker : workers)
+                            if (worker.requests.count(leader))
+                                running = &worker;
+                        if (running)
+                        {
+                            // Its "Cancelled" answer then ends the flight in drain().
+                            swallowed.insert(id);
+                            send(*running, {id, format, std::move(line)});
+                        }
+                        else
+                        {
+                            OutputFormat leaderFormat;
+                            dequeue(leader, leaderFormat);
+                            flights.finish(flight);
+                            parses.erase(leader);
+                        }
+                    }
+                    writeFrame(STDOUT_FILENO, target, {{"error", "Cancelled"}, {"cancelled", true}}, targetFormat);
+                    writeFrame(STDOUT_FILENO, id, {{"cancelled", target}, {"found", true}}, format);
+                    return;
+                }
+                if (dequeue(target, targetFormat))
+                {
+                    writeFrame(STDOUT_FILENO, target, {{"error", "Cancelled"}, {"cancelled", true}}, targetFormat);
+                    writeFrame(STDOUT_FILENO, id, {{"cancelled", target}, {"found", true}}, format);
+                    return;
+                }
+                for (auto &worker : workers)
+                    if (worker.requests.count(target))
+                        return send(worker, {id, format, std::move(line)});
+                writeFrame(STDOUT_FILENO, id, {{"cancelled", target}, {"found", false}}, format);
+            }
+            else if (op == "stats")
+                writeFrame(STDOUT_FILENO, id, {{"requests", requestCount}, {"runs", runs}, {"coalesced", coalesced}, {"workers", workers.size()}, {"spawned", generations}, {"crashes", crashes}, {"queued", queued()}, {"shed", shed}}, format);
+            else if (op == "close" && sharedDocs.count(request.at("doc").get<uint64_t>()))
+            {
+                // Another owner of a coalesced parse's document remains.
+                uint64_t doc = request.at("doc").get<uint64_t>();
+                if (--sharedDocs[doc] == 0)
+                    sharedDocs.erase(doc);
+                writeFrame(STDOUT_FILENO, id, {{"closed", doc}}, format);
+            }
+            else if (op == "parse" && flights.join(SingleFlight::key(request), request, id, format))
+                ++coalesced;
+            else if (limits.queue && queued() >= limits.queue)
+            {
+                ++shed;
+                writeFrame(STDOUT_FILENO, id, {{"error", "Too many queued requests (limit " + to_string(limits.queue) + ")"}, {"overloaded", true}}, format);
+            }
+            else if (request.contains("doc"))
+            {
+                Worker *worker = owner(request.at("doc").get<uint64_t>());
+                if (!worker)
+                    throw runtime_error("Unknown document (closed or evicted)");
+                worker->queue.push_back({id, format, std::move(line)});
+            }
+            else
+            {
+                if (op == "parse")
+                {
+                    optional<size_t> key = SingleFlight::key(request);
+                    parses[id] = flights.open(key, std::move(request), id, format);
+                }
+                shared.push_back({id, format, std::move(line)});
+            }
+        }
+        catch (const exception &e)
+        {
+            writeFrame(STDOUT_FILENO, id, {{"error", e.what()}}, format);
+        }
+    }
+
+    // Splits bytes read from stdin into request lines.
+    void consume(string_view data)
+    {
+        while (!data.empty())
+        {
+            size_t newline = data.find('\n');
+            if (!skipping)
+            {
+                input.append(data.substr(0, newline));
+                size_t maxLine = maxLineBytes(limits);
+                if (maxLine && input.size() > maxLine)
+                {
+                    skipping = true;
+                    input.resize(4096); // enough to find a leading id
+                }
+            }
+            if (newline == string_view::npos)
+                return;
+            data.remove_prefix(newline + 1);
+            string line = std::move(input);
+            input.clear();
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            if (skipping)
+            {
+                skipping = false;
+                ++requestCount;
+                writeFrame(STDOUT_FILENO, leadingId(line), {{"error", "Request too large (limit " + to_string(maxLineBytes(limits)) + " bytes)"}}, OutputFormat::Json);
+            }
+            else if (!line.empty())
+                accept(std::move(line));
+        }
+    }
+
+    size_t queued() const
+    {
+        size_t count = shared.size();
+        for (const auto &worker : workers)
+            count += worker.queue.size();
+        return count;
+    }
+
+    bool busy() const
+    {
+        if (!shared.empty())
+            return true;
+        for (const auto &worker : workers)
+            if (!worker.requests.empty() || !worker.queue.empty())
+                return true;
+        return false;
+    }
+
+public:
+    Supervisor(size_t count, size_t maxDocuments, const Limits &limits)
+        : workers(max<size_t>(1, count)), maxDocuments(maxDocuments), limits(limits) {}
+
+    int run()
+    {
+        signal(SIGPIPE, SIG_IGN);
+        warmUp();
+        for (auto &worker : workers)
+            spawn(worker);
+
+        bool reading = true;
+        char buffer[1 << 16];
+        while (reading || busy())
+        {
+            vector<pollfd> fds;
+            if (reading)
+                fds.push_back({STDIN_FILENO, POLLIN, 0});
+            for (const auto &worker : workers)
+                fds.push_back({worker.out, POLLIN, 0});
+            if (poll(fds.data(), fds.size(), -1) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw runtime_error("poll failed");
+            }
+            size_t next = 0;
+            if (reading && fds[next++].revents)
+            {
+                ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+                if (n > 0)
+                    consume(string_view(buffer, static_cast<size_t>(n)));
+                else if (n == 0 || errno != EINTR)
+                    reading = false;
+            }
+            for (auto &worker : workers)
+                if (fds[next++].revents && !drain(worker))
+                    respawn(worker);
+            dispatch();
+        }
+
+        for (auto &worker : workers)
+            close(worker.in);
+        for (auto &worker : workers)
+        {
+            close(worker.out);
+            waitpid(worker.pid, nullptr, 0);
+        }
+        return 0;
+    }
+};
+
+#endif
+
+// --- HTTP Server ---
+// --http PORT serves the visualizer without Flask: HTTP/1.1 with keep-alive
+// on 127.0.0.1, one epoll loop per worker thread (-j N) sharing a single
+// listening socket. index.html, script.js, style.css and cbor.js are read
+// once at startup and served from memory. /parse, /subtree, /step,
+// /locate and /stats run in-process on one shared Daemon, negotiating JSON / CBOR /
+// MessagePack from Accept like server.py; /trace-stream sends a program's
+// trace as chunked NDJSON while it runs (see TraceStream); /save-code and
+// /run-parser keep their old meaning (write input.cpp; parse it into
+// tree.json, ...). The routes that parse run on a worker pool behind the
+// daemon's --max-queue bound (see enqueue), so the loops keep answering
+// cheap requests meanwhile; a body that is not the expected JSON gets 400.
+
+#ifdef __linux__
+
+struct HttpRequest
+{
+    string method;
+    string path;
+    bool keepAlive = true;
+    string accept;
+    string body;
+};
+
+// A /trace-stream response in progress: the program runs lazily and its
+// trace goes out as HTTP chunks of NDJSON, one batch each time the socket
+// has taken the previous one, so a slow reader holds the run back instead
+// of the server buffering its trace. A run that fails ends with an
+// {"error": ...} line, like --trace-ndjson.
+struct TraceStream
+{
+    Session session;
+    Node tree = {NodeKind::Program}; // session.allFunctions points into it
+    optional<Generator<TraceEvent>> events;
+    size_t count = 0;                // events sent
+};
+
+struct HttpResponse
+{
+    int status = 200;
+    string type = "application/json";
+    string body;
+    bool varyAccept = false;
+    unique_ptr<TraceStream> stream; // set: the body follows in chunks
+};
+
+const char *statusText(int status)
+{
+    switch (status)
+    {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 413: return "Payload Too Large";
+    case 431: return "Request Header Fields Too Large";
+    case 501: return "Not Implemented";
+    case 503: return "Service Unavailable";
+    default: return "Internal Server Error";
+    }
+}
+
+const char *formatMimeType(OutputFormat format)
+{
+    switch (format)
+    {
+    case OutputFormat::Cbor: return "application/cbor";
+    case OutputFormat::MsgPack: return "application/msgpack";
+    default: return "application/json";
+    }
+}
+
+// Picks the output format the Accept header rates highest (JSON on ties,
+// for */* and when the header is missing).
+OutputFormat negotiateFormat(string_view accept)
+{
+    OutputFormat best = OutputFormat::Json;
+    double bestQuality = -1;
+    while (!accept.empty())
+    {
+        size_t comma = accept.find(',');
+        string_view item = accept.substr(0, comma);
+        accept = comma == string_view::npos ? string_view() : accept.substr(comma + 1);
+        size_t semicolon = item.find(';');
+        string_view type = item.substr(0, semicolon);
+        while (!type.empty() && type.front() == ' ')
+            type.remove_prefix(1);
+        while (!type.empty() && type.back() == ' ')
+            type.remove_suffix(1);
+        double quality = 1;
+        size_t q = item.find("q=", semicolon == string_view::npos ? item.size() : semicolon);
+        if (q != string_view::npos)
+            quality = atof(string(item.substr(q + 2)).c_str());
+        for (OutputFormat format : {OutputFormat::Json, OutputFormat::Cbor, OutputFormat::MsgPack})
+            if ((type == formatMimeType(format) || (type == "*/*" && format == OutputFormat::Json)) &&
+                (quality > bestQuality || (quality == bestQuality && format == OutputFormat::Json)))
+            {
+                best = format;
+                bestQuality = quality;
+            }
+    }
+    return best;
+}
+
+class HttpServer
+{
+    struct Loop;
+
+    struct Connection
+    {
+        int fd;
+        Loop *loop;                     // the epoll loop that owns it
+        string in;
+        string out;
+        size_t sent = 0;
+        bool closing = false;           // close once out is written
+        bool watched = false;           // registered with the loop's epoll
+        bool pending = false;           // a worker has its current request
+        unique_ptr<TraceStream> stream; // a response still being generated
+    };
+
+    struct Completion
+    {
+        Connection *connection;
+        HttpRequest request;
+        HttpResponse response;
+    };
+
+    // One epoll loop's mailbox: workers append their answers and poke the
+    // eventfd; the loop sends them. A pending connection is out of epoll and
+    // never dropped, so the pointer stays valid until its answer is in.
+    struct Loop
+    {
+        int wakeup = -1; // eventfd
+        mutex lock;
+        vector<Completion> done;
+    };
+
+    DaemonMetrics metrics;
+    Limits limits;
+    Daemon daemon;
+    int listener = -1;
+    unordered_map<string, pair<string, string>> files; // path -> (type, bytes)
+    mutex diskLock;                                    // input.cpp and the output files
+    mutex clientsLock;
+    unordered_map<string, shared_ptr<CancelToken>> clients; // client id -> its running parse
+    optional<ThreadPool> pool;                              // runs the routes that parse
+    atomic<size_t> queued{0};                               // requests handed to workers, not answered yet
+
+    static HttpResponse error(int status, const string &message)
+    {
+        return {status, "application/json", jsonText({{"error", message}})};
+    }
+
+    static string readFile(const string &path)
+    {
+        ifstream in(path, ios::binary);
+        if (!in)
+            throw runtime_error("Failed to open " + path);
+        return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    }
+
+    // /parse: a new parse from a client cancels the one it still has running.
+    HttpResponse parse(const HttpRequest &request)
+    {
+        json body = json::parse(request.body);
+        const json &code = body.at("code");
+        OutputFormat format = negotiateFormat(request.accept);
+        string client = body.value("client", string());
+        auto token = make_shared<CancelToken>();
+        if (!client.empty())
+        {
+            lock_guard<mutex> guard(clientsLock);
+            auto &running = clients[client];
+            if (running)
+                running->cancel();
+            running = token;
+        }
+        json response;
+        try
+        {
+            ++metrics.runs;
+            response = daemon.handle({{"op", "parse"}, {"code", code}, {"depth", 4}, {"layout", true}}, *token);
+        }
+        catch (const Cancelled &e)
+        {
+            ++metrics.cancelled;
+            response = {{"error", e.what()}, {"cancelled", true}};
+        }
+        if (!client.empty())
+        {
+            lock_guard<mutex> guard(clientsLock);
+            auto it = clients.find(client);
+            if (it != clients.end() && it->second == token)
+                clients.erase(it);
+        }
+        return {200, formatMimeType(format), encodeLimited(response, format, limits.outputBytes), true};
+    }
+
+    HttpResponse subtree(const HttpRequest &request)
+    {
+        json body = json::parse(request.body);
+        OutputFormat format = negotiateFormat(request.accept);
+        CancelToken never;
+        json response = daemon.handle({{"op", "subtree"},
+                                       {"doc", body.at("doc")},
+                                       {"node", body.at("node")},
+                                       {"depth", body.value("depth", 3)},
+                                       {"offset", body.value("offset", 0)}},
+                                      never);
+        return {200, formatMimeType(format), encodeLimited(response, format, limits.outputBytes), true};
+    }
+
+    HttpResponse step(const HttpRequest &request)
+    {
+        json body = json::parse(request.body);
+        CancelToken never;
+        json response = daemon.handle({{"op", "step"},
+                                       {"doc", body.at("doc")},
+                                       {"count", body.value("count", 100)},
+                                       {"restart", body.value("restart", false)}},
+                                      never);
+        return {200, "application/json", jsonText(response)};
+    }
+
+    HttpResponse locate(const HttpRequest &request)
+    {
+        json body = json::parse(request.body);
+        json message = {{"op", "locate"}, {"doc", body.at("doc")}, {"offset", body.at("offset")}};
+        if (body.contains("end"))
+        {
+            message["end"] = body.at("end");
+            message["limit"] = body.value("limit", 1000);
+        }
+        CancelToken never;
+        return {200, "application/json", jsonText(daemon.handle(message, never))};
+    }
+
+    // /trace-stream: a program with syntax errors answers a single error
+    // line; otherwise the trace is generated as the connection drains (see
+    // nextChunk).
+    HttpResponse traceStream(const HttpRequest &request)
+    {
+        json body = json::parse(request.body);
+        auto stream = make_unique<TraceStream>();
+        stream->session.limits = limits;
+        try
+        {
+            ++metrics.runs;
+            RunStats stats;
+            stream->tree = parseSource(body.at("code").get<string>(), stream->session, stats);
+            requireValidSyntax(stream->session);
+        }
+        catch (const json::exception &)
         {
-            string ns = tokens[pos + 2].value;
-            root.children.push_back({"Using: namespace " + ns});
-            pos += 3;
-            if (pos < tokens.size() && tokens[pos].value == ";")
-                ++pos;
+            throw;
         }
-        while (pos < tokens.size())
+        catch (const exception &e)
         {
-            Node func = parseFunction();
-            root.children.push_back(func);
-            allFunctions.push_back(func);
+            return {200, "application/x-ndjson", jsonText({{"error", e.what()}}) + "\n"};
         }
-        return root;
+        stream->events.emplace(programTrace(stream->session));
+        return {200, "application/x-ndjson", "", false, std::move(stream)};
     }
 
-    Node parseFunction()
+    // Appends the next batch of connection's trace as one chunk; after the
+    // last event (or an error line) also the closing chunk, which ends the
+    // stream.
+    static void nextChunk(Connection &connection)
     {
-        Node funcNode = {"Function"};
-
-        // Accept multiple return types
-        string returnType;
-        if (match("int"))
-            returnType = "int";
-        else if (match("void"))
-            returnType = "void";
-        else if (match("float"))
-            returnType = "float";
-        else if (match("string"))
-            returnType = "string";
-        else
-            throw runtime_error("Expected return type");
-
-        Token name = advance();
-        if (name.type != "identifier")
-            throw runtime_error("Expected function name");
-
-        funcNode.children.push_back({"ReturnType: " + returnType});
-        funcNode.children.push_back({"FunctionName: " + name.value});
-
-        // Add function to symbol table
-        symbolTable.push_back({name.value, returnType + " (function)", "global", 0, false});
-
-        string prevScope = currentScope;
-        currentScope = name.value;
-
-        if (!match("("))
-            throw runtime_error("Expected (");
-        Node paramList = {"Parameters"};
-        if (!match(")"))
+        TraceStream &stream = *connection.stream;
+        string lines;
+        bool done = false;
+        try
         {
-            do
+            while (!done && lines.size() < (16 << 10))
             {
-                // Accept multiple parameter types
-                string paramType;
-                if (match("int"))
-                    paramType = "int";
-                else if (match("void"))
-                    paramType = "void";
-                else if (match("float"))
-                    paramType = "float";
-                else if (match("string"))
-                    paramType = "string";
-                else
-                    throw runtime_error("Expected parameter type");
-                Token paramName = advance();
-                if (paramName.type != "identifier")
-                    throw runtime_error("Expected parameter name");
-                paramList.children.push_back({paramType + " " + paramName.value});
-                // Add parameter to symbol table
-                symbolTable.push_back({paramName.value, paramType, currentScope, 0, false});
-            } while (match(","));
-            if (!match(")"))
-                throw runtime_error("Expected )");
+                done = !stream.events->next();
+                if (done)
+                    break;
+                checkLimit(++stream.count, stream.session.limits.traceEvents, "Trace too long");
+                lines += jsonText(traceEventToJson(stream.events->value(), stream.session.strings));
+                lines += '\n';
+            }
         }
-        funcNode.children.push_back(paramList);
-
-        if (!match("{"))
-            throw runtime_error("Expected {");
-
-        Node body = {"Body"};
-        while (!match("}"))
+        catch (const exception &e)
         {
-            body.children.push_back(parseStatement());
+            lines += jsonText({{"error", e.what()}}) + "\n";
+            done = true;
+        }
+        if (!lines.empty())
+        {
+            char size[20];
+            snprintf(size, sizeof(size), "%zx\r\n", lines.size());
+            connection.out += size;
+            connection.out += lines;
+            connection.out += "\r\n";
+        }
+        if (done)
+        {
+            connection.out += "0\r\n\r\n";
+            connection.stream.reset();
         }
-        funcNode.children.push_back(body);
-
-        currentScope = prevScope;
-        return funcNode;
     }
 
+    HttpResponse saveCode(const HttpRequest &request)
+    {
+        string code = json::parse(request.body).at("code").get<string>();
+        lock_guard<mutex> guard(diskLock);
+        ofstream out("input.cpp", ios::binary);
+        out << code;
+        if (!out)
+            throw runtime_error("Failed to write input.cpp");
+        return {200, "application/json", R"({"success":true})"};
+    }
 
-// ---------------------------------------------------------------------------
-
-    // What it does:
-    // Parses a single statement (like variable declaration, return, if, while, etc.).
-    // Returns the syntax tree for the statement.
-
-    Node parseStatement()
+    // What the old flow ran as `./parser`: input.cpp -> tree.json, trace.json, symbol_table.json.
+    HttpResponse runParser()
     {
-        // Variable declaration for supported types
-        string varType;
-        if (match("int"))
-            varType = "int";
-        else if (match("void"))
-            varType = "void";
-        else if (match("float"))
-            varType = "float";
-        else if (match("string"))
-            varType = "string";
-        if (!varType.empty())
+        lock_guard<mutex> guard(diskLock);
+        try
         {
-            Token varName = advance();
-            if (varName.type != "identifier")
-                throw runtime_error("Expected variable name");
-            Node decl = {"VarDecl"};
-            decl.children.push_back({varType + " " + varName.value});
-            int val = 0;
-            bool hasVal = false;
-            if (match("="))
-            {
-                Node expr = parseExpression();
-                decl.children.push_back(expr);
-                // Try to evaluate if possible
-                unordered_map<string, int> dummyVars;
-                val = evalExpr(expr, dummyVars);
-                hasVal = true;
-            }
-            if (!match(";"))
-                throw runtime_error("Expected ; after variable declaration");
-            // Add variable to symbol table
-            symbolTable.push_back({varName.value, varType, currentScope, val, hasVal});
-            return decl;
+            Session session;
+            session.limits = limits;
+            RunStats stats;
+            Node tree = parseFiles({"input.cpp"}, session, stats);
+            requireValidSyntax(session);
+            simulateProgram(session, stats);
+            writeOutputs(tree, session, stats, "./", OutputOptions());
         }
-        if (match("return"))
+        catch (const exception &e)
         {
-            Node retNode = {"Return"};
-            retNode.children.push_back(parseExpression());
-            if (!match(";"))
-                throw runtime_error("Expected ; after return");
-            return retNode;
+            return error(500, string("Parser error: ") + e.what());
         }
-        if (match("if"))
+        return {200, "application/json", R"({"success":true})"};
+    }
+
+    HttpResponse route(const HttpRequest &request)
+    {
+        ++metrics.requests;
+        const string &path = request.path;
+        if (request.method == "GET" || request.method == "HEAD")
         {
-            Node ifNode = {"If"};
-            if (!match("("))
-                throw runtime_error("Expected ( after if");
-            ifNode.children.push_back(parseExpression());
-            if (!match(")"))
-                throw runtime_error("Expected ) after if condition");
-            ifNode.children.push_back(parseStatement());
-            if (match("else"))
-                ifNode.children.push_back(parseStatement());
-            return ifNode;
+            auto file = files.find(path == "/" ? "/index.html" : path);
+            if (file != files.end())
+                return {200, file->second.first, file->second.second};
+            if (path == "/stats")
+            {
+                CancelToken never;
+                return {200, "application/json", jsonText(daemon.handle({{"op", "stats"}}, never))};
+            }
+            // Files the app writes at run time are read from disk.
+            for (const char *name : {"input.cpp", "tree.json", "trace.json", "symbol_table.json"})
+                if (path.size() > 1 && path.substr(1) == name)
+                {
+                    lock_guard<mutex> guard(diskLock);
+                    try
+                    {
+                        return {200, path.back() == 'p' ? "text/plain; charset=utf-8" : "application/json", readFile(name)};
+                    }
+                    catch (const exception &)
+                    {
+                        break;
+                    }
+                }
+            return error(404, "Not found: " + path);
         }
-        if (match("while"))
+        if (request.method != "POST")
+            return error(405, "Method not allowed");
+        try
         {
-            Node whileNode = {"While"};
-            if (!match("("))
-                throw runtime_error("Expected ( after while");
-            whileNode.children.push_back(parseExpression());
-            if (!match(")"))
-                throw runtime_error("Expected ) after while condition");
-            whileNode.children.push_back(parseStatement());
-            return whileNode;
+            if (path == "/parse")
+                return parse(request);
+            if (path == "/subtree")
+                return subtree(request);
+            if (path == "/step")
+                return step(request);
+            if (path == "/locate")
+                return locate(request);
+            if (path == "/trace-stream")
+                return traceStream(request);
+            if (path == "/save-code")
+                return saveCode(request);
+            if (path == "/run-parser")
+                return runParser();
         }
-        if (match("cout"))
+        catch (const json::exception &e)
         {
-            Node coutNode = {"Cout"};
-            // Require at least one << and expression
-            if (!match("<<"))
-                throw runtime_error("Expected << after cout");
-            coutNode.children.push_back(parseExpression());
-            // Handle additional << expressions
-            while (match("<<"))
-            {
-                coutNode.children.push_back(parseExpression());
-            }
-            if (!match(";"))
-                throw runtime_error("Expected ; after cout");
-            return coutNode;
+            return error(400, string("Malformed request body: ") + e.what());
         }
-        if (match("cin"))
+        catch (const exception &e)
         {
-            Node cinNode = {"Cin"};
-            if (!match(">>"))
-                throw runtime_error("Expected >> after cin");
-            do
-            {
-                Token var = advance();
-                if (var.type != "identifier")
-                    throw runtime_error("Expected variable after >>");
-                cinNode.children.push_back({"Var: " + var.value});
-            } while (match(">>"));
-            if (!match(";"))
-                throw runtime_error("Expected ; after cin");
-            return cinNode;
+            return error(500, e.what());
         }
-        if (match("{"))
+        return error(404, "Not found: " + path);
+    }
+
+    static bool parses(const HttpRequest &request)
+    {
+        return request.method == "POST" && (request.path == "/parse" || request.path == "/trace-stream" || request.path == "/run-parser");
+    }
+
+    // Hands request to the workers; false (nothing queued) once --max-queue
+    // requests are already waiting or running, like the daemon sheds.
+    bool enqueue(Connection &connection, HttpRequest &request)
+    {
+        if (queued.fetch_add(1) >= limits.queue && limits.queue)
         {
-            Node block = {"Block"};
-            while (!match("}"))
+            --queued;
+            return false;
+        }
+        connection.pending = true;
+        pool->submit([this, target = &connection, request = std::move(request)]() mutable
+                     {
+            HttpResponse response = route(request);
+            --queued;
+            request.body.clear();
+            Loop &loop = *target->loop;
             {
-                block.children.push_back(parseStatement());
+                lock_guard<mutex> guard(loop.lock);
+                loop.done.push_back({target, std::move(request), std::move(response)});
             }
-            return block;
-        }
-        // Function call or assignment
-        Token first = advance();
-        if (first.type == "identifier")
+            uint64_t one = 1;
+            ssize_t written = write(loop.wakeup, &one, sizeof(one));
+            (void)written; });
+        return true;
+    }
+
+    static void appendResponse(Connection &connection, const HttpRequest &request, HttpResponse response)
+    {
+        string &out = connection.out;
+        out += "HTTP/1.1 " + to_string(response.status) + ' ' + statusText(response.status) + "\r\n";
+        out += "Content-Type: " + response.type + "\r\n";
+        if (response.stream)
+            out += "Transfer-Encoding: chunked\r\n";
+        else
+            out += "Content-Length: " + to_string(response.body.size()) + "\r\n";
+        if (response.varyAccept)
+            out += "Vary: Accept\r\n";
+        out += request.keepAlive && !connection.closing ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+        if (request.method != "HEAD")
+            out += response.body;
+        connection.stream = std::move(response.stream);
+        if (!request.keepAlive)
+            connection.closing = true;
+    }
+
+    // Answers every complete request in connection.in (pipelining works),
+    // up to one whose response is streamed or that went to a worker: those
+    // behind it wait for it.
+    void process(Connection &connection)
+    {
+        size_t maxBody = maxLineBytes(limits);
+        while (!connection.closing && !connection.stream && !connection.pending)
         {
-            if (match("="))
+            size_t headerEnd = connection.in.find("\r\n\r\n");
+            if (headerEnd == string::npos)
             {
-                // Assignment
-                Node assign = {"Assignment"};
-                assign.children.push_back({"Var: " + first.value});
-                Node expr = parseExpression();
-                assign.children.push_back(expr);
-                // Try to update value in symbol table if possible
-                for (auto &entry : symbolTable)
+                if (connection.in.size() > (64 << 10))
                 {
-                    if (entry.name == first.value && entry.scope == currentScope)
-                    {
-                        unordered_map<string, int> dummyVars;
-                        entry.value = evalExpr(expr, dummyVars);
-                        entry.hasValue = true;
-                    }
+                    connection.closing = true;
+                    appendResponse(connection, {}, error(431, "Request headers too large"));
                 }
-                if (!match(";"))
-                    throw runtime_error("Expected ; after assignment");
-                return assign;
+                return;
             }
-            else if (match("("))
+            HttpRequest request;
+            string_view head(connection.in.data(), headerEnd);
+            size_t lineEnd = head.find("\r\n");
+            string_view requestLine = head.substr(0, lineEnd);
+            size_t space1 = requestLine.find(' '), space2 = requestLine.rfind(' ');
+            if (space1 == string_view::npos || space2 == space1)
             {
-                // Function call
-                Node call = {"FunctionCall"};
-                call.children.push_back({"Callee: " + first.value});
-                Node args = {"Arguments"};
-                if (!match(")"))
+                connection.closing = true;
+                appendResponse(connection, {}, error(400, "Malformed request line"));
+                return;
+            }
+            request.method = string(requestLine.substr(0, space1));
+            request.path = string(requestLine.substr(space1 + 1, space2 - space1 - 1));
+            request.path = request.path.substr(0, request.path.find('?'));
+            string_view version = requestLine.substr(space2 + 1);
+            request.keepAlive = version == "HTTP/1.1";
+            size_t contentLength = 0;
+            bool chunked = false;
+            while (lineEnd != string_view::npos && lineEnd < head.size())
+            {
+                size_t next = head.find("\r\n", lineEnd + 2);
+                string_view line = head.substr(lineEnd + 2, next == string_view::npos ? string_view::npos : next - lineEnd - 2);
+                lineEnd = next;
+                size_t colon = line.find(':');
+                if (colon == string_view::npos)
+                    continue;
+                string name(line.substr(0, colon));
+                transform(name.begin(), name.end(), name.begin(), [](unsigned char c)
+                          { return static_cast<char>(tolower(c)); });
+                string_view value = line.substr(colon + 1);
+                while (!value.empty() && value.front() == ' ')
+                    value.remove_prefix(1);
+                if (name == "content-length")
+                    contentLength = strtoull(string(value).c_str(), nullptr, 10);
+                else if (name == "transfer-encoding")
+                    chunked = true;
+                else if (name == "accept")
+                    request.accept = string(value);
+                else if (name == "connection")
                 {
-                    do
-                    {
-                        args.children.push_back(parseExpression());
-                    } while (match(","));
-                    if (!match(")"))
-                        throw runtime_error("Expected ) after function call arguments");
+                    string token(value);
+                    transform(token.begin(), token.end(), token.begin(), [](unsigned char c)
+                              { return static_cast<char>(tolower(c)); });
+                    if (token == "close")
+                        request.keepAlive = false;
+                    else if (token == "keep-alive")
+                        request.keepAlive = true;
                 }
-                call.children.push_back(args);
-                if (!match(";"))
-                    throw runtime_error("Expected ; after function call");
-                return call;
+            }
+            if (chunked || (maxBody && contentLength > maxBody))
+            {
+                connection.closing = true;
+                appendResponse(connection, request, chunked ? error(501, "Chunked bodies are not supported")
+                                                            : error(413, "Request too large (limit " + to_string(maxBody) + " bytes)"));
+                return;
+            }
+            size_t total = headerEnd + 4 + contentLength;
+            if (connection.in.size() < total)
+                return;
+            request.body = connection.in.substr(headerEnd + 4, contentLength);
+            connection.in.erase(0, total);
+            if (!parses(request))
+                appendResponse(connection, request, route(request));
+            else if (!enqueue(connection, request))
+            {
+                ++metrics.requests;
+                ++metrics.shed;
+                appendResponse(connection, request, {503, "application/json", jsonText({{"error", "Too many queued requests (limit " + to_string(limits.queue) + ")"}, {"overloaded", true}})});
             }
         }
-        throw runtime_error("Unknown statement starting with: " + first.value);
     }
 
-    // What it does:
-    // Parses an expression (like 1 + 2, a, a + b, etc.).
-    // Returns the syntax tree for the expression.
-
-    Node parseExpression()
+    // Writes what it can; false once the connection should be dropped
+    // (write error, or everything written and closing, with no stream left).
+    static bool flush(Connection &connection)
     {
-        Node left = parseSimpleExpression();
-        // Handle binary operators (==, !=, <, >, <=, >=, +, -, *, /, %)
-        while (pos < tokens.size() && tokens[pos].type == "symbol" &&
-               (tokens[pos].value == "+" || tokens[pos].value == "-" ||
-                tokens[pos].value == "*" || tokens[pos].value == "/" ||
-                tokens[pos].value == "%" ||
-                tokens[pos].value == "==" || tokens[pos].value == "!=" ||
-                tokens[pos].value == "<" || tokens[pos].value == ">" ||
-                tokens[pos].value == "<=" || tokens[pos].value == ">="))
+        while (connection.sent < connection.out.size())
         {
-            Token op = advance();
-            Node exprNode = {"Expr"};
-            exprNode.children.push_back(left);
-            exprNode.children.push_back({"Op: " + op.value});
-            exprNode.children.push_back(parseSimpleExpression());
-            left = exprNode;
+            ssize_t n = send(connection.fd, connection.out.data() + connection.sent,
+                             connection.out.size() - connection.sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true;
+            if (n <= 0)
+            {
+                connection.out.clear(); // the peer is gone
+                connection.stream.reset();
+                connection.closing = true;
+                return false;
+            }
+            connection.sent += static_cast<size_t>(n);
         }
-        return left;
+        connection.out.clear();
+        connection.sent = 0;
+        return !connection.closing || connection.stream || connection.pending;
     }
 
-    // What it does:
-    // Parses a simple expression (like 1, a, a(), etc.).
-    // Returns the syntax tree for the simple expression.
+    // flush(), then once the output has drained: the next chunk of a trace
+    // stream, and when that was its last, the requests that waited behind
+    // it. One chunk per call, so a stream takes turns with other
+    // connections. False once the connection should be dropped.
+    bool pump(Connection &connection)
+    {
+        if (!flush(connection))
+            return false;
+        if (!connection.out.empty() || !connection.stream)
+            return true;
+        nextChunk(connection);
+        if (!connection.stream)
+            process(connection);
+        return flush(connection) || !connection.out.empty();
+    }
 
-    Node parseSimpleExpression()
+    // One worker: accepts on the shared listener and serves its connections.
+    void serve()
     {
-        Token left = advance();
-        if (left.type == "identifier" && pos < tokens.size() && tokens[pos].value == "(")
+        int poller = epoll_create1(EPOLL_CLOEXEC);
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.ptr = nullptr;
+        epoll_ctl(poller, EPOLL_CTL_ADD, listener, &event);
+        Loop loop;
+        loop.wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        event.events = EPOLLIN;
+        event.data.ptr = &loop;
+        epoll_ctl(poller, EPOLL_CTL_ADD, loop.wakeup, &event);
+        unordered_map<int, unique_ptr<Connection>> connections;
+        auto unwatch = [&](Connection *connection)
         {
-            // Function call as expression
-            advance(); // consume '('
-            Node call = {"FunctionCall"};
-            call.children.push_back({"Callee: " + left.value});
-            Node args = {"Arguments"};
-            if (pos < tokens.size() && tokens[pos].value != ")")
+            if (connection->watched)
+                epoll_ctl(poller, EPOLL_CTL_DEL, connection->fd, nullptr);
+            connection->watched = false;
+        };
+        // A connection a worker still holds is closed once its answer is in.
+        auto drop = [&](Connection *connection)
+        {
+            unwatch(connection);
+            if (connection->pending)
+                return;
+            close(connection->fd);
+            connections.erase(connection->fd);
+        };
+        auto watch = [&](Connection *connection)
+        {
+            if (connection->pending && connection->out.empty())
+                return unwatch(connection); // nothing to do until the answer is in
+            epoll_event ev{};
+            ev.events = connection->out.empty() && !connection->stream && !connection->pending ? EPOLLIN | EPOLLRDHUP : EPOLLOUT;
+            ev.data.ptr = connection;
+            epoll_ctl(poller, connection->watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, connection->fd, &ev);
+            connection->watched = true;
+        };
+
+        epoll_event events[256];
+        char buffer[1 << 16];
+        while (true)
+        {
+            int ready = epoll_wait(poller, events, 256, -1);
+            for (int i = 0; i < ready; ++i)
             {
-                do
+                if (events[i].data.ptr == &loop)
                 {
-                    args.children.push_back(parseExpression());
-                } while (match(","));
+                    uint64_t count;
+                    ssize_t n = read(loop.wakeup, &count, sizeof(count));
+                    (void)n;
+                    vector<Completion> done;
+                    {
+                        lock_guard<mutex> guard(loop.lock);
+                        done.swap(loop.done);
+                    }
+                    for (auto &[connection, request, response] : done)
+                    {
+                        connection->pending = false;
+                        appendResponse(*connection, request, std::move(response));
+                        process(*connection); // the requests pipelined behind it
+                        if (pump(*connection))
+                            watch(connection);
+                        else
+                            drop(connection);
+                    }
+                    continue;
+                }
+                auto *connection = static_cast<Connection *>(events[i].data.ptr);
+                if (!connection)
+                {
+                    int fd;
+                    while ((fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                    {
+                        int on = 1;
+                        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                        auto added = make_unique<Connection>();
+                        added->fd = fd;
+                        added->loop = &loop;
+                        watch(added.get());
+                        connections[fd] = std::move(added);
+                    }
+                    continue;
+                }
+                if (events[i].events & EPOLLIN)
+                {
+                    ssize_t n;
+                    while ((n = recv(connection->fd, buffer, sizeof(buffer), 0)) > 0)
+                        connection->in.append(buffer, static_cast<size_t>(n));
+                    process(*connection);
+                    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+                        connection->closing = true; // answer what was read, then close
+                }
+                if (events[i].events & (EPOLLERR | EPOLLHUP))
+                    connection->closing = true;
+                // While a response is pending only EPOLLOUT is watched, so a
+                // slow reader gets no more requests processed.
+                if (pump(*connection))
+                    watch(connection);
+                else
+                    drop(connection);
             }
-            if (!match(")"))
-                throw runtime_error("Expected ) after function call arguments");
-            call.children.push_back(args);
-            return call;
         }
-        Node exprNode = {"Expr"};
-        exprNode.children.push_back({"Value: " + left.value});
-        return exprNode;
     }
-};
 
-// --- Expression Evaluation ---
-
-int evalExpr(const Node &expr, unordered_map<string, int> &vars)
-{
-    if (expr.label == "Expr")
+public:
+    HttpServer(size_t maxDocuments, const Limits &limits) : limits(limits), daemon(maxDocuments, metrics, this->limits)
     {
-        if (expr.children.size() == 1)
-        {
-            string val = expr.children[0].label.substr(7); // "Value: "
-            if (!val.empty() && isdigit(val[0]))
-                return stoi(val);
-            if (vars.count(val))
-                return vars[val];
-            return 0;
-        }
-        else if (expr.children.size() == 3)
+        const pair<const char *, const char *> assets[] = {
+            {"index.html", "text/html; charset=utf-8"},
+            {"script.js", "application/javascript"},
+            {"cbor.js", "application/javascript"},
+            {"style.css", "text/css"}};
+        for (const auto &[name, type] : assets)
         {
-            int left = evalExpr(expr.children[0], vars);
-            string op = expr.children[1].label.substr(4); // "Op: "
-            int right = evalExpr(expr.children[2], vars);
-            if (op == "+")
-                return left + right;
-            if (op == "-")
-                return left - right;
-            if (op == "*")
-                return left * right;
-            if (op == "/")
-                return right != 0 ? left / right : 0;
-            if (op == "%")
-                return right != 0 ? left % right : 0;
-            if (op == "==")
-                return left == right;
-            if (op == "!=")
-                return left != right;
-            if (op == "<")
-                return left < right;
-            if (op == ">")
-                return left > right;
-            if (op == "<=")
-                return left <= right;
-            if (op == ">=")
-                return left >= right;
+            try
+            {
+                files[string("/") + name] = {type, readFile(name)};
+            }
+            catch (const exception &)
+            {
+                cerr << "Warning: " << name << " not found, it will not be served" << endl;
+            }
         }
     }
-    return 0;
-}
 
-json nodeToJson(const Node &node)
-{
-    json j;
-    j["name"] = node.label;
-    j["children"] = json::array();
-    for (const auto &child : node.children)
+    int run(int port, size_t threads)
     {
-        j["children"].push_back(nodeToJson(child));
+        signal(SIGPIPE, SIG_IGN);
+        listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int on = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(static_cast<uint16_t>(port));
+        if (listener < 0 || ::bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0)
+            throw runtime_error("Cannot listen on 127.0.0.1:" + to_string(port) + ": " + strerror(errno));
+        pool.emplace(threads);
+        cout << "Serving on http://127.0.0.1:" << port << " with " << max<size_t>(1, threads) << " threads" << endl;
+        vector<thread> workers;
+        for (size_t i = 0; i < max<size_t>(1, threads); ++i)
+            workers.emplace_back([this]
+                                 { serve(); });
+        for (auto &worker : workers)
+            worker.join();
+        return 0;
     }
-    return j;
-}
+};
 
-// --- Trace Generation ---
+#endif
+
+    // --- Main ---
 
+// Usage: parser [-o DIR] [FILE...]
+//        parser --pipe [FILE...]
+//        parser --batch DIR|LIST [-j N] [-o DIR]
+// With no files, input.cpp is parsed. Several files are parsed as one
+// program: each becomes a "File: <path>" subtree, and calls may cross files.
+// Outputs go to DIR (default: the current directory; batch_out for --batch).
+// --pipe reads stdin (or FILE...) and writes one JSON document to stdout
+// instead of files, so concurrent callers never share temp files.
+// --format cbor|msgpack switches every output (files, --pipe, --batch) to binary.
+// --layout adds server-computed "x"/"y" tidy-tree coordinates to every node.
+// --spans adds each node's source "span": [byte offset, length].
+// --daemon serves parse/subtree requests on stdin/stdout (see Daemon).
+// --supervisor serves the same protocol from -j N forked workers (see Supervisor).
+// --http PORT serves the web UI and its endpoints itself (see HttpServer).
+// --svg PATH renders the parse tree as an SVG image instead ("-" = stdout).
+// --simd scalar|sse2|avx2 picks the lexer's character kernels (default: the
+// widest the CPU supports).
+// -j N also lexes a large input in up to N parallel chunks (see tokenizeParallel).
+// --pipeline N lexes on a second thread, feeding the parser through an
+// N-token ring (see TokenPipe), instead of lexing the whole file first.
+// --trace-ndjson PATH streams the trace as NDJSON while simulating instead
+// of writing trace.json; with "-" only the trace is written, to stdout.
+// --max-input/-tokens/-nodes/-depth/-expr-depth/-trace/-output/-queue/-errors N
+// override the resource limits (see Limits); 0 lifts one.
 
-void simulateExecution(const Node &node, unordered_map<string, int> &vars)
+int main(int argc, char **argv)
 {
-    if (node.label == "Function")
+    vector<string> paths;
+    string outDir;
+    string batchSource;
+    bool pipeMode = false;
+    bool daemonMode = false;
+    bool supervisorMode = false;
+    int httpPort = 0;
+    string svgPath;
+    string tracePath;
+    bool traceStreaming = false; // streamTrace reports its own failures
+    size_t pipeline = 0;
+    size_t maxDocuments = 64;
+    OutputOptions options;
+    Limits limits;
+    size_t threads = thread::hardware_concurrency();
+    // --max-* flags: a byte or item count, 0 for no limit
+    const pair<const char *, size_t Limits::*> limitFlags[] = {
+        {"--max-input", &Limits::inputBytes},
+        {"--max-tokens", &Limits::tokens},
+        {"--max-nodes", &Limits::nodes},
+        {"--max-depth", &Limits::depth},
+        {"--max-expr-depth", &Limits::exprDepth},
+        {"--max-trace", &Limits::traceEvents},
+        {"--max-output", &Limits::outputBytes},
+        {"--max-queue", &Limits::queue},
+        {"--max-errors", &Limits::syntaxErrors}};
+    for (int i = 1; i < argc; ++i)
     {
-        string funcName;
-        for (const auto &child : node.children)
+        string arg = argv[i];
+        if (arg == "-o" && i + 1 < argc)
+            outDir = argv[++i];
+        else if (arg == "--batch" && i + 1 < argc)
+            batchSource = argv[++i];
+        else if (arg == "--pipe")
+            pipeMode = true;
+        else if (arg == "--layout")
+            options.layout = true;
+        else if (arg == "--spans")
+            options.spans = true;
+        else if (arg == "--daemon")
+            daemonMode = true;
+        else if (arg == "--supervisor")
+            supervisorMode = true;
+        else if (arg == "--http" && i + 1 < argc)
+            httpPort = atoi(argv[++i]);
+        else if (arg == "--svg" && i + 1 < argc)
+            svgPath = argv[++i];
+        else if (arg == "--trace-ndjson" && i + 1 < argc)
+            tracePath = argv[++i];
+        else if (arg == "--pipeline" && i + 1 < argc)
+            pipeline = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--simd" && i + 1 < argc)
         {
-            if (child.label.rfind("FunctionName:", 0) == 0)
+            charKernels = findCharKernels(argv[++i]);
+            if (!charKernels)
             {
-                funcName = child.label.substr(13);
-                break;
+                cerr << "Error: --simd " << argv[i] << " is not available here (expected scalar, sse2 or avx2)" << endl;
+                return 1;
             }
         }
-        if (!funcName.empty())
+        else if (arg == "--max-docs" && i + 1 < argc)
+            maxDocuments = static_cast<size_t>(max(1, atoi(argv[++i])));
+        else if (auto flag = find_if(begin(limitFlags), end(limitFlags), [&](const auto &flag)
+                                     { return arg == flag.first; });
+                 flag != end(limitFlags) && i + 1 < argc)
+            limits.*(flag->second) = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--format" && i + 1 < argc)
         {
-            trace.push_back({{"action", "call"}, {"function", funcName}});
-            // Find body and simulate it
-            for (const auto &child : node.children)
+            try
             {
-                if (child.label == "Body")
-                {
-                    for (const auto &stmt : child.children)
-                    {
-                        simulateExecution(stmt, vars);
-                    }
-                }
+                options.format = parseOutputFormat(argv[++i]);
+            }
+            catch (const exception &e)
+            {
+                cerr << "Error: " << e.what() << endl;
+                return 1;
             }
-            trace.push_back({{"action", "return"}, {"function", funcName}});
         }
-    }
-    else if (node.label == "VarDecl")
-    {
-        string var;
-        if (!node.children.empty())
+        else if (arg == "-j" && i + 1 < argc)
+            threads = static_cast<size_t>(max(1, atoi(argv[++i])));
+        else if (arg == "-h" || arg == "--help")
         {
-            string decl = node.children[0].label;
-            size_t space = decl.find(' ');
-            var = (space != string::npos) ? decl.substr(space + 1) : decl;
+            cout << "Usage: " << argv[0] << " [-o DIR] [--format json|cbor|msgpack] [--layout] [--spans] [--pipeline N] [--trace-ndjson PATH|-] [FILE...]\n"
+                 << "       " << argv[0] << " --pipe [--format json|cbor|msgpack] [--layout] [--spans] [--pipeline N] [FILE...] < input\n"
+                 << "       " << argv[0] << " --batch DIR|LIST [-j N] [-o DIR] [--format json|cbor|msgpack] [--layout] [--spans]\n"
+                 << "       " << argv[0] << " --daemon [--max-docs N]\n"
+                 << "       " << argv[0] << " --supervisor [-j N] [--max-docs N]\n"
+                 << "       " << argv[0] << " --http PORT [-j N] [--max-docs N]\n"
+                 << "       " << argv[0] << " --svg PATH|- [FILE...]\n"
+                 << "Lexer kernels: --simd scalar|sse2|avx2 (default: best available)\n"
+                 << "Limits (0 = none): --max-input BYTES --max-tokens N --max-nodes N --max-depth N\n"
+                 << "                   --max-expr-depth N --max-trace N --max-output BYTES --max-queue N\n"
+                 << "                   --max-errors N\n";
+            return 0;
         }
-        int val = 0;
-        if (node.children.size() > 1)
-            val = evalExpr(node.children[1], vars);
-        vars[var] = val;
-        trace.push_back({{"action", "vardecl"}, {"variable", var}});
-    }
-    else if (node.label == "Assignment")
-    {
-        string var;
-        if (!node.children.empty())
-            var = node.children[0].label.substr(5); // "Var: "
-        int val = 0;
-        if (node.children.size() > 1)
-            val = evalExpr(node.children[1], vars);
-        vars[var] = val;
-        trace.push_back({{"action", "assign"}, {"variable", var}});
-    }
-    else if (node.label == "Return")
-    {
-        trace.push_back({{"action", "return_stmt"}});
-        if (!node.children.empty())
-            evalExpr(node.children[0], vars);
+        else
+            paths.push_back(arg);
     }
-    else if (node.label == "If")
+
+    if (daemonMode)
+        return runDaemon(maxDocuments, limits);
+
+    if (httpPort > 0)
     {
-        trace.push_back({{"action", "if_enter"}});
-        bool conditionTrue = false;
-        if (!node.children.empty())
-            conditionTrue = evalExpr(node.children[0], vars);
-        if (conditionTrue)
+#ifdef __linux__
+        try
         {
-            trace.push_back({{"action", "if_taken"}, {"branch", "then"}});
-            if (node.children.size() > 1)
-                simulateExecution(node.children[1], vars);
+            return HttpServer(maxDocuments, limits).run(httpPort, threads);
         }
-        else
+        catch (const exception &e)
         {
-            trace.push_back({{"action", "if_taken"}, {"branch", "else"}});
-            if (node.children.size() > 2)
-                simulateExecution(node.children[2], vars);
+            cerr << "Error: " << e.what() << endl;
+            return 1;
         }
+#else
+        cerr << "Error: --http needs epoll (Linux); use server.py elsewhere" << endl;
+        return 1;
+#endif
     }
-    else if (node.label == "While")
+
+    if (supervisorMode)
     {
-        trace.push_back({{"action", "while_enter"}});
-        int loopCount = 0;
-        while (evalExpr(node.children[0], vars) && loopCount < 10) // prevent infinite loop
+#ifdef _WIN32
+        cerr << "Error: --supervisor needs fork(); use --daemon on Windows" << endl;
+        return 1;
+#else
+        try
         {
-            if (node.children.size() > 1)
-                simulateExecution(node.children[1], vars);
-            loopCount++;
+            return Supervisor(threads, maxDocuments, limits).run();
         }
-    }
-    else if (node.label == "Cout")
-    {
-        trace.push_back({{"action", "cout"}});
-        for (const auto &child : node.children)
-            evalExpr(child, vars);
-    }
-    else if (node.label == "Cin")
-    {
-        trace.push_back({{"action", "cin"}});
-        // For demo, set input variable to 5 if not already set
-        for (const auto &child : node.children)
+        catch (const exception &e)
         {
-            if (child.label.rfind("Var: ", 0) == 0)
-            {
-                string var = child.label.substr(5);
-                if (vars.count(var) == 0)
-                    vars[var] = 5;
-            }
+            cerr << "Error: " << e.what() << endl;
+            return 1;
         }
+#endif
     }
-    else if (node.label == "FunctionCall")
+
+    if (pipeMode)
     {
-        string callee;
-        for (const auto &child : node.children)
-        {
-            if (child.label.rfind("Callee:", 0) == 0)
-            {
-                callee = child.label.substr(7);
-                break;
-            }
-        }
-        if (!callee.empty())
+        if (paths.empty())
+            paths.push_back("-");
+        Session session;
+        session.limits = limits;
+        session.pipeline = pipeline;
+        session.lexThreads = threads;
+        RunStats stats;
+        vector<string> errors;
+        Node tree = {NodeKind::Program};
+        bool parsed = false;
+        try
         {
-            trace.push_back({{"action", "call"}, {"function", callee}});
-            for (const auto &func : allFunctions)
-            {
-                string fname;
-                for (const auto &fchild : func.children)
-                {
-                    if (fchild.label.rfind("FunctionName:", 0) == 0)
-                    {
-                        fname = fchild.label.substr(13);
-                        break;
-                    }
-                }
-                if (fname == callee)
-                {
-                    simulateExecution(func, vars);
-                    break;
-                }
-            }
-            trace.push_back({{"action", "return"}, {"function", callee}});
+            tree = parseFiles(paths, session, stats);
+            parsed = true;
+            for (const auto &error : session.syntaxErrors)
+                errors.push_back(error.what());
+            if (errors.empty())
+                simulateProgram(session, stats);
         }
-    }
-    else
-    {
-        for (const auto &child : node.children)
+        catch (const exception &e)
         {
-            simulateExecution(child, vars);
+            errors.push_back(e.what());
         }
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        string document = encodeLimited(runDocument(parsed ? &tree : nullptr, session, stats, errors, options), options.format, limits.outputBytes);
+        cout.write(document.data(), static_cast<streamsize>(document.size()));
+        if (options.format == OutputFormat::Json)
+            cout << '\n';
+        cout.flush();
+        return errors.empty() ? 0 : 1;
     }
-}
-
-    // --- Main ---
-
-int main()
-{
-    ifstream file("input.cpp");
-    if (!file.is_open())
-    {
-        cerr << "Failed to open input.cpp\n";
-        return 1;
-    }
-    stringstream buffer;
-    buffer << file.rdbuf();
-    string code = buffer.str();
 
     try
     {
-        auto tokens = tokenize(code);
-        Parser parser(tokens);
-        Node tree = parser.parse();
-        json output = nodeToJson(tree);
+        if (!batchSource.empty())
+            return runBatch(batchSource, outDir.empty() ? "batch_out" : outDir, threads, options, limits);
 
-        // Simulate execution starting from main
-        for (const auto &func : allFunctions)
+        if (!svgPath.empty())
         {
-            for (const auto &fchild : func.children)
+            if (paths.empty())
+                paths.push_back("input.cpp");
+            Session session;
+            session.limits = limits;
+            session.pipeline = pipeline;
+            session.lexThreads = threads;
+            RunStats stats;
+            Node tree = parseFiles(paths, session, stats);
+            requireValidSyntax(session);
+            FILE *file = svgPath == "-" ? stdout : fopen(svgPath.c_str(), "wb");
+            if (!file)
+                throw runtime_error("Failed to open " + svgPath);
+            writeSvg(tree, session.strings, file);
+            if (file != stdout)
             {
-                if (fchild.label == "FunctionName: main")
-                {
-                    unordered_map<string, int> vars;
-                    simulateExecution(func, vars);
-                }
+                fclose(file);
+                cout << "Parse tree rendered to " << svgPath << "\n";
             }
+            return 0;
         }
 
-        // Write parse tree
-        ofstream out("tree.json");
-        out << output.dump(4);
+        if (paths.empty())
+            paths.push_back("input.cpp");
+        if (outDir.empty())
+            outDir = ".";
 
-        // Write trace
-        ofstream traceOut("trace.json");
-        traceOut << json(trace).dump(4);
+        Session session;
+        session.limits = limits;
+        session.pipeline = pipeline;
+        session.lexThreads = threads;
+        RunStats stats;
+        Node tree = parseFiles(paths, session, stats);
+        requireValidSyntax(session);
 
-        // Write symbol table
-        json symtab = json::array();
-        for (const auto &entry : symbolTable)
+        if (!tracePath.empty())
         {
-            json row;
-            row["name"] = entry.name;
-            row["type"] = entry.type;
-            row["scope"] = entry.scope;
-            if (entry.hasValue)
-                row["value"] = entry.value;
-            symtab.push_back(row);
+            if (tracePath != "-")
+                writeOutputs(tree, session, stats, outDir + "/", options, false);
+            FILE *file = tracePath == "-" ? stdout : fopen(tracePath.c_str(), "wb");
+            if (!file)
+                throw runtime_error("Failed to open " + tracePath);
+            size_t events;
+            {
+                BufferedWriter out(file);
+                traceStreaming = true;
+                events = streamTrace(session, out, stats);
+            }
+            if (file != stdout)
+            {
+                fclose(file);
+                string ext = formatExtension(options.format);
+                cout << "\nParse tree generated and saved to tree." << ext << "\n";
+                cout << "Execution trace streamed to " << tracePath << " (" << events << " events)\n";
+                cout << "Symbol table generated and saved to symbol_table." << ext << "\n";
+            }
+            return 0;
         }
-        ofstream symtabOut("symbol_table.json");
-        symtabOut << symtab.dump(4);
 
-        cout << "\nParse tree generated and saved to tree.json\n";
-        cout << "Execution trace generated and saved to trace.json\n";
-        cout << "Symbol table generated and saved to symbol_table.json\n";
+        simulateProgram(session, stats);
+        writeOutputs(tree, session, stats, outDir + "/", options);
+
+        string ext = formatExtension(options.format);
+        cout << "\nParse tree generated and saved to tree." << ext << "\n";
+        cout << "Execution trace generated and saved to trace." << ext << "\n";
+        cout << "Symbol table generated and saved to symbol_table." << ext << "\n";
     }
     catch (const exception &e)
     {
+        // A stdout trace stream always ends with an error line on failure,
+        // including read and syntax errors from before the run started
+        if (tracePath == "-" && !traceStreaming)
+            cout << jsonText({{"error", e.what()}}) << endl;
         cerr << "Error: " << e.what() << endl;
         return 1;
     }
@@ -4,67 +4,273 @@ const convertBtn = document.getElementById('convert-btn');
 const statusMessage = document.getElementById('status-message');
 const visualizationSection = document.getElementById('visualization-section');
 
+// The tree currently shown. The server keeps the full parse tree (doc) and
+// sends only the top levels; nodes with `childCount` have more children to
+// fetch from /subtree. Every node carries `span`: [byte offset, length] in
+// the code that was sent, which starts `codeStart` characters into the
+// textarea (the code is trimmed before sending).
+let current = null;
+let zoomTransform = d3.zoomIdentity;
+
+// Clicking Convert again supersedes the parse still in flight: its fetch is
+// aborted and the server cancels its daemon request for this client.
+const clientId = Math.random().toString(36).slice(2);
+let inFlight = null;
+
+// The trace being played into #branch-info, aborted by the next Convert.
+const branchInfo = document.getElementById('branch-info');
+let playback = null;
+
 // Add event listener to the convert button
 convertBtn.addEventListener('click', async () => {
     const code = codeInput.value.trim();
+    const codeStart = codeInput.value.indexOf(code);
     if (!code) {
         showStatus('Please enter some code first!', 'error');
         return;
     }
 
+    if (inFlight) {
+        inFlight.abort();
+    }
+    if (playback) {
+        playback.abort();
+        playback = null;
+    }
+    branchInfo.textContent = '';
+    const controller = new AbortController();
+    inFlight = controller;
+
     try {
-        // Show loading state
-        convertBtn.disabled = true;
+        // Show loading state (the button stays enabled so an edit can supersede this run)
         convertBtn.textContent = 'Processing...';
         showStatus('Processing your code...', 'info');
 
-        // Save code to input.cpp
-        const response = await fetch('/save-code', {
+        // Parse the code; the server answers with tree, trace, symbols and errors at once.
+        // CBOR is preferred (smaller, no text parsing); JSON still works if the server lacks it.
+        const response = await fetch('/parse', {
             method: 'POST',
             headers: {
                 'Content-Type': 'application/json',
+                'Accept': 'application/cbor, application/json;q=0.9',
             },
-            body: JSON.stringify({ code }),
+            body: JSON.stringify({ code, client: clientId }),
+            signal: controller.signal,
         });
 
         if (!response.ok) {
-            throw new Error('Failed to save code');
+            throw new Error('Failed to parse code');
         }
 
-        // Run the parser
-        const parseResponse = await fetch('/run-parser', {
-            method: 'POST',
-        });
-
-        if (!parseResponse.ok) {
-            throw new Error('Failed to parse code');
+        const result = await readDocument(response);
+        if (controller !== inFlight) {
+            return;
+        }
+        // With syntax errors the server still sends the tree it could
+        // parse (without the statements it skipped); only a lexer error
+        // leaves no tree at all.
+        if (!result.tree) {
+            throw new Error(result.errors.join('\n'));
         }
 
-        // Show success message and visualization
-        showStatus('Code processed successfully!', 'success');
+        // Show the outcome and visualization
+        if (result.errors.length > 0) {
+            showStatus('Error: ' + result.errors.join('\n'), 'error');
+        } else {
+            showStatus('Code processed successfully!', 'success');
+        }
         visualizationSection.style.display = 'block';
 
-        // Load and render the tree
-        const [treeData, traceData] = await Promise.all([
-            fetch('tree.json').then(res => res.json()),
-            fetch('trace.json').then(res => res.json())
-        ]);
-
-        // Clear previous visualization if any
-        document.getElementById('tree').innerHTML = '';
-        
         // Render the new tree
-        renderTree(treeData, traceData);
+        current = {
+            doc: result.doc, tree: result.tree, trace: result.trace, extent: result.extent,
+            code, bytes: new TextEncoder().encode(code),
+            codeStart,
+        };
+        zoomTransform = d3.zoomIdentity;
+        drawCurrentTree();
+        if (result.errors.length === 0) {
+            playTrace(code, result.trace);
+        }
 
     } catch (error) {
-        showStatus('Error: ' + error.message, 'error');
+        if (controller === inFlight) {
+            showStatus('Error: ' + error.message, 'error');
+        }
     } finally {
-        // Reset button state
-        convertBtn.disabled = false;
-        convertBtn.textContent = 'Convert & Visualize';
+        // Reset button state, unless a newer run has taken over
+        if (controller === inFlight) {
+            inFlight = null;
+            convertBtn.textContent = 'Convert & Visualize';
+        }
     }
 });
 
+// Decodes a /parse response according to its Content-Type.
+async function readDocument(response) {
+    const type = response.headers.get('Content-Type') || '';
+    if (type.startsWith('application/cbor')) {
+        return decodeCbor(await response.arrayBuffer());
+    }
+    return response.json();
+}
+
+// Streams the execution trace of code from /trace-stream (NDJSON, one event
+// per line) and shows each step in #branch-info as it arrives, paced so the
+// run can be followed. The parser ends a failed run with an {"error": ...}
+// line, which goes to the status message. A server without the route gets
+// the trace /parse already sent (`fallback`) played instead.
+async function playTrace(code, fallback) {
+    const controller = new AbortController();
+    playback = controller;
+    let step = 0;
+    const show = async event => {
+        branchInfo.textContent = `Step ${++step}: ${describeEvent(event)}`;
+        await new Promise(resolve => setTimeout(resolve, 150));
+    };
+    try {
+        const response = await fetch('/trace-stream', {
+            method: 'POST',
+            headers: { 'Content-Type': 'application/json' },
+            body: JSON.stringify({ code }),
+            signal: controller.signal,
+        });
+        if (response.status === 404) {
+            for (const event of fallback || []) {
+                await show(event);
+                if (controller.signal.aborted) return;
+            }
+            return;
+        }
+        if (!response.ok) {
+            throw new Error('Failed to stream the trace');
+        }
+        const reader = response.body.getReader();
+        const decoder = new TextDecoder();
+        let pending = '';
+        for (;;) {
+            const { done, value } = await reader.read();
+            pending += decoder.decode(value, { stream: !done });
+            const lines = pending.split('\n');
+            pending = done ? '' : lines.pop();
+            for (const line of lines) {
+                if (!line.trim()) continue;
+                const event = JSON.parse(line);
+                if (event.error) {
+                    throw new Error(event.error);
+                }
+                await show(event);
+                if (controller.signal.aborted) return;
+            }
+            if (done) break;
+        }
+    } catch (error) {
+        if (!controller.signal.aborted) {
+            showStatus('Error: ' + error.message, 'error');
+        }
+    } finally {
+        if (playback === controller) {
+            playback = null;
+        }
+    }
+}
+
+function describeEvent(event) {
+    switch (event.action) {
+        case 'call': return `call ${event.function}()`;
+        case 'return': return `return from ${event.function}()`;
+        case 'vardecl': return `declare ${event.variable}`;
+        case 'assign': return `assign ${event.variable}`;
+        case 'return_stmt': return 'return statement';
+        case 'if_enter': return 'evaluate if';
+        case 'if_taken': return `if \u2192 ${event.branch}`;
+        case 'while_enter': return 'enter while loop';
+        default: return event.action;
+    }
+}
+
+function drawCurrentTree() {
+    // Clear previous visualization if any
+    document.getElementById('tree').innerHTML = '';
+    renderTree(current.tree, current.trace, current.extent);
+}
+
+// Fetches the next children of a collapsed node and redraws.
+async function expandNode(data) {
+    try {
+        const loaded = data.children ? data.children.length : 0;
+        const response = await fetch('/subtree', {
+            method: 'POST',
+            headers: {
+                'Content-Type': 'application/json',
+                'Accept': 'application/cbor, application/json;q=0.9',
+            },
+            body: JSON.stringify({ doc: current.doc, node: data.id, depth: 3, offset: loaded }),
+        });
+        const result = await readDocument(response);
+        if (!response.ok || result.error) {
+            throw new Error(result.error || 'Failed to load subtree');
+        }
+        data.children = (data.children || []).concat(result.tree.children || []);
+        if (result.tree.childCount !== undefined && data.children.length < result.tree.childCount) {
+            data.childCount = result.tree.childCount;
+        } else {
+            delete data.childCount;
+        }
+        drawCurrentTree();
+    } catch (error) {
+        showStatus('Error: ' + error.message, 'error');
+    }
+}
+
+// Selects a node's source text in the textarea. Spans count UTF-8 bytes,
+// so the prefix is decoded to find the matching character positions.
+function highlightSource(span) {
+    if (!span || !current) return;
+    const decoder = new TextDecoder();
+    const toChars = offset => current.codeStart + decoder.decode(current.bytes.subarray(0, offset)).length;
+    codeInput.focus({ preventScroll: true });
+    codeInput.setSelectionRange(toChars(span[0]), toChars(span[0] + span[1]));
+}
+
+// Moving the cursor in the editor marks the tree node under it: /locate
+// answers with the innermost node and its ancestors, and the deepest of
+// them that is drawn gets the mark. Skipped once the code was edited.
+let locating = false;
+async function locateCursor() {
+    if (!current || locating || codeInput.value.trim() !== current.code) return;
+    const cursor = codeInput.selectionStart - current.codeStart;
+    if (cursor < 0) return;
+    const offset = new TextEncoder().encode(current.code.slice(0, cursor)).length;
+    locating = true;
+    try {
+        const response = await fetch('/locate', {
+            method: 'POST',
+            headers: { 'Content-Type': 'application/json' },
+            body: JSON.stringify({ doc: current.doc, offset }),
+        });
+        const result = await response.json();
+        if (response.ok && current && result.doc === current.doc) {
+            markNode(result.node === null ? [] : result.path.concat([result.node]));
+        }
+    } catch (error) {
+        // Only a hint: a failed lookup leaves the mark as it was.
+    } finally {
+        locating = false;
+    }
+}
+
+function markNode(ids) {
+    const drawn = new Set(d3.selectAll('#tree .node').data().map(d => d.data.id));
+    const target = ids.filter(id => drawn.has(id)).pop();
+    d3.selectAll('#tree .node circle')
+        .attr('stroke', d => d.data.id === target ? '#ffbe0b' : '#22223b')
+        .attr('stroke-width', d => d.data.id === target ? 3 : 2);
+}
+
+codeInput.addEventListener('click', locateCursor);
+codeInput.addEventListener('keyup', locateCursor);
+
 function showStatus(message, type) {
     statusMessage.textContent = message;
     statusMessage.className = type;
@@ -86,7 +292,7 @@ function getNodeColor(label) {
     return "#adb5bd";
 }
 
-function renderTree(treeData, traceData) {
+function renderTree(treeData, traceData, extent) {
     const margin = { top: 80, right: 120, bottom: 80, left: 120 };
     const width = 1600 - margin.left - margin.right;
     const height = 1000 - margin.top - margin.bottom;
@@ -112,16 +318,48 @@ function renderTree(treeData, traceData) {
         .attr("offset", d => d.offset)
         .attr("stop-color", d => d.color);
 
-    const g = svg.append("g")
+    // Pan/zoom wraps the margin group; the transform survives redraws so
+    // expanding a node does not jump the view.
+    const viewport = svg.append("g");
+    const zoom = d3.zoom()
+        .scaleExtent([0.05, 20])
+        .on("zoom", event => {
+            zoomTransform = event.transform;
+            viewport.attr("transform", zoomTransform);
+        });
+    svg.call(zoom)
+        .call(zoom.transform, zoomTransform)
+        .on("dblclick.zoom", null);
+
+    const g = viewport.append("g")
         .attr("transform", `translate(${margin.left},${margin.top})`);
 
     const root = d3.hierarchy(treeData);
 
-    const treeLayout = d3.tree()
-        .size([height, width - 200])
-        .separation((a, b) => (a.parent === b.parent ? 2.5 : 2));
+    if (treeData.x !== undefined) {
+        // The server already laid the tree out (parser --layout): x is the
+        // breadth position and y the depth, so only scale them to the view.
+        // The extent of the whole tree is used when known, so nodes keep
+        // their place as collapsed parts are fetched.
+        let maxX = extent ? extent.x : 0;
+        let maxDepth = extent ? Math.max(1, extent.depth) : 1;
+        root.each(d => {
+            maxX = Math.max(maxX, d.data.x);
+            maxDepth = Math.max(maxDepth, d.data.y);
+        });
+        const kx = height / (maxX + 2);
+        const ky = (width - 200) / maxDepth;
+        root.each(d => {
+            d.x = (d.data.x + 1) * kx;
+            d.y = d.data.y * ky;
+        });
+    } else {
+        const treeLayout = d3.tree()
+            .size([height, width - 200])
+            .separation((a, b) => (a.parent === b.parent ? 2.5 : 2));
 
-    treeLayout(root);
+        treeLayout(root);
+    }
 
     g.selectAll('.link')
         .data(root.links())
@@ -148,6 +386,12 @@ function renderTree(treeData, traceData) {
         .attr('fill', d => getNodeColor(d.data.name))
         .attr('stroke', '#22223b')
         .attr('stroke-width', 2)
+        .attr('stroke-dasharray', d => d.data.childCount !== undefined ? '4 2' : null)
+        .style('cursor', 'pointer')
+        .on('click', (event, d) => {
+            highlightSource(d.data.span);
+            if (d.data.childCount !== undefined) expandNode(d.data);
+        })
         .style('filter', 'drop-shadow(0 2px 8px rgba(80,80,80,0.15))')
         .on('mouseover', function () {
             d3.select(this)
@@ -167,7 +411,12 @@ function renderTree(treeData, traceData) {
         .style('font-size', '13px')
         .style('font-family', '"Segoe UI", Roboto, sans-serif')
         .style('fill', '#343a40')
-        .text(d => d.data.name);
+        .text(d => {
+            // Collapsed nodes show how many children are still on the server
+            if (d.data.childCount === undefined) return d.data.name;
+            const hidden = d.data.childCount - (d.data.children ? d.data.children.length : 0);
+            return `${d.data.name} (+${hidden})`;
+        });
 
     // No animation/highlighting of flow for any statements
 }
@@ -1,9 +1,20 @@
-from flask import Flask, request, jsonify, send_from_directory
+from flask import Flask, request, jsonify, send_from_directory, Response
 import subprocess
+import threading
+import json
 import os
 
 app = Flask(__name__)
 
+build_lock = threading.Lock()
+
+# Compile the parser once, and again only when parse.cpp changes
+def ensure_parser():
+    with build_lock:
+        binary = 'parser.exe' if os.name == 'nt' else 'parser'
+        if not os.path.exists(binary) or os.path.getmtime(binary) < os.path.getmtime('parse.cpp'):
+            subprocess.run(['g++', '-std=c++20', '-O2', 'parse.cpp', '-o', 'parser', '-pthread'], check=True)
+
 # Serve static files
 @app.route('/')
 def index():
@@ -28,8 +39,8 @@ def save_code():
 @app.route('/run-parser', methods=['POST'])
 def run_parser():
     try:
-        # Compile and run the parser
-        subprocess.run(['g++', 'parse.cpp', '-o', 'parser'], check=True)
+        # Compile (if needed) and run the parser
+        ensure_parser()
         subprocess.run(['./parser'], check=True)
         return jsonify({'success': True})
     except subprocess.CalledProcessError as e:
@@ -37,5 +48,193 @@ def run_parser():
     except Exception as e:
         return jsonify({'error': str(e)}), 500
 
+# Response formats the parser can write, by MIME type (JSON first, so it
+# wins when the client does not say what it prefers)
+OUTPUT_FORMATS = {
+    'application/json': 'json',
+    'application/cbor': 'cbor',
+    'application/msgpack': 'msgpack',
+}
+
+# One long-lived `parser --supervisor` shared by all requests. It keeps parsed
+# trees in memory so the browser can page subtrees in by node id. Requests
+# are written as JSON lines; each response frame ("<id> <length>\n" + payload)
+# is handed to the waiting request with the same id.
+# A request sent on behalf of a client supersedes that client's previous
+# one: the daemon is told to cancel it, so stale parses stop burning CPU.
+class ParserDaemon:
+    def __init__(self):
+        self.proc = None
+        self.lock = threading.Lock()
+        self.pending = {}
+        self.latest = {}
+        self.next_id = 1
+
+    def start(self):
+        ensure_parser()
+        # --supervisor runs each request in a forked worker, so an input that
+        # crashes the parser fails alone; Windows has no fork, so it gets --daemon.
+        # Both coalesce identical concurrent parses into one run.
+        mode = '--daemon' if os.name == 'nt' else '--supervisor'
+        self.proc = subprocess.Popen(['./parser', mode], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        threading.Thread(target=self.read_responses, args=(self.proc,), daemon=True).start()
+
+    def read_responses(self, proc):
+        while True:
+            header = proc.stdout.readline()
+            if not header:
+                break
+            request_id, length = map(int, header.split())
+            payload = proc.stdout.read(length)
+            with self.lock:
+                slot = self.pending.pop(request_id, None)
+            if slot:  # None for fire-and-forget messages such as cancel
+                slot['payload'] = payload
+                slot['done'].set()
+        # The daemon exited: fail whatever was still waiting on it
+        with self.lock:
+            waiting = [slot for slot in self.pending.values() if slot]
+            self.pending.clear()
+        for slot in waiting:
+            slot['done'].set()
+
+    # Writes one message with a fresh id (caller holds self.lock)
+    def send(self, message):
+        request_id = self.next_id
+        self.next_id += 1
+        # "id" goes first so the parser can still answer a line it refuses
+        # to read in full (over its input limit)
+        message = {'id': request_id, **message}
+        self.proc.stdin.write((json.dumps(message) + '\n').encode())
+        self.proc.stdin.flush()
+        return request_id
+
+    # Sends one request and returns the raw response payload
+    def request(self, message, client=None):
+        slot = {'done': threading.Event(), 'payload': None}
+        with self.lock:
+            if self.proc is None or self.proc.poll() is not None:
+                self.start()
+            request_id = self.next_id
+            self.pending[request_id] = slot
+            self.send(message)
+            if client is not None:
+                previous = self.latest.get(client)
+                self.latest[client] = request_id
+                if previous in self.pending:
+                    self.pending[self.send({'op': 'cancel', 'target': previous})] = None
+        slot['done'].wait()
+        with self.lock:
+            if client is not None and self.latest.get(client) == request_id:
+                del self.latest[client]
+        if slot['payload'] is None:
+            raise RuntimeError('Parser daemon exited')
+        return slot['payload']
+
+daemon = ParserDaemon()
+
+def negotiated_format():
+    return request.accept_mimetypes.best_match(list(OUTPUT_FORMATS), 'application/json')
+
+# Parse code from the request body: the daemon answers with the top levels of
+# the tree (with x/y layout coordinates for the whole tree), the trace,
+# symbols, errors and stats, plus a doc id for fetching deeper subtrees.
+# Nothing is written to disk, so concurrent requests never collide.
+# The document is JSON, CBOR or MessagePack depending on the Accept header.
+@app.route('/parse', methods=['POST'])
+def parse():
+    try:
+        code = request.json.get('code')
+        mimetype = negotiated_format()
+        payload = daemon.request({'op': 'parse', 'code': code, 'depth': 4, 'layout': True,
+                                  'format': OUTPUT_FORMATS[mimetype]},
+                                 client=request.json.get('client'))
+        return Response(payload, mimetype=mimetype, headers={'Vary': 'Accept'})
+    except subprocess.CalledProcessError as e:
+        return jsonify({'error': f'Build error: {str(e)}'}), 500
+    except Exception as e:
+        return jsonify({'error': str(e)}), 500
+
+# Page in part of a parsed tree: {doc, node, depth?, offset?}
+@app.route('/subtree', methods=['POST'])
+def subtree():
+    try:
+        body = request.json
+        mimetype = negotiated_format()
+        message = {'op': 'subtree', 'doc': body['doc'], 'node': body['node'],
+                   'depth': body.get('depth', 3), 'offset': body.get('offset', 0),
+                   'format': OUTPUT_FORMATS[mimetype]}
+        payload = daemon.request(message)
+        return Response(payload, mimetype=mimetype, headers={'Vary': 'Accept'})
+    except Exception as e:
+        return jsonify({'error': str(e)}), 500
+
+# Run a parsed program a few trace events at a time: {doc, count?, restart?}
+@app.route('/step', methods=['POST'])
+def step():
+    try:
+        body = request.json
+        message = {'op': 'step', 'doc': body['doc'], 'count': body.get('count', 100),
+                   'restart': body.get('restart', False)}
+        return Response(daemon.request(message), mimetype='application/json')
+    except Exception as e:
+        return jsonify({'error': str(e)}), 500
+
+# The node under a source offset (and with "end", every node overlapping
+# [offset, end)): {doc, offset, end?, limit?}
+@app.route('/locate', methods=['POST'])
+def locate():
+    try:
+        body = request.json
+        message = {'op': 'locate', 'doc': body['doc'], 'offset': body['offset']}
+        if 'end' in body:
+            message['end'] = body['end']
+            message['limit'] = body.get('limit', 1000)
+        return Response(daemon.request(message), mimetype='application/json')
+    except Exception as e:
+        return jsonify({'error': str(e)}), 500
+
+# Stream the execution trace of {code} as NDJSON, one event per line as the
+# parser produces it, so the page can animate before the simulation is done.
+# A client that disconnects stops the parser.
+@app.route('/trace-stream', methods=['POST'])
+def trace_stream():
+    try:
+        code = request.json.get('code')
+        ensure_parser()
+        proc = subprocess.Popen(['./parser', '--trace-ndjson', '-', '-'],
+                                stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                                stderr=subprocess.PIPE)
+        proc.stdin.write(code.encode())
+        proc.stdin.close()
+    except Exception as e:
+        return jsonify({'error': str(e)}), 500
+
+    # The parser ends a failed stream with an {"error": ...} line; if it died
+    # without one, turn its stderr and exit status into that line here
+    def events():
+        last = b''
+        try:
+            for line in proc.stdout:
+                last = line
+                yield line
+            status = proc.wait()
+            if status != 0 and not last.startswith(b'{"error"'):
+                message = proc.stderr.read().decode(errors='replace').strip()
+                message = message.removeprefix('Error: ') or f'parser exited with status {status}'
+                yield json.dumps({'error': message}) + '\n'
+        finally:
+            proc.kill()
+            proc.wait()
+    return Response(events(), mimetype='application/x-ndjson')
+
+# Daemon counters: requests read, runs executed, parses coalesced, cancels
+@app.route('/stats')
+def stats():
+    try:
+        return Response(daemon.request({'op': 'stats'}), mimetype='application/json')
+    except Exception as e:
+        return jsonify({'error': str(e)}), 500
+
 if __name__ == '__main__':
     app.run(port=3000, debug=True) 
@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+# Benchmarks behind the numbers quoted in the history, on generated
+# inputs and the blocks in tests/bench repeated to size, so anyone can
+# rerun them:
+#
+#   python3 tests/bench.py            run every benchmark
+#   python3 tests/bench.py NAME...    run the benchmarks whose name contains NAME
+#
+# The report is printed and written to bench_output.txt. Times are the
+# parser's own *_ms stats (median of several runs), so process start-up and
+# writing the document are left out. -j rows only show scaling up to the
+# number of cores this machine has; the report says how many that is.
+
+import gzip
+import json
+import os
+import re
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+from pathlib import Path
+
+sys.path.insert(0, str(Path(__file__).resolve().parent))
+from run_tests import PARSER, ROOT, build  # noqa: E402
+
+BENCH = ROOT / 'tests' / 'bench'
+RUNS = 5
+
+
+def program(size=None, lines=None, block='program.cpp'):
+    """The block repeated to at least size bytes or lines."""
+    text = (BENCH / block).read_text()
+    per_block = len(text) if size else text.count('\n')
+    return text * -(-(size or lines) // per_block)
+
+
+def parse_stats(path, *args):
+    """The "stats" of one --pipe run on path."""
+    proc = subprocess.run([str(PARSER), '--pipe', *map(str, args), str(path)], cwd=ROOT,
+                          stdout=subprocess.PIPE, stderr=subprocess.PIPE, timeout=600)
+    if proc.returncode:
+        raise RuntimeError(proc.stderr.decode().strip())
+    # Keys are sorted, so stats comes before the (possibly very deep) tree.
+    return json.loads(re.search(rb'"stats":(\{[^{}]*\})', proc.stdout).group(1))
+
+
+def median_ms(path, key, *args):
+    return statistics.median(parse_stats(path, *args)[key] for _ in range(RUNS))
+
+
+def bench_precedence(work):
+    # Parse time (precedence climbing) of flat + * - / % < == chains
+    lines = ['terms   parse']
+    for terms in (1000, 5000):
+        path = work / f'chain{terms}.cpp'
+        operators = ['+', '*', '-', '/', '%', '<', '==']
+        expression = '1' + ''.join(f' {operators[i % len(operators)]} {i % 9 + 1}' for i in range(terms - 1))
+        path.write_text(f'int main() {{ int x = {expression}; return x; }}')
+        lines.append(f'{terms:<7} {median_ms(path, "parse_ms"):8.2f} ms')
+    return lines
+
+
+def bench_formats(work):
+    # --pipe document size per --format, and how long the browser takes to
+    # decode it (cbor.js vs TextDecoder + JSON.parse) when node is installed
+    path = work / 'program36k.cpp'
+    path.write_text(program(lines=36000))
+    lines = [f'{path.read_text().count(chr(10)):,} lines', 'format    bytes        gzip -6      decode']
+    documents = {}
+    for format in ('json', 'cbor', 'msgpack'):
+        out = work / f'document.{format}'
+        with open(out, 'wb') as f:
+            subprocess.run([str(PARSER), '--pipe', '--format', format, str(path)], cwd=ROOT,
+                           stdout=f, check=True, timeout=600)
+        documents[format] = out
+    decode = decode_times(documents)
+    for format, out in documents.items():
+        data = out.read_bytes()
+        lines.append(f'{format:<9} {len(data):>11,}  {len(gzip.compress(data, 6)):>11,}  {decode.get(format, "-")}')
+    return lines
+
+
+def decode_times(documents):
+    node = shutil.which('node')
+    if not node:
+        return {}
+    script = f'''
+        const fs = require('fs');
+        require('vm').runInThisContext(fs.readFileSync({json.dumps(str(ROOT / 'cbor.js'))}, 'utf8'));
+        const decoders = {{
+            json: bytes => JSON.parse(new TextDecoder().decode(bytes)),
+            cbor: bytes => decodeCbor(bytes),
+        }};
+        const paths = {{json: process.argv[1], cbor: process.argv[2]}};
+        const result = {{}};
+        for (const [format, decode] of Object.entries(decoders)) {{
+            const bytes = fs.readFileSync(paths[format]);
+            const times = [];
+            for (let i = 0; i < {RUNS}; ++i) {{
+                const start = process.hrtime.bigint();
+                decode(bytes);
+                times.push(Number(process.hrtime.bigint() - start) / 1e6);
+            }}
+            times.sort((a, b) => a - b);
+            result[format] = times[times.length >> 1].toFixed(1) + ' ms';
+        }}
+        console.log(JSON.stringify(result));
+    '''
+    proc = subprocess.run([node, '-e', script, str(documents['json']), str(documents['cbor'])],
+                          stdout=subprocess.PIPE, check=True, timeout=600)
+    return json.loads(proc.stdout)
+
+
+def bench_parallel(work):
+    # Chunked lexing (tokenizeParallel) of a 20 MB input at several -j
+    path = work / 'program20mb.cpp'
+    path.write_text(program(size=20 << 20))
+    cores = os.cpu_count() or 1
+    lines = [f'{path.stat().st_size:,} bytes, {cores} core(s)', '-j   lex (scan + intern)']
+    for threads in (1, 2, 4, 8):
+        note = '' if threads <= cores else '  (more threads than cores: not a scaling figure)'
+        lines.append(f'{threads:<4} {median_ms(path, "lex_ms", "-j", threads):8.2f} ms{note}')
+    return lines
+
+
+def bench_simd(work):
+    # The lexer's character kernels (--simd) on 5 MB of short tokens and of
+    # long ones, on one thread
+    lines = ['kernels  lex (scan + intern), -j 1']
+    for block in ('program.cpp', 'long_tokens.cpp'):
+        path = work / f'{block}.5mb.cpp'
+        path.write_text(program(size=5 << 20, block=block))
+        lines.append(f'{block}, {path.stat().st_size:,} bytes')
+        for kernels in ('scalar', 'sse2', 'avx2'):
+            try:
+                lines.append(f'{kernels:<8} {median_ms(path, "lex_ms", "--simd", kernels, "-j", 1):8.2f} ms')
+            except RuntimeError as e:
+                lines.append(f'{kernels:<8} skipped: {e}')
+    return lines
+
+
+def main(argv):
+    build()
+    benchmarks = [(name[6:], fn) for name, fn in globals().items() if name.startswith('bench_') and callable(fn)]
+    report = []
+    with tempfile.TemporaryDirectory() as work:
+        for name, fn in benchmarks:
+            if argv and not any(w in name for w in argv):
+                continue
+            report += [f'== {name}', *fn(Path(work)), '']
+    text = '\n'.join(report)
+    print(text)
+    (ROOT / 'bench_output.txt').write_text(text)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,16 @@
+// A block of long tokens for the lexer kernels: deep indentation, long
+// identifiers, long string literals and comments, where SSE2 / AVX2 test
+// 16 / 32 bytes per step instead of one.
+int compute_the_weighted_running_total_of_all_sensor_readings(int number_of_sensor_readings_to_consider) {
+                int accumulated_weighted_running_total_so_far = 0;
+                int index_of_the_current_sensor_reading = 0;
+                /* Every reading is weighted by its position, so that later readings, which are
+                   considered more reliable by the calibration procedure, count for more overall. */
+                while (index_of_the_current_sensor_reading < number_of_sensor_readings_to_consider) {
+                                accumulated_weighted_running_total_so_far = accumulated_weighted_running_total_so_far + index_of_the_current_sensor_reading;
+                                index_of_the_current_sensor_reading = index_of_the_current_sensor_reading + 1;
+                }
+                string description_of_the_result_for_the_operator = "the weighted running total of all sensor readings has been computed successfully";
+                cout << description_of_the_result_for_the_operator << endl; // reported once per call, after the loop has finished
+                return accumulated_weighted_running_total_so_far;
+}
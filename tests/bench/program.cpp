@@ -0,0 +1,44 @@
+// One block of the benchmark program: tests/bench.py repeats it to the
+// size a benchmark needs, so the inputs are the same on every machine.
+int accumulate_weighted_total(int first_value, int second_value) {
+    int running_total = 0;
+    int index = 0;
+    /* Weighted sum over a short range; the weights alternate so both
+       branches of the comparison below are taken. */
+    while (index < 8) {
+        if (index % 2 == 0) {
+            running_total = running_total + first_value * index;
+        } else {
+            running_total = running_total - second_value / 2;
+        }
+        index = index + 1;
+    }
+    return running_total;
+}
+
+float scaled_average(float numerator, int denominator) {
+    float result = 0.0;
+    if (denominator != 0) {
+        result = numerator / denominator * 1.5e2;
+    }
+    return result;
+}
+
+int classify_temperature(int degrees) {
+    string label = "comfortable, neither too hot nor too cold";
+    if (degrees < 10) {
+        label = "cold: wear a coat";
+    }
+    if (degrees >= 30) {
+        label = "hot: stay in the shade";
+    }
+    cout << "Temperature " << degrees << " is " << label << endl;
+    return degrees * 9 / 5 + 32;
+}
+
+int main() {
+    int total = accumulate_weighted_total(3, 7); // 3 * (0 + 2 + 4 + 6) - 4 * 3
+    float average = scaled_average(12.5, 4);
+    int fahrenheit = classify_temperature(total - 20);
+    return total + fahrenheit;
+}
@@ -0,0 +1,14 @@
+// a line comment before anything
+#include <iostream> // after an include
+using namespace std; /* after using */
+/* a block
+   comment over
+   several lines */
+int main() { /**/ int a = 8 /* inside */ / /* between */ 2; //
+    int b = a /***/ * 3; /* ** / * **/
+    string s = "// not a comment";
+    string t = "/* nor this */";
+    int c = b//2
+        + 1;
+    return c; // no newline at the end
+} // end
\ No newline at end of file
@@ -0,0 +1,17 @@
+#include <iostream>
+using namespace std;
+
+// Identifiers that start like keywords, a string equal to an identifier,
+// and the same names in several scopes all map to the right text.
+int mainly(int integer) {
+    string returned = "mainly";
+    int whiles = integer + 1;
+    return whiles;
+}
+
+int main() {
+    int integer = 2;
+    string mainly = "integer";
+    int x = integer * 3;
+    return x;
+}
@@ -0,0 +1,44 @@
+#include <iostream>
+using namespace std;
+
+// Every keyword once, next to identifiers one byte away from a keyword,
+// keywords in another case, and names longer than any keyword.
+void readIn() {
+    int ci = 0;
+    cin >> ci;
+}
+
+float floa(float floats) {
+    return floats;
+}
+
+int main() {
+    int in = 1;
+    int ints = in + 1;
+    int i = 2;
+    int iff = i * 3;
+    string strin = "while";
+    string strings = strin;
+    int els = 4;
+    int elses = els;
+    int whil = 0;
+    int Int = 5;
+    int IF = Int;
+    int returns = 6;
+    int voids = 7;
+    int couts = 8;
+    int cins = 9;
+    int main2 = 10;
+    int integer_while_return = 11;
+    float f = floa(1.5);
+    if (iff == 6) {
+        whil = whil + 1;
+    } else {
+        whil = whil - 1;
+    }
+    while (whil < 3) {
+        whil = whil + 1;
+    }
+    cout << strings << IF << endl;
+    return whil;
+}
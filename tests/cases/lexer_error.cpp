@@ -0,0 +1,4 @@
+int total;
+int f() { int b = 1; int ; return b; }
+int main() { return f(); }
+string s = "unterminated
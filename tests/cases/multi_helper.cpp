@@ -0,0 +1,4 @@
+int helper(int n) {
+    int doubled = n * 2;
+    return doubled;
+}
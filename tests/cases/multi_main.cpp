@@ -0,0 +1,7 @@
+#include <iostream>
+using namespace std;
+
+int main() {
+    helper(21);
+    return 0;
+}
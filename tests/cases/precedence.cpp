@@ -0,0 +1,9 @@
+int main() {
+    int a = 10 - 4 - 3;
+    int b = 1 + 2 * 3 - 4 / 2 % 3;
+    int c = 1 + 2 < 4 == 1;
+    int d = 8 / 2 * 3;
+    int e = 2 * 3 + 4 * 5 != 26;
+    int f = 1 < 2 == 2 > 1;
+    return a;
+}
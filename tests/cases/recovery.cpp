@@ -0,0 +1,25 @@
+#include <iostream>
+using namespace std;
+
+// Five mistakes: each is reported, and everything around them still
+// parses.
+int twice(int n) {
+    int m = n * 2
+    return m;
+}
+
+int broken( {
+    return 0;
+}
+
+int main() {
+    int a = 1;
+    int b = a + ;
+    string s = "ok";
+    cout << s << endl;
+    int = 3;
+    if (a < 2) {
+        a = a + 1
+    }
+    return a;
+}
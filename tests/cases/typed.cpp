@@ -0,0 +1,64 @@
+#include <iostream>
+using namespace std;
+
+// Values keep their type: 32-bit ints that wrap like the compiled program,
+// doubles, and strings that only compare. Every initializer is constant,
+// so each value shows in the symbol table; the same rules at run time show
+// in which branches runtime() takes.
+void runtime(int one, float third, string word) {
+    int big = 2147483647;
+    big = big + one;
+    if (big < 0) {
+        cout << "wrapped" << endl;
+    }
+    float f = third * 3;
+    if (f == 1) {
+        cout << "exact" << endl;
+    }
+    int t = 0;
+    t = 2.9;
+    if (t == 2) {
+        cout << "truncated" << endl;
+    }
+    if (one / 0 == 0) {
+        cout << "zero" << endl;
+    }
+    if (word < "zebra") {
+        cout << "ordered" << endl;
+    }
+    string copy = word;
+    copy = 5;
+    if (copy == word) {
+        cout << "kept" << endl;
+    } else {
+        cout << "unknown" << endl;
+    }
+}
+
+int main() {
+    int sum = 2147483647 + 1;
+    int product = 65536 * 65536 + 7;
+    int quotient = 7 / 2;
+    int negative = 0 - 7 / 2;
+    int remainder = 0 - 7 % 3;
+    int byZero = 5 / 0;
+    int modZero = 5 % 0;
+    int truncated = 3.99;
+    int tooBig = 3000000000.0;
+    float half = 1 / 2.0;
+    float widened = 7;
+    float mixed = 1 + 0.5 * 3;
+    float floatZero = 1.5 / 0;
+    float exponent = 2.5e3;
+    float bigLiteral = 4294967296;
+    string text = "abc";
+    int less = "abc" < "abd";
+    int equal = "abc" == "abc";
+    int concat = "a" + "b";
+    string fromInt = 5;
+    int fromString = "5";
+    int compare = 1.5 > 1;
+    runtime(1, 1 / 3.0, "apple");
+    cout << text << sum << half << endl;
+    return sum;
+}
@@ -0,0 +1,877 @@
+#!/usr/bin/env python3
+# Golden-output tests for the parser. Each test_* function below runs
+# ./parser on inputs from tests/cases and returns what it printed, with
+# timings removed; that text must match tests/expected/<name>.txt.
+#
+#   python3 tests/run_tests.py            run every test
+#   python3 tests/run_tests.py NAME...    run the tests whose name contains NAME
+#   python3 tests/run_tests.py --update   rewrite the expected files from this build
+#
+# The parser is rebuilt first when parse.cpp is newer, as server.py does.
+
+import http.client
+import json
+import os
+import re
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import xml.etree.ElementTree as ElementTree
+from contextlib import contextmanager
+from pathlib import Path
+
+ROOT = Path(__file__).resolve().parent.parent
+CASES = ROOT / 'tests' / 'cases'
+EXPECTED = ROOT / 'tests' / 'expected'
+PARSER = ROOT / ('parser.exe' if os.name == 'nt' else 'parser')
+
+
+def build():
+    if not PARSER.exists() or PARSER.stat().st_mtime < (ROOT / 'parse.cpp').stat().st_mtime:
+        subprocess.run(['g++', '-std=c++20', '-O2', 'parse.cpp', '-o', PARSER.name, '-pthread'],
+                       cwd=ROOT, check=True)
+
+
+def source(name):
+    return (CASES / name).read_bytes()
+
+
+def run(*args, input=b''):
+    """Runs the parser; returns (exit status, stdout bytes)."""
+    proc = subprocess.run([str(PARSER), *map(str, args)], input=input, cwd=ROOT,
+                          stdout=subprocess.PIPE, stderr=subprocess.PIPE, timeout=120)
+    return proc.returncode, proc.stdout
+
+
+def strip_timings(value):
+    """Drops the *_ms fields, the only part of a document that varies run to run."""
+    if isinstance(value, dict):
+        return {k: strip_timings(v) for k, v in value.items() if not k.endswith('_ms')}
+    if isinstance(value, list):
+        return [strip_timings(v) for v in value]
+    return value
+
+
+def show(value):
+    return json.dumps(strip_timings(value), indent=1, sort_keys=True)
+
+
+def pipe(code, *args):
+    """The --pipe document for code, and the exit status."""
+    status, out = run('--pipe', *args, input=code)
+    return status, json.loads(out)
+
+
+def daemon(requests, *args):
+    """Sends requests to --daemon in one write and returns its answers by id."""
+    lines = b''.join(json.dumps(r).encode() + b'\n' for r in requests)
+    status, out = run('--daemon', *args, input=lines)
+    return read_frames(out)
+
+
+@contextmanager
+def daemon_process(*args, mode='--daemon'):
+    """Runs --daemon (or mode); yields ask(request) -> its decoded JSON answer, one round trip at a time."""
+    proc = subprocess.Popen([str(PARSER), mode, *map(str, args)], cwd=ROOT,
+                            stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+    try:
+        def ask(request):
+            proc.stdin.write(json.dumps(request).encode() + b'\n')
+            proc.stdin.flush()
+            id, length = proc.stdout.readline().split()
+            assert int(id) == request.get('id', 0)
+            return json.loads(proc.stdout.read(int(length)))
+        yield ask
+    finally:
+        proc.stdin.close()
+        proc.wait()
+
+
+def read_frames(out):
+    """Splits "<id> <length>\\n" + payload frames into {id: payload bytes}."""
+    frames = {}
+    while out:
+        header, _, out = out.partition(b'\n')
+        id, length = header.split()
+        frames[int(id)], out = out[:int(length)], out[int(length):]
+    return frames
+
+
+def parse_answer(code, *args, **request):
+    """The daemon's answer to one parse of code (the tree window is 2 levels deep)."""
+    answers = daemon([{'id': 1, 'op': 'parse', 'code': code, 'depth': 2, **request}], *args)
+    return json.loads(answers[1])
+
+
+def chain(terms, op='+'):
+    """main() assigning a flat `1 op 1 op ...` chain of the given length."""
+    return 'int main() { int x = ' + f' {op} '.join(['1'] * terms) + '; return x; }'
+
+
+@contextmanager
+def http_server(*args):
+    """Runs --http on a free port; yields a function (method, path, body, headers) -> (status, type, bytes)."""
+    with socket.socket() as probe:
+        probe.bind(('127.0.0.1', 0))
+        port = probe.getsockname()[1]
+    proc = subprocess.Popen([str(PARSER), '--http', str(port), *map(str, args)], cwd=ROOT,
+                            stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+    try:
+        proc.stdout.readline()  # "Serving on ..." once it listens
+
+        def request(method, path, body=None, headers=None):
+            connection = http.client.HTTPConnection('127.0.0.1', port, timeout=60)
+            connection.request(method, path, body=json.dumps(body) if isinstance(body, dict) else body, headers=headers or {})
+            response = connection.getresponse()
+            result = response.status, response.getheader('Content-Type'), response.read()
+            connection.close()
+            return result
+        request.port = port
+        yield request
+    finally:
+        proc.kill()
+        proc.wait()
+
+
+def expression(node):
+    """An Expr subtree as fully parenthesized infix text."""
+    children = node.get('children', [])
+    if len(children) == 3:
+        op = children[1]['name'].removeprefix('Op: ')
+        return f'({expression(children[0])} {op} {expression(children[2])})'
+    if node['name'] == 'Expr' and len(children) == 1:
+        return children[0]['name'].removeprefix('Value: ')
+    return node['name']
+
+
+def nodes(tree, name):
+    """Every node called name, in preorder."""
+    if tree['name'] == name:
+        yield tree
+    for child in tree.get('children', []):
+        yield from nodes(child, name)
+
+
+def decode_cbor(data):
+    """The subset of CBOR json.hpp writes: definite lengths, no tags."""
+    def item(at):
+        major, info = data[at] >> 5, data[at] & 31
+        at += 1
+        if major == 7:
+            if info in (20, 21, 22):
+                return {20: False, 21: True, 22: None}[info], at
+            size, format = {25: (2, '>e'), 26: (4, '>f'), 27: (8, '>d')}[info]
+            return struct.unpack_from(format, data, at)[0], at + size
+        if info < 24:
+            length = info
+        else:
+            size = 1 << (info - 24)
+            length, at = int.from_bytes(data[at:at + size], 'big'), at + size
+        if major in (0, 1):
+            return (length if major == 0 else -1 - length), at
+        if major in (2, 3):
+            text = data[at:at + length]
+            return (text if major == 2 else text.decode()), at + length
+        values = []
+        for _ in range(length * (2 if major == 5 else 1)):
+            value, at = item(at)
+            values.append(value)
+        return (values if major == 4 else dict(zip(values[::2], values[1::2]))), at
+    return item(0)[0]
+
+
+def decode_msgpack(data):
+    """The subset of MessagePack json.hpp writes."""
+    def item(at):
+        tag = data[at]
+        at += 1
+        def take(size):
+            return int.from_bytes(data[at:at + size], 'big'), at + size
+        def sequence(length, at, pairs):
+            values = []
+            for _ in range(length * (2 if pairs else 1)):
+                value, at = item(at)
+                values.append(value)
+            return (dict(zip(values[::2], values[1::2])) if pairs else values), at
+        if tag < 0x80 or tag >= 0xe0:
+            return (tag if tag < 0x80 else tag - 0x100), at
+        if tag < 0xa0:
+            return sequence(tag & 15, at, pairs=tag < 0x90)
+        if tag < 0xc0:
+            return data[at:at + (tag & 31)].decode(), at + (tag & 31)
+        if tag in (0xc0, 0xc2, 0xc3):
+            return {0xc0: None, 0xc2: False, 0xc3: True}[tag], at
+        if tag in (0xca, 0xcb):
+            size = 4 if tag == 0xca else 8
+            return struct.unpack_from('>f' if size == 4 else '>d', data, at)[0], at + size
+        if 0xcc <= tag <= 0xd3:
+            size = 1 << ((tag - 0xcc) % 4)
+            value, end = take(size)
+            if tag >= 0xd0 and value >= 1 << (8 * size - 1):
+                value -= 1 << (8 * size)
+            return value, end
+        if tag in (0xc4, 0xc5, 0xc6, 0xd9, 0xda, 0xdb):
+            size = {0xc4: 1, 0xc5: 2, 0xc6: 4, 0xd9: 1, 0xda: 2, 0xdb: 4}[tag]
+            length, at = take(size)
+            text = data[at:at + length]
+            return (text if tag < 0xd9 else text.decode()), at + length
+        size = 2 if tag in (0xdc, 0xde) else 4
+        length, at = take(size)
+        return sequence(length, at, pairs=tag >= 0xde)
+    return item(0)[0]
+
+
+def masked(out):
+    """A --pipe document's bytes with its timings removed."""
+    return re.sub(rb'"\w+_ms":[-+.\deE]+,?', b'', out)
+
+
+def outline(node, depth=0):
+    """The tree as indented node names, one per line."""
+    lines = ['  ' * depth + node['name']]
+    for child in node.get('children', []):
+        lines += outline(child, depth + 1)
+    return lines
+
+
+def symbol_lines(doc):
+    return [f"{row['scope']}.{row['name']}: {row['type']}" + (f" = {json.dumps(row['value'])}" if 'value' in row else '')
+            for row in doc['symbols']]
+
+
+def trace_lines(events):
+    return [' '.join([event['action'], *(str(v) for k, v in sorted(event.items()) if k != 'action')]) for event in events]
+
+
+# --- Cases ---
+
+def test_precedence():
+    # Left-associative chains, * / % over + -, comparisons over == !=
+    status, doc = pipe(source('precedence.cpp'))
+    values = {row['name']: row.get('value') for row in doc['symbols']}
+    lines = [f'exit {status}']
+    for decl in nodes(doc['tree'], 'VarDecl'):
+        name = decl['children'][0]['name'].split()[-1]
+        lines.append(f'{name} = {expression(decl["children"][1])} -> {values[name]}')
+    return '\n'.join(lines)
+
+
+def test_interning():
+    # Interned identifiers and literals come back as the same text in the
+    # tree, the symbol table and the trace
+    status, doc = pipe(source('interning.cpp'))
+    return '\n'.join([f'exit {status}', *outline(doc['tree']), '', *symbol_lines(doc), '', *trace_lines(doc['trace'])])
+
+
+def test_keywords():
+    # Keywords are recognized exactly: names a byte longer or shorter than
+    # one, or in another case, are identifiers, and a keyword can't be one
+    status, doc = pipe(source('keywords.cpp'))
+    lines = [f'exit {status}', *outline(doc['tree']), '', *symbol_lines(doc)]
+    for code in (b'int main() { int while = 1; return 0; }', b'int main() { string cout = "x"; return 0; }',
+                 b'int if() { return 0; }', b'int main() { return0; }'):
+        lines.append(f'{code.decode()}: {pipe(code)[1]["errors"]}')
+    return '\n'.join(lines)
+
+
+def test_comments():
+    # // and /* */ comments are skipped anywhere between tokens (the file
+    # ends inside a // comment, with no newline), not inside strings, and
+    # still count lines for positions after them
+    status, doc = pipe(source('comments.cpp'))
+    lines = [f'exit {status}, tokens {doc["stats"]["tokens"]}', *outline(doc['tree']), '', *symbol_lines(doc), '',
+             *trace_lines(doc['trace'])]
+    for code in (b'int main() {\n  /* one\n two\n', b'int main() {\n/* x */ /* y\n*/ return 0 }',
+                 b'int main() { int a = 4 / / 2; }', b'int main() { return 0; } /'):
+        lines.append(f'{code.decode()!r}: {pipe(code)[1]["errors"]}')
+    return '\n'.join(lines)
+
+
+def test_spans():
+    # --spans: each node's [offset, length] covers its own source text,
+    # in bytes from the start of its file (so after a multi-byte
+    # character too); errors carry the line and (byte) column they
+    # occurred at
+    lines = []
+
+    def spans(node, code, depth=0):
+        offset, length = node['span']
+        lines.append('  ' * depth + f'{node["name"]} [{offset}, {length}] {code[offset:offset + length].decode()!r}')
+        for child in node.get('children', []):
+            spans(child, code, depth + 1)
+
+    code = b'int main() {\n    string s = "\xc3\xa9t\xc3\xa9";\n    int x = 1 + 2 * 3;\n    return x;\n}\n'
+    status, doc = pipe(code, '--spans')
+    lines.append(f'exit {status}')
+    spans(doc['tree'], code)
+    with tempfile.TemporaryDirectory() as dir:
+        # Offsets restart in each file
+        (Path(dir) / 'a.cpp').write_bytes(b'int f() { return 1; }\n')
+        (Path(dir) / 'b.cpp').write_bytes(b'int main() { return f(); }\n')
+        status, doc = pipe(b'', '--spans', Path(dir) / 'a.cpp', Path(dir) / 'b.cpp')
+        for file, name in zip(doc['tree']['children'], ('a.cpp', 'b.cpp')):
+            lines.append(name)
+            spans(file['children'][0], (Path(dir) / name).read_bytes(), 1)
+    for code in (b'int main() {\n    int x = 1\n    return x;\n}\n', b'int main() {\n\n  string s = "\xc3\xa9", t = 1;\n}',
+                 b'int main() {\n  string s = "open\n}\n'):
+        lines.append(f'{code.decode()!r}: {pipe(code)[1]["errors"]}')
+    return '\n'.join(lines)
+
+
+def test_locate():
+    # The daemon's locate against a scan of the whole tree: at every byte
+    # offset the innermost node covering it and its ancestors (the root
+    # between functions, none past the end), and for ranges the overlapping nodes in preorder,
+    # cut at limit
+    code = source('multi_helper.cpp') + source('precedence.cpp').replace(b'int main', b'int main2')
+    lines = []
+    with daemon_process() as ask:
+        tree = ask({'op': 'parse', 'id': 1, 'code': code.decode(), 'depth': 1000, 'limit': 100000, 'budget': 100000})['tree']
+        spans = []  # (id, offset, end, path), preorder
+
+        def index(node, path):
+            offset, length = node['span']
+            spans.append((node['id'], offset, offset + length, path))
+            for child in node.get('children', []):
+                index(child, path + [node['id']])
+        index(tree, [])
+        lines.append(f'{len(spans)} nodes, {len(code)} bytes')
+        mismatches = 0
+        for offset in range(len(code) + 1):
+            covering = [(id, path) for id, start, end, path in spans if start <= offset < end]
+            id, path = covering[-1] if covering else (None, [])
+            answer = ask({'op': 'locate', 'id': 2, 'doc': 1, 'offset': offset})
+            if (answer['node'], answer['path']) != (id, path):
+                mismatches += 1
+                if mismatches <= 5:
+                    lines.append(f'offset {offset}: got {answer}, expected node {id} path {path}')
+        lines.append(f'locate at every offset: {mismatches} mismatches')
+        for offset, end, limit in ((0, 1, 10), (0, len(code), 5), (40, 120, 1000), (len(code), len(code) + 10, 5)):
+            overlapping = [id for id, start, stop, _ in spans if start < end and offset < stop]
+            answer = ask({'op': 'locate', 'id': 3, 'doc': 1, 'offset': offset, 'end': end, 'limit': limit})
+            expected = (overlapping[:limit], len(overlapping) > limit)
+            got = (answer['nodes'], answer.get('more', False))
+            lines.append(f'[{offset}, {end}) limit {limit}: {len(overlapping)} nodes, ' + ('same' if got == expected else f'got {got}'))
+        lines.append(f'closed doc: {ask({"op": "locate", "id": 4, "doc": 7, "offset": 0})}')
+    return '\n'.join(lines)
+
+
+def test_recovery():
+    # One run reports every syntax error, each diagnostic's span pointing at
+    # the token where it was found, and keeps the tree around them; the
+    # program isn't run. --max-errors caps the list, and file-writing runs
+    # fail without writing
+    code = source('recovery.cpp')
+    status, doc = pipe(code)
+    lines = [f'exit {status}, trace {doc["trace"]}', *outline(doc['tree']), '']
+    for diagnostic in doc['diagnostics']:
+        offset, length = diagnostic['span']
+        lines.append(f'{diagnostic["message"]}: {code[offset:offset + length].decode()!r}')
+    lines.append(f'errors same as diagnostics: {doc["errors"] == [d["message"] for d in doc["diagnostics"]]}')
+    for limit in (1, 2):
+        status, doc = pipe(code, '--max-errors', limit)
+        lines.append(f'--max-errors {limit}: exit {status}, {len(doc["errors"])} errors, tree {"kept" if doc["tree"] else "null"}')
+    with tempfile.TemporaryDirectory() as out:
+        status, _ = run('-o', out, 'tests/cases/recovery.cpp')
+        lines.append(f'-o: exit {status}, files {sorted(os.listdir(out))}')
+    return '\n'.join(lines)
+
+
+def test_typed_values():
+    # Constant initializers in the symbol table and conditions at run time
+    # agree on int wrapping, truncation, division by zero, doubles and
+    # string comparison; an operation a type doesn't support is no value
+    status, doc = pipe(source('typed.cpp'))
+    events = [event for event in doc['trace'] if event['action'] != 'vardecl']
+    return '\n'.join([f'exit {status}', *symbol_lines(doc), '', *trace_lines(events)])
+
+
+def test_multi_file():
+    # Several files parse into one program with a "File: <path>" subtree
+    # each, calls resolve across them, and -o picks the output directory;
+    # an empty file and a missing one
+    with tempfile.TemporaryDirectory() as out:
+        status, _ = run('-o', out, 'tests/cases/multi_main.cpp', 'tests/cases/multi_helper.cpp')
+        lines = [f'exit {status}: {" ".join(sorted(os.listdir(out)))}']
+        tree = json.loads(Path(out, 'tree.json').read_text())
+        lines += outline(tree)
+        lines += trace_lines(json.loads(Path(out, 'trace.json').read_text()))
+        Path(out, 'empty.cpp').write_bytes(b'')
+        status, doc = pipe(b'', Path(out, 'empty.cpp'))
+        lines.append(f'empty file: exit {status}, {outline(doc["tree"])}')
+    status, doc = pipe(b'', 'tests/cases/missing.cpp')
+    lines.append(f'missing file: exit {status}, {doc["errors"]}')
+    return '\n'.join(lines)
+
+
+def test_batch():
+    # --batch over a directory (only .cpp/.cc/.cxx, mirrored under -o) and
+    # over a list file; the outputs are the same at any -j and a bad file
+    # only fails itself
+    with tempfile.TemporaryDirectory() as work:
+        work = Path(work)
+        (work / 'src' / 'sub').mkdir(parents=True)
+        (work / 'src' / 'precedence.cpp').write_bytes(source('precedence.cpp'))
+        (work / 'src' / 'sub' / 'helper.cc').write_bytes(source('multi_helper.cpp'))
+        (work / 'src' / 'sub' / 'bad.cxx').write_bytes(b'int main( {\n')
+        (work / 'src' / 'notes.txt').write_bytes(b'not a source file\n')
+        (work / 'list.txt').write_text(f"{work / 'src' / 'precedence.cpp'}\n{work / 'src' / 'sub' / 'bad.cxx'}\n")
+        lines = []
+        for input in ('src', 'list.txt'):
+            outputs = {}
+            for threads in (1, 4):
+                out = work / f'out-{input}-{threads}'
+                status, _ = run('--batch', work / input, '-j', threads, '-o', out)
+                files = {str(path.relative_to(out)): path.read_bytes() for path in sorted(out.rglob('*')) if path.is_file()}
+                summary = strip_timings(json.loads(files.pop('summary.json')))
+                summary.pop('threads')
+                outputs[threads] = status, files, summary
+            status, files, summary = outputs[1]
+            lines.append(f'--batch {input}: exit {status}, -j 4 {"same" if outputs[4] == outputs[1] else "differs"}')
+            lines += sorted(files)
+            lines.append(show(summary).replace(str(work), '<tmp>'))
+    return '\n'.join(lines)
+
+
+def test_pipe():
+    # --pipe: one document on stdout from stdin, "-" or a path, all alike;
+    # a syntax error still writes it (errors set, exit status 1)
+    lines = []
+    code = source('multi_helper.cpp')
+    status, doc = pipe(code)
+    lines.append(f'stdin: exit {status}, keys {sorted(doc)}, stats {sorted(strip_timings(doc["stats"]).items())}')
+    for args in (('-',), ('tests/cases/multi_helper.cpp',)):
+        other = pipe(code, *args)
+        lines.append(f'{args[0]}: {"same" if strip_timings(other[1]) == strip_timings(doc) and other[0] == status else show(other[1])}')
+    status, doc = pipe(b'int main() { return 0 }')
+    lines.append(f'parse error: exit {status}')
+    lines.append(show(doc))
+    # Source text need not be UTF-8; invalid bytes come out as U+FFFD
+    for name, code in (('invalid UTF-8 in a string', b'int main() { string s = "a\xffb"; return 0; }'),
+                       ('stray byte', b'int main() { int \xc3\xa9 = 1; }')):
+        status, doc = pipe(code)
+        lines.append(f'{name}: exit {status}, symbols {[s.get("value") for s in doc["symbols"]]}, errors {doc["errors"]}')
+    return '\n'.join(lines)
+
+
+def test_formats():
+    # --format cbor / msgpack carry the same document as JSON, in --pipe
+    # and in the file outputs; --http /parse picks the format from Accept
+    code = source('interning.cpp')
+    status, doc = pipe(code)
+    lines = []
+    for format, decode in (('cbor', decode_cbor), ('msgpack', decode_msgpack)):
+        other_status, out = run('--pipe', '--format', format, input=code)
+        same = other_status == status and strip_timings(decode(out)) == strip_timings(doc)
+        lines.append(f'--pipe --format {format}: {"same as json" if same else show(decode(out))}')
+        with tempfile.TemporaryDirectory() as dir:
+            run('--format', format, '-o', dir, 'tests/cases/interning.cpp')
+            names = sorted(os.listdir(dir))
+            tree = decode(Path(dir, f'tree.{format}').read_bytes())
+            lines.append(f'  files {" ".join(names)}, tree {"same" if tree == doc["tree"] else "differs"}')
+    with http_server('-j', 1) as request:
+        for accept in (None, '*/*', 'application/cbor', 'application/cbor;q=0.5, application/json',
+                       'application/msgpack, application/cbor;q=0.9'):
+            status, type, body = request('POST', '/parse', {'code': code.decode()}, {'Accept': accept} if accept else {})
+            decoded = {'application/json': json.loads, 'application/cbor': decode_cbor, 'application/msgpack': decode_msgpack}[type](body)
+            lines.append(f'Accept {accept}: {status} {type}, symbols {len(decoded["symbols"])}')
+    return '\n'.join(lines)
+
+
+def test_layout():
+    # --layout: y is the depth, nodes on one level keep at least a unit
+    # apart in preorder, and a parent sits centred over its children
+    status, doc = pipe(source('multi_helper.cpp'), '--layout')
+    lines = [f'exit {status}']
+    levels = {}
+
+    def walk(node, depth):
+        children = node.get('children', [])
+        lines.append(f"{'  ' * depth}{node['name']} ({node['x']:g}, {node['y']})")
+        levels.setdefault(depth, []).append(node['x'])
+        assert node['y'] == depth, node
+        if children:
+            assert abs(node['x'] - (children[0]['x'] + children[-1]['x']) / 2) <= 0.01, node  # x has 2 decimals
+        for child in children:
+            walk(child, depth + 1)
+    walk(doc['tree'], 0)
+    for depth, xs in levels.items():
+        assert all(b - a >= 0.99 for a, b in zip(xs, xs[1:])), (depth, xs)
+    return '\n'.join(lines)
+
+
+def test_paging():
+    # A parse answers a window (depth levels, limit children per node);
+    # paging the rest in with subtree rebuilds exactly the --pipe tree
+    code = source('interning.cpp')
+    full = pipe(code)[1]['tree']
+    lines = []
+    with daemon_process() as ask:
+        answer = ask({'id': 1, 'op': 'parse', 'code': code.decode(), 'depth': 1, 'limit': 2, 'trace': False})
+        lines.append('window: ' + json.dumps(answer['tree'], sort_keys=True))
+        requests = 0
+
+        def fill(node):
+            nonlocal requests
+            node.setdefault('children', [])
+            while len(node['children']) < node.get('childCount', len(node['children'])):
+                requests += 1
+                page = ask({'id': 2, 'op': 'subtree', 'doc': answer['doc'], 'node': node['id'],
+                            'depth': 1, 'limit': 2, 'offset': len(node['children'])})['tree']
+                assert page['id'] == node['id'] and page['children'], page
+                node['children'] += page['children']
+            for child in node['children']:
+                fill(child)
+        fill(answer['tree'])
+        lines.append(f'subtree requests: {requests}, rebuilt tree {"matches" if outline(answer["tree"]) == outline(full) else "differs"}')
+        ids = []
+        def preorder(node):
+            ids.append(node['id'])
+            for child in node['children']:
+                preorder(child)
+        preorder(answer['tree'])
+        lines.append(f'ids are preorder: {ids == list(range(len(ids)))}')
+        for bad in ({'doc': 99, 'node': 0}, {'doc': answer['doc'], 'node': len(ids)}):
+            lines.append(f'subtree {bad}: {ask({"id": 3, "op": "subtree", **bad})}')
+        ask({'id': 4, 'op': 'close', 'doc': answer['doc']})
+        lines.append(f'after close: {ask({"id": 5, "op": "subtree", "doc": answer["doc"], "node": 0})}')
+    return '\n'.join(lines)
+
+
+def test_svg():
+    # --svg: well-formed SVG with one circle per node, text escaped; "-"
+    # writes to stdout, a path writes the file
+    lines = []
+    for name, code in (('escaping', b'int main() { string s = "<a & b>"; return 0; }'), ('helper', source('multi_helper.cpp'))):
+        status, svg = run('--svg', '-', '-', input=code)
+        root = ElementTree.fromstring(svg)
+        circles = sum(1 for _ in root.iter('{http://www.w3.org/2000/svg}circle'))
+        lines.append(f'{name}: exit {status}, {circles} circles for {pipe(code)[1]["stats"]["nodes"]} nodes')
+        lines += svg.decode().splitlines() if name == 'helper' else [line for line in svg.decode().splitlines() if '&amp;' in line]
+    with tempfile.TemporaryDirectory() as out:
+        status, _ = run('--svg', Path(out, 'tree.svg'), 'tests/cases/multi_helper.cpp')
+        lines.append(f'to a file: exit {status}, same as stdout: {Path(out, "tree.svg").read_bytes() == svg}')
+    return '\n'.join(lines)
+
+
+def slow_code():
+    """A program that takes the parser most of a second."""
+    return 'int main() { int x = 0; ' + 'x = x + 1; ' * 300000 + 'return x; }'
+
+
+def test_cancel():
+    # The daemon's cancel op stops a queued or running request, which then
+    # answers Cancelled; the HTTP server cancels a client's parse when the
+    # same client sends a new one
+    lines = []
+    answers = daemon([{'id': 1, 'op': 'parse', 'code': slow_code(), 'depth': 1},
+                      {'id': 2, 'op': 'cancel', 'target': 1},
+                      {'id': 3, 'op': 'cancel', 'target': 1},
+                      {'id': 4, 'op': 'parse', 'code': 'int main() { return 0; }', 'depth': 0},
+                      {'id': 5, 'op': 'stats'}])
+    for id, answer in sorted(answers.items()):
+        answer = json.loads(answer)
+        answer.pop('runs', None)  # whether the cancel found request 1 queued or running
+        lines.append(f'{id}: ' + (f'doc {answer["doc"]}' if 'doc' in answer else json.dumps(answer, sort_keys=True)))
+    with http_server('-j', 2) as request:
+        result = {}
+        first = threading.Thread(target=lambda: result.update(first=request('POST', '/parse', {'code': slow_code(), 'client': 'tab'})))
+        first.start()
+        time.sleep(0.3)
+        status, type, answer = request('POST', '/parse', {'code': 'int main() { return 0; }', 'client': 'tab'})
+        first.join()
+        lines.append(f'http first: {result["first"][0]} {result["first"][2].decode()}')
+        lines.append(f'http second: {status}, symbols {len(json.loads(answer)["symbols"])}')
+        lines.append(f'http stats: cancelled {json.loads(request("GET", "/stats")[2])["cancelled"]}')
+    return '\n'.join(lines)
+
+
+def test_coalescing():
+    # An identical parse sent while one is running shares its run and its
+    # doc, in whatever format it asked for; the doc stays open until both
+    # closed it. A different window is a run of its own.
+    slow = {'op': 'parse', 'code': slow_code(), 'depth': 1, 'layout': True, 'trace': False}
+    # Sent in one write, so 2 arrives while 1 is still running.
+    requests = [{'id': 1, **slow}, {'id': 2, **slow, 'format': 'cbor'}]
+    lines = []
+    answers = daemon(requests + [{'id': 3, **slow, 'depth': 2}, {'id': 4, 'op': 'stats'}])
+    for id, payload in sorted(answers.items()):
+        answer = decode_cbor(payload) if id == 2 else json.loads(payload)
+        lines.append(f'{id}: doc {answer["doc"]}' if id < 4 else f'{id}: {json.dumps(answer, sort_keys=True)}')
+    closes = [{'id': 10 + i, 'op': 'close', 'doc': 1} for i in range(2)]
+    probes = [{'id': 20 + i, 'op': 'subtree', 'doc': 1, 'node': 0, 'depth': 0} for i in range(2)]
+    answers = daemon(requests + [r for pair in zip(closes, probes) for r in pair])
+    for id in (20, 21):
+        lines.append(f'after {id - 19} close(s): {json.loads(answers[id]).get("error", "open")}')
+    return '\n'.join(lines)
+
+
+def test_supervisor():
+    # --supervisor: a request that crashes the parser only takes down its
+    # worker, which is replaced; its documents are gone, the others answer
+    # as before. Identical parses are coalesced before reaching a worker.
+    crash = 'int main() { int x = ' + ' + '.join(['1'] * 200000) + '; return x; }'  # too deep for the stack
+    small = 'int main() { return 0; }'
+    lines = []
+    with daemon_process('-j', 1, '--max-expr-depth', 0, mode='--supervisor') as ask:
+        doc = ask({'id': 1, 'op': 'parse', 'code': small, 'depth': 0})['doc']
+        lines.append(f'parse: generation {doc >> 32}, doc {doc & 0xffffffff}')
+        lines.append(f'crash: {ask({"id": 2, "op": "parse", "code": crash, "depth": 0})}')
+        lines.append(f'old doc: {ask({"id": 3, "op": "subtree", "doc": doc, "node": 0, "depth": 0})}')
+        doc = ask({'id': 4, 'op': 'parse', 'code': small, 'depth': 0})['doc']
+        lines.append(f'parse: generation {doc >> 32}, doc {doc & 0xffffffff}')
+        lines.append(f'subtree: {ask({"id": 5, "op": "subtree", "doc": doc, "node": 0, "depth": 0})["tree"]["name"]}')
+        stats = ask({'id': 6, 'op': 'stats'})
+        lines.append(f'stats: {json.dumps({k: stats[k] for k in ("crashes", "spawned", "workers")})}')
+    slow = {'op': 'parse', 'code': slow_code(), 'depth': 0, 'trace': False}
+    requests = [{'id': 1, **slow}, {'id': 2, **slow, 'format': 'msgpack'}, {'id': 3, 'op': 'stats'}]
+    status, out = run('--supervisor', '-j', 2, input=b''.join(json.dumps(r).encode() + b'\n' for r in requests))
+    answers = read_frames(out)
+    docs = json.loads(answers[1])['doc'], decode_msgpack(answers[2])['doc']
+    lines.append(f'identical parses: same doc {docs[0] == docs[1]}, coalesced {json.loads(answers[3])["coalesced"]}')
+    return '\n'.join(lines)
+
+
+def test_step():
+    # step runs the program lazily: the events it pages out equal the eager
+    # trace, restart starts over, and a program that never ends can still
+    # be stepped since nothing past the requested events is simulated
+    code = source('multi_main.cpp').decode() + source('multi_helper.cpp').decode()
+    recursive = 'int f() { f(); return 0; } int main() { f(); return 0; }'
+    lines = []
+    with daemon_process() as ask:
+        answer = ask({'id': 1, 'op': 'parse', 'code': code, 'depth': 0})
+        eager, doc = answer['trace'], answer['doc']
+        stepped, pages = [], []
+        while True:
+            page = ask({'id': 2, 'op': 'step', 'doc': doc, 'count': 4})
+            stepped += page['events']
+            pages.append(len(page['events']))
+            if page['done']:
+                break
+        lines.append(f'pages {pages}, same as the eager trace: {stepped == eager}')
+        page = ask({'id': 3, 'op': 'step', 'doc': doc, 'count': 2, 'restart': True})
+        lines.append(f'restart: {trace_lines(page["events"])}, done {page["done"]}')
+        doc = ask({'id': 4, 'op': 'parse', 'code': recursive, 'depth': 0, 'trace': False})['doc']
+        for _ in range(2):
+            page = ask({'id': 5, 'op': 'step', 'doc': doc, 'count': 3})
+            lines.append(f'runaway: {trace_lines(page["events"])}, done {page["done"]}')
+    return '\n'.join(lines)
+
+
+def test_parallel_lex():
+    # Inputs of 512 KB and more are lexed in chunks at -j N; the document is
+    # the same at any N, also when a block comment or a string literal full
+    # of "#" lines, braces and quotes runs across chunk boundaries, and a
+    # late lexer error is reported at the same place
+    block = source('multi_helper.cpp').decode()
+    functions = ''.join(block.replace('helper', f'helper_{i}') for i in range(4000))  # about 290 KB
+    noise = '#define X {\n} "quoted" // not a comment\n' * 8000  # about 330 KB
+    inputs = {
+        'plain': functions + functions,
+        'block comment': functions + '/*\n' + noise + '*/\n' + functions,
+        'string literal': functions + 'int main() { string s = "\n' + noise.replace('"', "'") + '"; return 0; }\n' + functions,
+        'late lexer error': functions + functions + 'int bad = `;\n',
+    }
+    lines = []
+    for name, code in inputs.items():
+        # Compared as bytes with the timings masked: decoding is the slow part.
+        outputs = {threads: run('--pipe', '-j', threads, input=code.encode()) for threads in (1, 2, 4, 8)}
+        outputs = {threads: (status, masked(out)) for threads, (status, out) in outputs.items()}
+        status, out = outputs[1]
+        stats = json.loads(re.search(rb'"stats":(\{[^{}]*\})', out).group(1))
+        errors = json.loads(re.search(rb'"errors":(\[[^]]*\])', out).group(1))
+        same = [threads for threads in (2, 4, 8) if outputs[threads] == outputs[1]]
+        lines.append(f'{name}: {len(code):,} bytes, exit {status}, tokens {stats["tokens"]}, errors {errors}; same at -j {same}')
+    return '\n'.join(lines)
+
+
+def test_simd():
+    # --simd scalar, sse2 and avx2 lex every input identically: runs of
+    # each length around the 8-byte scalar prefix and the 16/32-byte
+    # blocks, at every alignment, plus lexer errors. Kernel sets this CPU
+    # lacks are skipped, so the expected output is the same everywhere.
+    inputs = {}
+    for length in (1, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 200):
+        for pad in range(4):
+            name = 'v' + 'x' * (length - 1)
+            inputs[f'runs {length}+{pad}'] = (' ' * pad + f'#pragma {"p" * length}\nint main() {{ int {name} = {"7" * min(length, 9)};\n' +
+                                              ' ' * length + f'string t{pad} = "{"a" * length}\\{"é" * pad}";\n'
+                                              f'/*{"*" * length}*/ // {"c" * length}\nreturn 0; }}\n')
+    inputs['program'] = source('interning.cpp').decode()
+    inputs['unterminated string'] = 'int main() { string s = "' + 'a' * 100
+    inputs['unterminated comment'] = 'int main() { return 0; } /*' + ' ' * 100
+    inputs['bad byte'] = 'int main() { int x = 1' + ' ' * 40 + '@; }'
+    inputs['stray non-ASCII byte'] = 'int main() { int x = 1' + ' ' * 40 + 'é; }'
+    lines = []
+    run_tokens = 0
+    for name, code in inputs.items():
+        outputs = {}
+        for kernels in ('scalar', 'sse2', 'avx2'):
+            status, out = run('--simd', kernels, '--pipe', input=code.encode())
+            if out:  # no document: not available here
+                outputs[kernels] = status, masked(out)
+        agree = all(output == outputs['scalar'] for output in outputs.values())
+        status, out = outputs['scalar']
+        stats = json.loads(re.search(rb'"stats":(\{[^{}]*\})', out).group(1))
+        if name.startswith('runs') and agree and not status:
+            run_tokens += stats['tokens']
+            continue
+        lines.append(f'{name}: exit {status}, tokens {stats["tokens"]}, ' + ('kernels agree' if agree else f'differ: {outputs}'))
+    lines.append(f'{sum(name.startswith("runs") for name in inputs)} run inputs, {run_tokens} tokens: kernels agree unless listed')
+    return '\n'.join(lines)
+
+
+def test_limits():
+    # A flat chain is a loop in the parser, not nesting: it only counts
+    # against --max-expr-depth, while real nesting still hits --max-depth
+    lines = []
+    for terms in (1500, 5000, 10001, 10002):
+        answer = parse_answer(chain(terms))
+        if answer['tree']:
+            lines.append(f'chain of {terms}: nodes {answer["stats"]["nodes"]} x = {answer["symbols"][-1]["value"]}')
+        else:
+            lines.append(f'chain of {terms}: {answer["errors"]}')
+    calls = 'int main() { int x = ' + 'f(' * 1001 + '1' + ')' * 1001 + '; return x; }'
+    lines.append(f'calls nested 1001 deep: {parse_answer(calls)["errors"]}')
+    for ifs in (500, 501):
+        # an if and its block are a level each
+        blocks = 'int main() { ' + 'if (1) { ' * ifs + '}' * ifs + ' return 0; }'
+        lines.append(f'ifs nested {ifs} deep: {parse_answer(blocks)["errors"]}')
+    lines.append(f'chain of 100, --max-expr-depth 50: {parse_answer(chain(100), "--max-expr-depth", 50)["errors"]}')
+    lines.append(f'--max-tokens 10: {parse_answer(chain(100), "--max-tokens", 10)["errors"]}')
+    status, doc = pipe(chain(100).encode(), '--max-nodes', 100)
+    lines.append(f'--pipe --max-nodes 100: exit {status} {doc["errors"]}')
+    status, doc = pipe(chain(100).encode(), '--max-output', 100)
+    errors = [re.sub(r'\d+ bytes', 'N bytes', e) for e in doc['errors']]  # the size includes timings
+    lines.append(f'--pipe --max-output 100: exit {status} {errors}')
+    return '\n'.join(lines)
+
+
+def test_trace_stream():
+    # --trace-ndjson - - and the HTTP /trace-stream route: the trace as
+    # NDJSON, and a failed parse or run ends the stream with an error line
+    loop = b'int main() { int x = 1; while (x < 3) { x = x + 1; } return x; }'
+    broken = b'int main() { x = ; }'
+    recursive = b'int f() { f(); return 0; } int main() { f(); return 0; }'
+    lines = []
+    for name, code in (('loop', loop), ('syntax error', broken), ('runaway recursion', recursive)):
+        status, out = run('--trace-ndjson', '-', '-', input=code)
+        lines.append(f'cli {name}: exit {status}')
+        lines += out.decode().splitlines()[-3:]
+    with http_server('-j', 1) as request:
+        for name, code in (('loop', loop), ('syntax error', broken), ('runaway recursion', recursive)):
+            status, type, body = request('POST', '/trace-stream', {'code': code.decode()})
+            lines.append(f'http {name}: {status} {type}')
+            lines += body.decode().splitlines()[-3:]
+    return '\n'.join(lines)
+
+
+def test_pipeline():
+    # --pipeline N gives the same document as lexing first, including when
+    # the lexer fails after the parser has already consumed symbols
+    lines = []
+    for name in ('precedence.cpp', 'lexer_error.cpp'):
+        status, doc = pipe(source(name))
+        lines.append(f'{name}: exit {status}')
+        if status:
+            lines.append(show(doc))
+        for ring in (1, 64, 4096):
+            other = pipe(source(name), '--pipeline', ring)
+            same = other[0] == status and strip_timings(other[1]) == strip_timings(doc)
+            lines.append(f'--pipeline {ring}: {"same" if same else show(other[1])}')
+    return '\n'.join(lines)
+
+
+def test_http_routes():
+    # --http: static files from memory, the JSON routes, error statuses, and
+    # several pipelined requests on one keep-alive connection
+    lines = []
+    with http_server('-j', 2) as request:
+        for method, path, body in (('GET', '/', None), ('GET', '/script.js', None), ('HEAD', '/style.css', None),
+                                   ('GET', '/nope', None), ('PUT', '/parse', None), ('POST', '/nope', {})):
+            status, type, answer = request(method, path, body)
+            if status == 200:
+                file = (ROOT / (path[1:] or 'index.html')).read_bytes()
+                answer = 'the file' if answer == file else 'no body' if method == 'HEAD' and not answer else answer
+            lines.append(f'{method} {path}: {status} {type} {answer if status == 200 else answer.decode()}')
+        doc = json.loads(request('POST', '/parse', {'code': source('multi_main.cpp').decode()})[2])['doc']
+        for path, body in (('/subtree', {'doc': doc, 'node': 3, 'depth': 1}),
+                           ('/step', {'doc': doc, 'count': 2}),
+                           ('/locate', {'doc': doc, 'offset': 60})):
+            status, type, answer = request('POST', path, body)
+            lines.append(f'POST {path}: {status} {json.dumps(json.loads(answer), sort_keys=True)}')
+        # Three requests in one write on one connection, answered in order.
+        with socket.create_connection(('127.0.0.1', request.port)) as connection:
+            connection.sendall(b'GET /stats HTTP/1.1\r\n\r\n' * 2 + b'GET /nope HTTP/1.1\r\nConnection: close\r\n\r\n')
+            received = b''
+            while chunk := connection.recv(1 << 16):
+                received += chunk
+        lines.append('pipelined: ' + ', '.join(re.findall(rb'HTTP/1.1 (\d+)', received)[i].decode() for i in range(3)) +
+                     ', then ' + ('closed' if received.endswith(b'}') else 'more'))
+    return '\n'.join(lines)
+
+
+def test_http_queue():
+    # --http: parses run on the worker pool behind --max-queue, so /stats is
+    # answered during one and a parse past the bound is shed with 503; a
+    # body that is not the expected JSON is a 400
+    lines = []
+    with http_server('-j', 1, '--max-queue', 1) as request:
+        for body in (b'not json', {'source': 'int main() {}'}):
+            status, type, answer = request('POST', '/parse', body)
+            lines.append(f'bad body: {status} {json.loads(answer)["error"].split(":")[0]}')
+        slow = {'code': slow_code()}
+        result = {}
+        worker = threading.Thread(target=lambda: result.update(slow=request('POST', '/parse', slow)))
+        worker.start()
+        time.sleep(0.3)
+        status, type, answer = request('GET', '/stats')
+        lines.append(f'stats during the parse: {status}, slow parse done: {"slow" in result}')
+        status, type, answer = request('POST', '/parse', {'code': 'int main() { return 0; }'})
+        lines.append(f'second parse: {status} {answer.decode()}')
+        worker.join()
+        lines.append(f'slow parse: {result["slow"][0]}')
+        stats = json.loads(request('GET', '/stats')[2])
+        lines.append(f'stats: requests {stats["requests"]}, runs {stats["runs"]}, shed {stats["shed"]}')
+    return '\n'.join(lines)
+
+
+# --- Runner ---
+
+def main(argv):
+    update = '--update' in argv
+    wanted = [arg for arg in argv if arg != '--update']
+    build()
+    tests = [(name[5:], fn) for name, fn in globals().items() if name.startswith('test_') and callable(fn)]
+    failed = 0
+    for name, fn in tests:
+        if wanted and not any(w in name for w in wanted):
+            continue
+        expected = EXPECTED / f'{name}.txt'
+        try:
+            actual = fn().rstrip('\n') + '\n'
+        except Exception as e:
+            print(f'FAIL {name}: {type(e).__name__}: {e}')
+            failed += 1
+            continue
+        if update:
+            expected.write_text(actual)
+            print(f'wrote {expected.relative_to(ROOT)}')
+        elif not expected.exists() or expected.read_text() != actual:
+            print(f'FAIL {name}: output differs from {expected.relative_to(ROOT)}:')
+            print(actual)
+            failed += 1
+        else:
+            print(f'ok   {name}')
+    if failed:
+        print(f'{failed} failed')
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))